@@ -0,0 +1,325 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "batch.h"
+
+// How many jobs a worker runs at once, switching between them
+// every time slice
+#define LOLVM_BATCH_SLOTS 4
+
+/*
+ * Chase-Lev work-stealing deque of job indices. The owner pushes and pops
+ * at the bottom, other workers steal from the top.
+ * Jobs are only ever pushed before the workers start, so the buffer
+ * never has to grow.
+ */
+struct lolvm_deque {
+	_Atomic int64_t top;
+	_Atomic int64_t bottom;
+	_Atomic size_t *buf;
+	int64_t mask;
+};
+
+static int lolvm_deque_init(struct lolvm_deque *d, size_t capacity)
+{
+	size_t size = 1;
+	while (size < capacity) {
+		size *= 2;
+	}
+
+	atomic_init(&d->top, 0);
+	atomic_init(&d->bottom, 0);
+	d->mask = size - 1;
+	d->buf = malloc(size * sizeof(*d->buf));
+	return d->buf ? 0 : -1;
+}
+
+static void lolvm_deque_push(struct lolvm_deque *d, size_t job)
+{
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+	atomic_store_explicit(&d->buf[b & d->mask], job, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+static int lolvm_deque_pop(struct lolvm_deque *d, size_t *job)
+{
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+	if (t > b) {
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		return 0;
+	}
+
+	*job = atomic_load_explicit(&d->buf[b & d->mask], memory_order_relaxed);
+	if (t == b) {
+		// Last job; race any thieves for it
+		int won = atomic_compare_exchange_strong_explicit(
+			&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+		atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+		return won;
+	}
+
+	return 1;
+}
+
+static int lolvm_deque_steal(struct lolvm_deque *d, size_t *job)
+{
+	int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+	if (t >= b) {
+		return 0;
+	}
+
+	*job = atomic_load_explicit(&d->buf[t & d->mask], memory_order_relaxed);
+	return atomic_compare_exchange_strong_explicit(
+		&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+// A VM which runs one job after another, with its own output buffer
+struct lolvm_batch_slot {
+	struct lolvm vm;
+	int have_vm;
+	int busy;
+	FILE *out;
+	char *buf;
+	size_t size;
+};
+
+struct lolvm_batch;
+
+struct lolvm_batch_worker {
+	struct lolvm_batch *batch;
+	int index;
+	pthread_t thread;
+	struct lolvm_deque deque;
+	struct lolvm_batch_slot slots[LOLVM_BATCH_SLOTS];
+	uint64_t slices;
+	uint64_t steals;
+	int failed;
+};
+
+struct lolvm_batch {
+	struct lolvm_program *prog;
+	const struct lolvm_batch_options *opts;
+	struct lolvm_batch_worker *workers;
+	int nworkers;
+
+	// Jobs which haven't finished yet
+	_Atomic size_t remaining;
+};
+
+static int lolvm_batch_take(struct lolvm_batch_worker *w, size_t *job)
+{
+	if (lolvm_deque_pop(&w->deque, job)) {
+		return 1;
+	}
+
+	struct lolvm_batch *batch = w->batch;
+	for (int i = 1; i < batch->nworkers; ++i) {
+		struct lolvm_batch_worker *victim = &batch->workers[(w->index + i) % batch->nworkers];
+		if (lolvm_deque_steal(&victim->deque, job)) {
+			w->steals += 1;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int lolvm_batch_start(struct lolvm_batch_worker *w, struct lolvm_batch_slot *slot)
+{
+	const struct lolvm_batch_options *opts = w->batch->opts;
+	if (!slot->have_vm) {
+		if (lolvm_init(&slot->vm, w->batch->prog, opts->stack_size, opts->callstack_size) < 0) {
+			return -1;
+		}
+
+		slot->have_vm = 1;
+		slot->vm.out.file = slot->out;
+		slot->vm.out.binary = opts->binary;
+	} else if (!opts->snapshot) {
+		lolvm_reset(&slot->vm);
+	}
+
+	if (opts->snapshot && lolvm_snapshot_restore(&slot->vm, opts->snapshot) < 0) {
+		return -1;
+	}
+
+	slot->busy = 1;
+	return 0;
+}
+
+static void lolvm_batch_finish(struct lolvm_batch_worker *w, struct lolvm_batch_slot *slot)
+{
+	FILE *out = w->batch->opts->out;
+	lolvm_flush(&slot->vm);
+	long len = ftell(slot->out);
+	if (out && len > 0) {
+		fwrite(slot->buf, 1, len, out);
+	}
+
+	rewind(slot->out);
+	slot->busy = 0;
+	atomic_fetch_sub(&w->batch->remaining, 1);
+}
+
+static void *lolvm_batch_worker_main(void *arg)
+{
+	struct lolvm_batch_worker *w = arg;
+	struct lolvm_batch *batch = w->batch;
+	int active = 0;
+	int cur = 0;
+
+	while (1) {
+		// Fill any free slots with new jobs
+		for (int i = 0; i < LOLVM_BATCH_SLOTS && active < LOLVM_BATCH_SLOTS; ++i) {
+			size_t job;
+			if (w->slots[i].busy || !lolvm_batch_take(w, &job)) {
+				continue;
+			}
+
+			if (lolvm_batch_start(w, &w->slots[i]) < 0) {
+				w->failed = 1;
+				atomic_fetch_sub(&batch->remaining, 1);
+				continue;
+			}
+
+			active += 1;
+		}
+
+		if (active == 0) {
+			if (atomic_load(&batch->remaining) == 0) {
+				break;
+			}
+
+			// Other workers are still running the last jobs
+			sched_yield();
+			continue;
+		}
+
+		while (!w->slots[cur].busy) {
+			cur = (cur + 1) % LOLVM_BATCH_SLOTS;
+		}
+
+		struct lolvm_batch_slot *slot = &w->slots[cur];
+		lolvm_run_budget(&slot->vm, batch->opts->budget);
+		w->slices += 1;
+		if (slot->vm.halted) {
+			lolvm_batch_finish(w, slot);
+			active -= 1;
+		}
+
+		cur = (cur + 1) % LOLVM_BATCH_SLOTS;
+	}
+
+	return NULL;
+}
+
+static double lolvm_batch_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int lolvm_batch_run(
+		struct lolvm_program *prog, const struct lolvm_batch_options *opts,
+		struct lolvm_batch_result *result)
+{
+	struct lolvm_batch batch;
+	batch.prog = prog;
+	batch.opts = opts;
+	batch.nworkers = opts->threads > 0 ? opts->threads : 1;
+	atomic_init(&batch.remaining, opts->jobs);
+	batch.workers = calloc(batch.nworkers, sizeof(*batch.workers));
+	if (!batch.workers) {
+		return -1;
+	}
+
+	int ret = 0;
+	int started = 0;
+	size_t per_worker = (opts->jobs + batch.nworkers - 1) / batch.nworkers;
+	for (int i = 0; i < batch.nworkers; ++i) {
+		struct lolvm_batch_worker *w = &batch.workers[i];
+		w->batch = &batch;
+		w->index = i;
+		if (lolvm_deque_init(&w->deque, per_worker) < 0) {
+			ret = -1;
+		}
+
+		for (int j = 0; j < LOLVM_BATCH_SLOTS; ++j) {
+			struct lolvm_batch_slot *slot = &w->slots[j];
+			slot->out = open_memstream(&slot->buf, &slot->size);
+			if (!slot->out) {
+				ret = -1;
+			}
+		}
+	}
+
+	if (ret < 0) {
+		goto out;
+	}
+
+	for (size_t job = 0; job < opts->jobs; ++job) {
+		lolvm_deque_push(&batch.workers[job % batch.nworkers].deque, job);
+	}
+
+	double start = lolvm_batch_now();
+	for (; started < batch.nworkers; ++started) {
+		struct lolvm_batch_worker *w = &batch.workers[started];
+		if (pthread_create(&w->thread, NULL, lolvm_batch_worker_main, w) != 0) {
+			break;
+		}
+	}
+
+	// If some workers didn't start, the ones that did steal their jobs
+	if (started == 0) {
+		ret = -1;
+		goto out;
+	}
+
+	result->slices = 0;
+	result->steals = 0;
+	for (int i = 0; i < started; ++i) {
+		struct lolvm_batch_worker *w = &batch.workers[i];
+		pthread_join(w->thread, NULL);
+		result->slices += w->slices;
+		result->steals += w->steals;
+		if (w->failed) {
+			ret = -1;
+		}
+	}
+
+	result->seconds = lolvm_batch_now() - start;
+
+out:
+	for (int i = 0; i < batch.nworkers; ++i) {
+		struct lolvm_batch_worker *w = &batch.workers[i];
+		free(w->deque.buf);
+		for (int j = 0; j < LOLVM_BATCH_SLOTS; ++j) {
+			struct lolvm_batch_slot *slot = &w->slots[j];
+			if (slot->have_vm) {
+				lolvm_destroy(&slot->vm);
+			}
+
+			if (slot->out) {
+				fclose(slot->out);
+				free(slot->buf);
+			}
+		}
+	}
+
+	free(batch.workers);
+	return ret;
+}
@@ -0,0 +1,42 @@
+#ifndef LOLVM_BATCH_H
+#define LOLVM_BATCH_H
+
+/*
+ * Runs many independent instances of one program on a pool of worker
+ * threads. Each worker has a work-stealing deque of jobs which haven't
+ * started yet. Running jobs are preempted after every 'budget'
+ * instructions, so a long job can't hold up the jobs behind it.
+ */
+
+#include "lolvm.h"
+
+struct lolvm_batch_options {
+	size_t jobs;
+	int threads;
+	uint64_t budget; // Instructions per time slice
+	size_t stack_size;
+	size_t callstack_size;
+
+	// If set, every job starts from this snapshot instead of from the
+	// start of the program
+	const struct lolvm_snapshot *snapshot;
+
+	// Each job's output is written here in one piece when the job
+	// finishes, or dropped if this is NULL
+	FILE *out;
+	int binary; // Print values as raw bytes, like lolvm_output's 'binary'
+};
+
+struct lolvm_batch_result {
+	double seconds;
+	uint64_t slices;
+	uint64_t steals;
+};
+
+// The program must not be modified while the batch runs.
+// Returns -1 if the workers or their VMs can't be created.
+int lolvm_batch_run(
+		struct lolvm_program *prog, const struct lolvm_batch_options *opts,
+		struct lolvm_batch_result *result);
+
+#endif
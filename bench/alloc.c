@@ -0,0 +1,140 @@
+/*
+ * Allocation throughput of a VM's heap, compared to glibc's malloc.
+ * Each pattern runs against lolvm_alloc/lolvm_free (the code behind
+ * ALLOC and FREE) and against malloc/free, touching every block so
+ * neither can be optimized away.
+ *
+ *   alloc [iterations]
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lolvm.h"
+
+#define BATCH 1000
+#define ARENA 100
+
+static volatile unsigned char sink;
+static unsigned char *volatile escape;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t batch_size(size_t i)
+{
+	// A mix of small object sizes
+	return 16 + (i * 37) % 241;
+}
+
+static void report(const char *name, size_t ops, double vm_secs, double malloc_secs)
+{
+	printf("%-8s %10.2f %10.2f %8.2fx\n", name,
+		vm_secs * 1e9 / ops, malloc_secs * 1e9 / ops, malloc_secs / vm_secs);
+}
+
+int main(int argc, char **argv)
+{
+	size_t iters = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+
+	static const unsigned char halt[] = {LOL_HALT};
+	struct lolvm_program prog;
+	struct lolvm vm;
+	if (lolvm_program_init(&prog, halt, sizeof(halt)) < 0 ||
+			lolvm_init(&vm, &prog, LOLVM_STACK_SIZE, LOLVM_CALLSTACK_SIZE) < 0) {
+		fprintf(stderr, "Failed to create a VM\n");
+		return 1;
+	}
+
+	static unsigned char *ptrs[BATCH];
+	double start, vm_secs;
+	printf("%-8s %10s %10s %9s\n", "pattern", "lolvm ns", "malloc ns", "speedup");
+
+	// Allocate and free right away
+	start = now();
+	for (size_t i = 0; i < iters; ++i) {
+		unsigned char *p = lolvm_alloc(&vm, 24);
+		escape = p;
+		p[0] = i;
+		sink = p[0];
+		lolvm_free(&vm, p, 24);
+	}
+	vm_secs = now() - start;
+
+	start = now();
+	for (size_t i = 0; i < iters; ++i) {
+		unsigned char *p = malloc(24);
+		escape = p;
+		p[0] = i;
+		sink = p[0];
+		free(p);
+	}
+	report("pair", iters, vm_secs, now() - start);
+
+	// Allocate a batch of mixed sizes, then free it
+	size_t rounds = iters / BATCH;
+	start = now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < BATCH; ++i) {
+			ptrs[i] = lolvm_alloc(&vm, batch_size(i));
+			ptrs[i][0] = i;
+		}
+		for (size_t i = 0; i < BATCH; ++i) {
+			sink = ptrs[i][0];
+			lolvm_free(&vm, ptrs[i], batch_size(i));
+		}
+	}
+	vm_secs = now() - start;
+
+	start = now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < BATCH; ++i) {
+			ptrs[i] = malloc(batch_size(i));
+			ptrs[i][0] = i;
+		}
+		for (size_t i = 0; i < BATCH; ++i) {
+			sink = ptrs[i][0];
+			free(ptrs[i]);
+		}
+	}
+	report("batch", rounds * BATCH, vm_secs, now() - start);
+
+	// Request-scoped allocations, which an arena frees all at once
+	rounds = iters / ARENA;
+	start = now();
+	for (size_t r = 0; r < rounds; ++r) {
+		uint64_t mark = lolvm_arena_begin(&vm);
+		for (size_t i = 0; i < ARENA; ++i) {
+			unsigned char *p = lolvm_alloc(&vm, batch_size(i));
+			p[0] = i;
+			sink = p[0];
+		}
+		lolvm_arena_reset(&vm, mark);
+	}
+	vm_secs = now() - start;
+
+	start = now();
+	for (size_t r = 0; r < rounds; ++r) {
+		for (size_t i = 0; i < ARENA; ++i) {
+			ptrs[i] = malloc(batch_size(i));
+			ptrs[i][0] = i;
+			sink = ptrs[i][0];
+		}
+		for (size_t i = 0; i < ARENA; ++i) {
+			free(ptrs[i]);
+		}
+	}
+	report("arena", rounds * ARENA, vm_secs, now() - start);
+
+	printf("Heap peak: %zu bytes\n", vm.heap.peak);
+	lolvm_destroy(&vm);
+	lolvm_program_destroy(&prog);
+	return 0;
+}
@@ -0,0 +1,136 @@
+#!/bin/sh
+#
+# Benchmark harness for LolVM.
+#
+#   bench.sh [-n runs] <lolvm> <program.bc>...
+#     Run each program 'runs' times (5 by default) and write the results
+#     as JSON to stdout. Progress goes to stderr. Programs named
+#     *.sandbox.bc are compiled with --ptr32 and run with --sandbox.
+#
+#   bench.sh -c [-t percent] <baseline.json> <results.json>
+#     Compare results against a saved baseline, flagging benchmarks whose
+#     ns per instruction got more than 'percent' (5 by default) worse.
+#     Exits with status 1 if anything regressed.
+#
+# The JSON has one benchmark per line, so it's easy to read back here
+# without a JSON parser.
+
+set -e
+
+runs=5
+threshold=5
+compare=0
+
+while getopts "n:t:c" opt; do
+	case "$opt" in
+	n) runs="$OPTARG" ;;
+	t) threshold="$OPTARG" ;;
+	c) compare=1 ;;
+	*) exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+now_ns() {
+	date +%s%N
+}
+
+# Print "name ns_per_instr wall_ms" for every benchmark in a results file
+read_results() {
+	sed -n 's/.*"name": "\([^"]*\)".*"wall_ms": \([0-9.]*\).*"ns_per_instr": \([0-9.]*\).*/\1 \3 \2/p' "$1"
+}
+
+if [ "$compare" = 1 ]; then
+	if [ $# -ne 2 ]; then
+		echo "Usage: $0 -c [-t percent] <baseline.json> <results.json>" >&2
+		exit 2
+	fi
+
+	read_results "$1" > "${TMPDIR:-/tmp}/lolvm-bench-base.$$"
+	status=0
+	read_results "$2" | awk -v threshold="$threshold" -v base="${TMPDIR:-/tmp}/lolvm-bench-base.$$" '
+		BEGIN {
+			while ((getline line < base) > 0) {
+				split(line, f, " ");
+				base_ns[f[1]] = f[2];
+				base_ms[f[1]] = f[3];
+			}
+			printf "%-12s %12s %12s %8s\n", "benchmark", "base ns/i", "ns/i", "change";
+		}
+		{
+			if (!($1 in base_ns) || base_ns[$1] == 0) {
+				printf "%-12s %12s %12.3f %8s\n", $1, "-", $2, "new";
+				next;
+			}
+
+			change = 100 * ($2 - base_ns[$1]) / base_ns[$1];
+			flag = "";
+			if (change > threshold) {
+				flag = "  REGRESSION";
+				regressed = 1;
+			}
+			printf "%-12s %12.3f %12.3f %+7.1f%%%s\n", $1, base_ns[$1], $2, change, flag;
+		}
+		END { exit regressed }' || status=$?
+	rm -f "${TMPDIR:-/tmp}/lolvm-bench-base.$$"
+	exit $status
+fi
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 [-n runs] <lolvm> <program.bc>..." >&2
+	exit 2
+fi
+
+lolvm="$1"
+shift
+
+echo "{"
+echo "	\"runs\": $runs,"
+echo "	\"benchmarks\": ["
+first=1
+for prog in "$@"; do
+	name="$(basename "$prog" .bc)"
+	bytes="$(wc -c < "$prog" | tr -d ' ')"
+	flags=""
+	case "$prog" in
+	*.sandbox.bc) flags="--sandbox" ;;
+	esac
+
+	# The counting loop is slower, so it gets its own run. It doesn't
+	# check instructions, so it counts programs which the verifier rejects.
+	stats="$("$lolvm" $flags --no-verify --stats "$prog" 2>&1 >/dev/null)"
+	instrs="$(echo "$stats" | awk '/^Instructions executed:/ { print $3 }')"
+	switches="$(echo "$stats" | awk '/^Fiber switches:/ { print $3 }')"
+
+	times=""
+	i=0
+	while [ "$i" -lt "$runs" ]; do
+		start="$(now_ns)"
+		"$lolvm" $flags "$prog" > /dev/null
+		end="$(now_ns)"
+		times="$times $((end - start))"
+		i=$((i + 1))
+	done
+
+	# Median of the runs
+	wall_ns="$(echo $times | tr ' ' '\n' | sort -n | awk '{ t[NR] = $1 } END { print t[int((NR + 1) / 2)] }')"
+	line="$(awk -v name="$name" -v bytes="$bytes" -v instrs="$instrs" -v switches="$switches" -v ns="$wall_ns" 'BEGIN {
+		printf "{\"name\": \"%s\", \"bytes\": %d, \"instrs\": %d, \"wall_ms\": %.3f, \"ns_per_instr\": %.4f",
+			name, bytes, instrs, ns / 1e6, (instrs > 0 ? ns / instrs : 0)
+		# Programs with fibers also get the cost of a switch
+		if (switches > 0)
+			printf ", \"switches\": %d, \"ns_per_switch\": %.2f", switches, ns / switches
+		printf "}"
+	}')"
+	echo "$name: $line" >&2
+
+	if [ "$first" = 1 ]; then
+		first=0
+	else
+		echo ","
+	fi
+	printf "\t\t%s" "$line"
+done
+echo
+echo "	]"
+echo "}"
@@ -2,74 +2,65 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
 #include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
-#define LOLVM_OPS \
-	X(SETI_8)   /* dest @, imm x32 */ \
-	X(SETI_32)  /* dest @, imm x32 */ \
-	X(SETI_64)  /* dest @, imm x64 */ \
-	X(COPY_8)   /* dest @, src @ */ \
-	X(COPY_32)  /* dest @, src @ */ \
-	X(COPY_64)  /* dest @, src @ */ \
-	X(COPY_N)   /* dest @, src @, size u32 */ \
-	X(ADD_8)    /* dest @, a @, b @ */ \
-	X(ADD_32)   /* dest @, a @, b @ */ \
-	X(ADD_64)   /* dest @, a @, b @ */ \
-	X(ADD_F32)  /* dest @, a @, b @ */ \
-	X(ADD_F64)  /* dest @, a @, b @ */ \
-	X(ADDI_8)   /* dest @, a @, imm b x32 */ \
-	X(ADDI_32)  /* dest @, a @, imm b x32 */ \
-	X(ADDI_64)  /* dest @, a @, imm b x64 */ \
-	X(EQ_8)     /* dest @, a @, b @ */ \
-	X(EQ_32)    /* dest @, a @, b @ */ \
-	X(EQ_64)    /* dest @, a @, b @ */ \
-	X(EQ_F32)   /* dest @, a @, b @ */ \
-	X(EQ_F64)   /* dest @, a @, b @ */ \
-	X(NEQ_8)    /* dest @, a @, b @ */ \
-	X(NEQ_32)   /* dest @, a @, b @ */ \
-	X(NEQ_64)   /* dest @, a @, b @ */ \
-	X(NEQ_F32)  /* dest @, a @, b @ */ \
-	X(NEQ_F64)  /* dest @, a @, b @ */ \
-	X(LT_U8)    /* dest @, a @, b @ */ \
-	X(LT_I32)   /* dest @, a @, b @ */ \
-	X(LT_I64)   /* dest @, a @, b @ */ \
-	X(LT_F32)   /* dest @, a @, b @ */ \
-	X(LT_F64)   /* dest @, a @, b @ */ \
-	X(LE_U8)    /* dest @, a @, b @ */ \
-	X(LE_I32)   /* dest @, a @, b @ */ \
-	X(LE_I64)   /* dest @, a @, b @ */ \
-	X(LE_F32)   /* dest @, a @, b @ */ \
-	X(LE_F64)   /* dest @, a @, b @ */ \
-	X(REF)      /* dest @, src @ */ \
-	X(LOAD_8)   /* dest @, src @ */ \
-	X(LOAD_32)  /* dest @, src @ */ \
-	X(LOAD_64)  /* dest @, src @ */ \
-	X(LOAD_N)   /* dest @, src @, size u32 */ \
-	X(STORE_8)  /* dest @, src @ */ \
-	X(STORE_32) /* dest @, src @ */ \
-	X(STORE_64) /* dest @, src @ */ \
-	X(STORE_N)  /* dest @, src @, size u32 */ \
-	/* */ \
-	X(CALL)          /* stack-bump @, jump_target u32 */ \
-	X(RETURN)        /* */ \
-	X(BRANCH)        /* delta @ */ \
-	X(BRANCH_Z)      /* cond @, delta @ */ \
-	X(BRANCH_NZ)     /* cond @, delta @ */ \
-	X(DBG_PRINT_U8) /* val @ */ \
-	X(DBG_PRINT_I32) /* val @ */ \
-	X(DBG_PRINT_I64) /* val @ */ \
-	X(DBG_PRINT_F32) /* val @ */ \
-	X(DBG_PRINT_F64) /* val @ */ \
-	X(HALT)          /* */ \
-//
-
-enum lolvm_op {
-#define X(name) LOL_ ## name,
-LOLVM_OPS
-#undef X
-};
+#include "lolvm.h"
+
+// Use computed-goto dispatch in lolvm_run where the compiler supports it.
+// Build with -DLOLVM_THREADED=0 to get the portable switch-based loop.
+#ifndef LOLVM_THREADED
+#ifdef __GNUC__
+#define LOLVM_THREADED 1
+#else
+#define LOLVM_THREADED 0
+#endif
+#endif
 
-static const char *lolvm_op_name(enum lolvm_op op)
+// The JIT emits x86-64 machine code, so it's only available there.
+// Build with -DLOLVM_JIT=0 to leave it out.
+#ifndef LOLVM_JIT
+#if defined(__x86_64__) && defined(__unix__)
+#define LOLVM_JIT 1
+#else
+#define LOLVM_JIT 0
+#endif
+#endif
+
+// Vector instructions use SSE2, or AVX2 when the CPU has it, on x86-64.
+// Build with -DLOLVM_SIMD=0 to use only the plain C versions.
+#ifndef LOLVM_SIMD
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LOLVM_SIMD 1
+#else
+#define LOLVM_SIMD 0
+#endif
+#endif
+
+// The profiler times instructions with the timestamp counter on x86,
+// and with the monotonic clock everywhere else.
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LOLVM_PROFILE_RDTSC 1
+#define LOLVM_PROFILE_UNIT "cycles"
+#else
+#define LOLVM_PROFILE_RDTSC 0
+#define LOLVM_PROFILE_UNIT "ns"
+#endif
+
+const char *lolvm_op_name(enum lolvm_op op)
 {
 	switch (op) {
 #define X(name) case LOL_ ## name: return #name;
@@ -80,14 +71,14 @@ LOLVM_OPS
 	return "<invalid>";
 }
 
-static uint16_t parse_u16(unsigned char *ptr)
+static uint16_t parse_u16(const unsigned char *ptr)
 {
 	return 
 		((uint16_t)ptr[0] << 0) | \
 		((uint16_t)ptr[1] << 8);
 }
 
-static uint32_t parse_u32(unsigned char *ptr)
+static uint32_t parse_u32(const unsigned char *ptr)
 {
 	return 
 		((uint32_t)ptr[0] << 0) |
@@ -96,7 +87,7 @@ static uint32_t parse_u32(unsigned char *ptr)
 		((uint32_t)ptr[3] << 24);
 }
 
-static uint64_t parse_u64(unsigned char *ptr)
+static uint64_t parse_u64(const unsigned char *ptr)
 {
 	return 
 		((uint64_t)ptr[0] << 0) |
@@ -109,7 +100,7 @@ static uint64_t parse_u64(unsigned char *ptr)
 		((uint64_t)ptr[7] << 56);
 }
 
-size_t pretty_print_instruction(unsigned char *instr)
+size_t pretty_print_instruction(FILE *out, const unsigned char *instr)
 {
 	#define OP_U8(offset) (instr[iptr + offset])
 	#define OP_OFFSET(offset) ((int16_t)parse_u16(&instr[iptr + offset]))
@@ -121,187 +112,366 @@ size_t pretty_print_instruction(unsigned char *instr)
 	size_t iptr = 0;
 	switch ((enum lolvm_op)instr[iptr++]) {
 	case LOL_SETI_8:
-		printf("SETI_8 @%i, %" PRIu8 "\n", OP_OFFSET(0), OP_U8(2));
+		fprintf(out, "SETI_8 @%i, %" PRIu8 "\n", OP_OFFSET(0), OP_U8(2));
 		return 3;
 	case LOL_SETI_32:
-		printf("SETI_32 @%i, %" PRId32 "\n", OP_OFFSET(0), OP_U32(2));
+		fprintf(out, "SETI_32 @%i, %" PRId32 "\n", OP_OFFSET(0), OP_U32(2));
 		return 6;
 	case LOL_SETI_64:
-		printf("SETI_64 @%i, %" PRId64 "\n", OP_OFFSET(0), OP_U64(2));
+		fprintf(out, "SETI_64 @%i, %" PRId64 "\n", OP_OFFSET(0), OP_U64(2));
 		return 10;
 
 	case LOL_COPY_8:
-		printf("COPY_8 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "COPY_8 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 	case LOL_COPY_32:
-		printf("COPY_32 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "COPY_32 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 	case LOL_COPY_64:
-		printf("COPY_64 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "COPY_64 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 	case LOL_COPY_N:
-		printf("COPY_N @%i, @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
+		fprintf(out, "COPY_N @%i, @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
 		return 8;
 
 	case LOL_ADD_8:
-		printf("ADD_8 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "ADD_8 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_ADD_32:
-		printf("ADD_32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "ADD_32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_ADD_64:
-		printf("ADD_64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "ADD_64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_ADD_F32:
-		printf("ADD_32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "ADD_32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_ADD_F64:
-		printf("ADD_64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "ADD_64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 
 	case LOL_ADDI_8:
-		printf("ADDI_32 @%i, @%i, %" PRIu8 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U8(4));
+		fprintf(out, "ADDI_32 @%i, @%i, %" PRIu8 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U8(4));
 		return 5;
 	case LOL_ADDI_32:
-		printf("ADDI_32 @%i, @%i, %" PRId32 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
+		fprintf(out, "ADDI_32 @%i, @%i, %" PRId32 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
 		return 8;
 	case LOL_ADDI_64:
-		printf("ADDI_64 @%i, @%i, %" PRId64 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U64(4));
+		fprintf(out, "ADDI_64 @%i, @%i, %" PRId64 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U64(4));
 		return 12;
 
 	case LOL_EQ_8:
-		printf("EQ_8 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "EQ_8 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_EQ_32:
-		printf("EQ_32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "EQ_32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_EQ_64:
-		printf("EQ_64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "EQ_64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_EQ_F32:
-		printf("EQ_F32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "EQ_F32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_EQ_F64:
-		printf("EQ_F64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "EQ_F64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 
 	case LOL_NEQ_8:
-		printf("NEQ_8 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "NEQ_8 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_NEQ_32:
-		printf("NEQ_32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "NEQ_32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_NEQ_64:
-		printf("NEQ_64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "NEQ_64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_NEQ_F32:
-		printf("NEQ_F32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "NEQ_F32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_NEQ_F64:
-		printf("NEQ_F64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "NEQ_F64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 
 	case LOL_LT_U8:
-		printf("LT_U8 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "LT_U8 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_LT_I32:
-		printf("LT_I32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "LT_I32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_LT_I64:
-		printf("LT_I64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "LT_I64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_LT_F32:
-		printf("LT_F32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "LT_F32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_LT_F64:
-		printf("LT_F64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "LT_F64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 
 	case LOL_LE_U8:
-		printf("LE_U8 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "LE_U8 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_LE_I32:
-		printf("LE_I32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "LE_I32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_LE_I64:
-		printf("LE_I64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "LE_I64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_LE_F32:
-		printf("LE_F32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "LE_F32 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 	case LOL_LE_F64:
-		printf("LE_F64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
+		fprintf(out, "LE_F64 @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4));
 		return 6;
 
 	case LOL_REF:
-		printf("REF @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "REF @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 
 	case LOL_LOAD_8:
-		printf("LOAD_8 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "LOAD_8 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 	case LOL_LOAD_32:
-		printf("LOAD_32 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "LOAD_32 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 	case LOL_LOAD_64:
-		printf("LOAD_64 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "LOAD_64 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 	case LOL_LOAD_N:
-		printf("LOAD_N @%i, @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
+		fprintf(out, "LOAD_N @%i, @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
 		return 8;
 
 	case LOL_STORE_8:
-		printf("STORE_8 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "STORE_8 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 	case LOL_STORE_32:
-		printf("STORE_32 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "STORE_32 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 	case LOL_STORE_64:
-		printf("STORE_64 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "STORE_64 @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 	case LOL_STORE_N:
-		printf("STORE_N @%i, @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
+		fprintf(out, "STORE_N @%i, @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
 		return 8;
 
 	case LOL_CALL:
-		printf("CALL @%i, %u\n", OP_OFFSET(0), OP_U32(2));
+		fprintf(out, "CALL @%i, %u\n", OP_OFFSET(0), OP_U32(2));
 		return 6;
 	case LOL_RETURN:
-		printf("RETURN\n");
+		fprintf(out, "RETURN\n");
 		return 0;
 
 	case LOL_BRANCH:
-		printf("BRANCH @%i\n", OP_OFFSET(0));
+		fprintf(out, "BRANCH @%i\n", OP_OFFSET(0));
 		return 2;
 	case LOL_BRANCH_Z:
-		printf("BRANCH_Z @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "BRANCH_Z @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 	case LOL_BRANCH_NZ:
-		printf("BRANCH_NZ @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
+		fprintf(out, "BRANCH_NZ @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2));
 		return 4;
 
 	case LOL_DBG_PRINT_U8:
-		printf("DBG_PRINT_U8 @%i\n", OP_OFFSET(0));
+		fprintf(out, "DBG_PRINT_U8 @%i\n", OP_OFFSET(0));
 		return 2;
 	case LOL_DBG_PRINT_I32:
-		printf("DBG_PRINT_I32 @%i\n", OP_OFFSET(0));
+		fprintf(out, "DBG_PRINT_I32 @%i\n", OP_OFFSET(0));
 		return 2;
 	case LOL_DBG_PRINT_I64:
-		printf("DBG_PRINT_I64 @%i\n", OP_OFFSET(0));
+		fprintf(out, "DBG_PRINT_I64 @%i\n", OP_OFFSET(0));
 		return 2;
 	case LOL_DBG_PRINT_F32:
-		printf("DBG_PRINT_I32 @%i\n", OP_OFFSET(0));
+		fprintf(out, "DBG_PRINT_I32 @%i\n", OP_OFFSET(0));
 		return 2;
 	case LOL_DBG_PRINT_F64:
-		printf("DBG_PRINT_I64 @%i\n", OP_OFFSET(0));
+		fprintf(out, "DBG_PRINT_I64 @%i\n", OP_OFFSET(0));
 		return 2;
 
 	case LOL_HALT:
-		printf("HALT\n");
+		fprintf(out, "HALT\n");
+		return 0;
+
+	case LOL_BR_NEQ_8:
+		fprintf(out, "BR_NEQ_8 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_NEQ_32:
+		fprintf(out, "BR_NEQ_32 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_NEQ_64:
+		fprintf(out, "BR_NEQ_64 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_NEQ_F32:
+		fprintf(out, "BR_NEQ_F32 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_NEQ_F64:
+		fprintf(out, "BR_NEQ_F64 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+
+	case LOL_BR_EQ_8:
+		fprintf(out, "BR_EQ_8 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_EQ_32:
+		fprintf(out, "BR_EQ_32 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_EQ_64:
+		fprintf(out, "BR_EQ_64 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_EQ_F32:
+		fprintf(out, "BR_EQ_F32 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_EQ_F64:
+		fprintf(out, "BR_EQ_F64 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+
+	case LOL_BR_GE_U8:
+		fprintf(out, "BR_GE_U8 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_GE_I32:
+		fprintf(out, "BR_GE_I32 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_GE_I64:
+		fprintf(out, "BR_GE_I64 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_GE_F32:
+		fprintf(out, "BR_GE_F32 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_GE_F64:
+		fprintf(out, "BR_GE_F64 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+
+	case LOL_BR_GT_U8:
+		fprintf(out, "BR_GT_U8 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_GT_I32:
+		fprintf(out, "BR_GT_I32 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_GT_I64:
+		fprintf(out, "BR_GT_I64 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_GT_F32:
+		fprintf(out, "BR_GT_F32 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_BR_GT_F64:
+		fprintf(out, "BR_GT_F64 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+
+	case LOL_BRI_NEQ_32:
+		fprintf(out, "BRI_NEQ_32 @%i, @%i, %" PRId32 ", @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_I32(4), OP_OFFSET(8));
+		return 10;
+	case LOL_BRI_EQ_32:
+		fprintf(out, "BRI_EQ_32 @%i, @%i, %" PRId32 ", @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_I32(4), OP_OFFSET(8));
+		return 10;
+	case LOL_BRI_GE_I32:
+		fprintf(out, "BRI_GE_I32 @%i, @%i, %" PRId32 ", @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_I32(4), OP_OFFSET(8));
+		return 10;
+	case LOL_BRI_GT_I32:
+		fprintf(out, "BRI_GT_I32 @%i, @%i, %" PRId32 ", @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_I32(4), OP_OFFSET(8));
+		return 10;
+
+	case LOL_ADDI_32_BR:
+		fprintf(out, "ADDI_32_BR @%i, @%i, %" PRId32 ", @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_I32(4), OP_OFFSET(8));
+		return 10;
+	case LOL_LOOP_INC_LT_I32:
+		fprintf(out, "LOOP_INC_LT_I32 @%i, @%i, %" PRId32 ", @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_I32(4), OP_OFFSET(8));
+		return 10;
+	case LOL_LOOP_INC_LE_I32:
+		fprintf(out, "LOOP_INC_LE_I32 @%i, @%i, %" PRId32 ", @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_I32(4), OP_OFFSET(8));
+		return 10;
+	case LOL_ADDI_64_BR:
+		fprintf(out, "ADDI_64_BR @%i, @%i, %" PRId32 ", @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_I32(4), OP_OFFSET(8));
+		return 10;
+	case LOL_SETI_ADD_32_BR:
+		fprintf(out, "SETI_ADD_32_BR @%i, @%i, @%i, %" PRId32 ", @%i\n",
+			OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_I32(6), OP_OFFSET(10));
+		return 12;
+	case LOL_SETI_ADD_64_BR:
+		fprintf(out, "SETI_ADD_64_BR @%i, @%i, @%i, %" PRId32 ", @%i\n",
+			OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_I32(6), OP_OFFSET(10));
+		return 12;
+
+	case LOL_COPY2_32:
+		fprintf(out, "COPY2_32 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+	case LOL_COPY2_64:
+		fprintf(out, "COPY2_64 @%i, @%i, @%i, @%i\n", OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_OFFSET(6));
+		return 8;
+
+	case LOL_ALLOC:
+		fprintf(out, "ALLOC @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_U32(2));
+		return 6;
+	case LOL_FREE:
+		fprintf(out, "FREE @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_U32(2));
+		return 6;
+	case LOL_ARENA_BEGIN:
+		fprintf(out, "ARENA_BEGIN @%i\n", OP_OFFSET(0));
+		return 2;
+	case LOL_ARENA_RESET:
+		fprintf(out, "ARENA_RESET @%i\n", OP_OFFSET(0));
+		return 2;
+
+	case LOL_SPAWN:
+		fprintf(out, "SPAWN @%i, %u\n", OP_OFFSET(0), OP_U32(2));
+		return 6;
+	case LOL_YIELD:
+		fprintf(out, "YIELD\n");
+		return 0;
+	case LOL_CHAN_NEW:
+		fprintf(out, "CHAN_NEW @%i\n", OP_OFFSET(0));
+		return 2;
+	case LOL_CHAN_SEND:
+		fprintf(out, "CHAN_SEND @%i, @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
+		return 8;
+	case LOL_CHAN_RECV:
+		fprintf(out, "CHAN_RECV @%i, @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
+		return 8;
+
+	case LOL_WRITE_N:
+		fprintf(out, "WRITE_N @%i, %" PRIu32 "\n", OP_OFFSET(0), OP_U32(2));
+		return 6;
+	case LOL_FLUSH:
+		fprintf(out, "FLUSH\n");
 		return 0;
+	case LOL_PRINT_U8:
+		fprintf(out, "PRINT_U8 @%i\n", OP_OFFSET(0));
+		return 2;
+	case LOL_PRINT_I32:
+		fprintf(out, "PRINT_I32 @%i\n", OP_OFFSET(0));
+		return 2;
+	case LOL_PRINT_I64:
+		fprintf(out, "PRINT_I64 @%i\n", OP_OFFSET(0));
+		return 2;
+	case LOL_PRINT_F32:
+		fprintf(out, "PRINT_F32 @%i\n", OP_OFFSET(0));
+		return 2;
+	case LOL_PRINT_F64:
+		fprintf(out, "PRINT_F64 @%i\n", OP_OFFSET(0));
+		return 2;
+
+	case LOL_TAILCALL:
+		fprintf(out, "TAILCALL @%i, @%i, %u\n", OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
+		return 8;
+
+	case LOL_VADD_I32:
+	case LOL_VADD_F32:
+	case LOL_VEQ_I32:
+	case LOL_VLT_I32:
+	case LOL_VLE_I32:
+		fprintf(out, "%s @%i, @%i, @%i, %" PRIu32 "\n", lolvm_op_name(instr[0]),
+			OP_OFFSET(0), OP_OFFSET(2), OP_OFFSET(4), OP_U32(6));
+		return 10;
+	case LOL_VSUM_I32:
+	case LOL_VSUM_F32:
+	case LOL_VMIN_I32:
+	case LOL_VMAX_I32:
+	case LOL_FILL_8:
+	case LOL_FILL_32:
+	case LOL_FILL_64:
+		fprintf(out, "%s @%i, @%i, %" PRIu32 "\n", lolvm_op_name(instr[0]),
+			OP_OFFSET(0), OP_OFFSET(2), OP_U32(4));
+		return 8;
 	}
 
-	printf("Bad instruction (%02x)\n", *instr);
+	fprintf(out, "Bad instruction (%02x)\n", *instr);
 
 	#undef OP_U8
 	#undef OP_OFFSET
@@ -313,570 +483,6239 @@ size_t pretty_print_instruction(unsigned char *instr)
 	return 0;
 }
 
-void pretty_print(unsigned char *instrs, size_t size) {
+void pretty_print(FILE *out, const unsigned char *instrs, size_t size) {
 	size_t iptr = 0;
 	while (iptr < size)  {
-		printf("%04zu ", iptr);
-		iptr += pretty_print_instruction(&instrs[iptr]) + 1;
+		fprintf(out, "%04zu ", iptr);
+		iptr += pretty_print_instruction(out, &instrs[iptr]) + 1;
 	}
 }
 
-struct lolvm_stack_frame {
-	size_t sptr;
-	size_t iptr;
-};
-
-struct lolvm {
-	unsigned char *instrs;
-	size_t iptr;
-	size_t sptr;
-	size_t cptr;
-	int halted;
-	unsigned char stack[1024];
-	struct lolvm_stack_frame callstack[64];
-};
+_Static_assert(sizeof(struct lolvm_instr) == 16, "lolvm_instr should be 16 bytes");
 
-void lolvm_init(struct lolvm *vm, unsigned char *instrs)
+static int lolvm_program_fail(struct lolvm_program *prog, const char *error, size_t addr)
 {
-	vm->instrs = instrs;
-	vm->sptr = 0;
-	vm->iptr = 0;
-	vm->cptr = 0;
-	vm->halted = 0;
-
-	memset(&vm->stack, 0xFF, sizeof(vm->stack));
-	memset(&vm->callstack, 0xFF, sizeof(vm->callstack));
+	prog->error = error;
+	prog->error_addr = addr;
+	free(prog->code);
+	free(prog->addrs);
+	prog->code = NULL;
+	prog->addrs = NULL;
+	prog->count = 0;
+	return -1;
 }
 
-void lolvm_step(struct lolvm *vm)
+// Decode the instruction at 'addr' into 'instr', leaving branch and call
+// targets as byte addresses. Returns the size of the operands,
+// or -1 if they run past the end of the bytecode.
+static int lolvm_decode_instruction(
+		const unsigned char *bytecode, size_t size, size_t addr, struct lolvm_instr *instr)
 {
-	#define OP_U8(offset) (vm->instrs[vm->iptr + offset])
-	#define OP_OFFSET(offset) ((int16_t)parse_u16(&vm->instrs[vm->iptr + offset]))
-	#define OP_U32(offset) parse_u32(&vm->instrs[vm->iptr + offset])
-	#define OP_I32(offset) ((int32_t)OP_U32(offset))
-	#define OP_U64(offset) parse_u64(&vm->instrs[vm->iptr + offset])
-	#define OP_I64(offset) ((int64_t)OP_U64(offset))
-	#define STACK(offset) (&vm->stack[vm->sptr + (offset)])
-
-	switch ((enum lolvm_op)vm->instrs[vm->iptr++]) {
-	case LOL_SETI_8: {
-		uint8_t val = OP_U8(2);
-		*STACK(OP_OFFSET(0)) = val;
-		vm->iptr += 3;
-		break;
-	}
-	case LOL_SETI_32: {
-		uint32_t val = OP_U32(2);
-		memcpy(STACK(OP_OFFSET(0)), &val, 4);
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_SETI_64: {
-		uint64_t val = OP_I64(2);
-		memcpy(STACK(OP_OFFSET(0)), &val, 8);
-		vm->iptr += 10;
-		break;
-	}
-
-	case LOL_COPY_8: {
-		*STACK(OP_OFFSET(0)) = *STACK(OP_OFFSET(2));
-		vm->iptr += 4;
-		break;
-	}
-	case LOL_COPY_32: {
-		memcpy(STACK(OP_OFFSET(0)), STACK(OP_OFFSET(2)), 4);
-		vm->iptr += 4;
-		break;
-	}
-	case LOL_COPY_64: {
-		memcpy(STACK(OP_OFFSET(0)), STACK(OP_OFFSET(2)), 8);
-		vm->iptr += 4;
-		break;
-	}
-	case LOL_COPY_N: {
-		memcpy(STACK(OP_OFFSET(0)), STACK(OP_OFFSET(2)), OP_U32(4));
-		vm->iptr += 8;
-		break;
-	}
-
-	case LOL_ADD_8: {
-		*STACK(OP_OFFSET(0)) = *STACK(OP_OFFSET(2)) + *STACK(OP_OFFSET(4));
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_ADD_32: {
-		uint32_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		uint32_t b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 4);
-		a += b;
-		memcpy(STACK(OP_OFFSET(0)), &a, 4);
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_ADD_64: {
-		uint64_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		uint64_t b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 8);
-		a += b;
-		memcpy(STACK(OP_OFFSET(0)), &a, 8);
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_ADD_F32: {
-		float a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		float b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 4);
-		a += b;
-		memcpy(STACK(OP_OFFSET(0)), &a, 4);
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_ADD_F64: {
-		double a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		double b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 8);
-		a += b;
-		memcpy(STACK(OP_OFFSET(0)), &a, 8);
-		vm->iptr += 6;
-		break;
-	}
-
-	case LOL_ADDI_8: {
-		*STACK(OP_OFFSET(0)) = *STACK(OP_OFFSET(2)) + OP_U8(4);
-		vm->iptr += 5;
-		break;
-	}
-	case LOL_ADDI_32: {
-		uint32_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		uint32_t b = OP_U32(4);
-		a += b;
-		memcpy(STACK(OP_OFFSET(0)), &a, 4);
-		vm->iptr += 8;
-		break;
-	}
-	case LOL_ADDI_64: {
-		uint64_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		uint64_t b = OP_U64(4);
-		a += b;
-		memcpy(STACK(OP_OFFSET(0)), &a, 8);
-		vm->iptr += 12;
-		break;
-	}
-
-	case LOL_EQ_8: {
-		*STACK(OP_OFFSET(0)) = *STACK(OP_OFFSET(2)) == *STACK(OP_OFFSET(4));
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_EQ_32: {
-		uint32_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		uint32_t b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 4);
-		*STACK(OP_OFFSET(0)) = a == b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_EQ_64: {
-		uint64_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		uint64_t b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 8);
-		*STACK(OP_OFFSET(0)) = a == b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_EQ_F32: {
-		float a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		float b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 4);
-		*STACK(OP_OFFSET(0)) = a == b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_EQ_F64: {
-		double a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		double b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 8);
-		*STACK(OP_OFFSET(0)) = a == b;
-		vm->iptr += 6;
-		break;
-	}
+	#define OP_U8(offset) (bytecode[addr + 1 + offset])
+	#define OP_OFFSET(offset) ((int16_t)parse_u16(&bytecode[addr + 1 + offset]))
+	#define OP_U32(offset) parse_u32(&bytecode[addr + 1 + offset])
+	#define OP_U64(offset) parse_u64(&bytecode[addr + 1 + offset])
+	#define NEED(n) if (addr + 1 + (n) > size) return -1
 
-	case LOL_NEQ_8: {
-		*STACK(OP_OFFSET(0)) = *STACK(OP_OFFSET(2)) != *STACK(OP_OFFSET(4));
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_NEQ_32: {
-		uint32_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		uint32_t b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 4);
-		*STACK(OP_OFFSET(0)) = a != b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_NEQ_64: {
-		uint64_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		uint64_t b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 8);
-		*STACK(OP_OFFSET(0)) = a != b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_NEQ_F32: {
-		float a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		float b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 4);
-		*STACK(OP_OFFSET(0)) = a != b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_NEQ_F64: {
-		double a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		double b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 8);
-		*STACK(OP_OFFSET(0)) = a != b;
-		vm->iptr += 6;
-		break;
-	}
+	memset(instr, 0, sizeof(*instr));
+	instr->op = bytecode[addr];
+	instr->len = 1;
 
-	case LOL_LT_U8: {
-		*STACK(OP_OFFSET(0)) = *STACK(OP_OFFSET(2)) < *STACK(OP_OFFSET(4));
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_LT_I32: {
-		int32_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		int32_t b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 4);
-		*STACK(OP_OFFSET(0)) = a < b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_LT_I64: {
-		int64_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		int64_t b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 8);
-		*STACK(OP_OFFSET(0)) = a < b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_LT_F32: {
-		float a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		float b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 4);
-		*STACK(OP_OFFSET(0)) = a < b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_LT_F64: {
-		double a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		double b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 8);
-		*STACK(OP_OFFSET(0)) = a < b;
-		vm->iptr += 6;
-		break;
-	}
+	switch ((enum lolvm_op)instr->op) {
+	case LOL_SETI_8:
+		NEED(3);
+		instr->a = OP_OFFSET(0);
+		instr->imm = OP_U8(2);
+		return 3;
+	case LOL_SETI_32:
+		NEED(6);
+		instr->a = OP_OFFSET(0);
+		instr->imm = OP_U32(2);
+		return 6;
+	case LOL_SETI_64:
+		NEED(10);
+		instr->a = OP_OFFSET(0);
+		instr->imm = OP_U64(2);
+		return 10;
 
-	case LOL_LE_U8: {
-		*STACK(OP_OFFSET(0)) = *STACK(OP_OFFSET(2)) <= *STACK(OP_OFFSET(4));
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_LE_I32: {
-		int32_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		int32_t b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 4);
-		*STACK(OP_OFFSET(0)) = a <= b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_LE_I64: {
-		int64_t a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		int64_t b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 8);
-		*STACK(OP_OFFSET(0)) = a <= b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_LE_F32: {
-		float a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 4);
-		float b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 4);
-		*STACK(OP_OFFSET(0)) = a <= b;
-		vm->iptr += 6;
-		break;
-	}
-	case LOL_LE_F64: {
-		double a;
-		memcpy(&a, STACK(OP_OFFSET(2)), 8);
-		double b;
-		memcpy(&b, STACK(OP_OFFSET(4)), 8);
-		*STACK(OP_OFFSET(0)) = a <= b;
-		vm->iptr += 6;
-		break;
-	}
+	case LOL_COPY_8:
+	case LOL_COPY_32:
+	case LOL_COPY_64:
+	case LOL_REF:
+	case LOL_LOAD_8:
+	case LOL_LOAD_32:
+	case LOL_LOAD_64:
+	case LOL_STORE_8:
+	case LOL_STORE_32:
+	case LOL_STORE_64:
+		NEED(4);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		return 4;
 
-	case LOL_REF: {
-		uint64_t val = (uint64_t)STACK(OP_OFFSET(2));
-		memcpy(STACK(OP_OFFSET(0)), &val, 8);
-		vm->iptr += 4;
-		break;
-	}
+	case LOL_COPY_N:
+	case LOL_LOAD_N:
+	case LOL_STORE_N:
+	case LOL_CHAN_SEND:
+	case LOL_CHAN_RECV:
+	case LOL_VSUM_I32:
+	case LOL_VSUM_F32:
+	case LOL_VMIN_I32:
+	case LOL_VMAX_I32:
+	case LOL_FILL_8:
+	case LOL_FILL_32:
+	case LOL_FILL_64:
+		NEED(8);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->imm = OP_U32(4);
+		return 8;
 
-	case LOL_LOAD_8: {
-		uint64_t src;
-		memcpy(&src, STACK(OP_OFFSET(2)), 8);
-		unsigned char *srcptr = (unsigned char *)src;
-		*STACK(OP_OFFSET(0)) = *srcptr;
-		vm->iptr += 4;
-		break;
-	}
-	case LOL_LOAD_32: {
-		uint64_t src;
-		memcpy(&src, STACK(OP_OFFSET(2)), 8);
-		unsigned char *srcptr = (unsigned char *)src;
-		memcpy(STACK(OP_OFFSET(0)), srcptr, 4);
-		vm->iptr += 4;
-		break;
-	}
-	case LOL_LOAD_64: {
-		uint64_t src;
-		memcpy(&src, STACK(OP_OFFSET(2)), 8);
-		unsigned char *srcptr = (unsigned char *)src;
-		memcpy(STACK(OP_OFFSET(0)), srcptr, 8);
-		vm->iptr += 4;
-		break;
-	}
-	case LOL_LOAD_N: {
-		uint64_t src;
-		memcpy(&src, STACK(OP_OFFSET(2)), 8);
-		unsigned char *srcptr = (unsigned char *)src;
-		memcpy(STACK(OP_OFFSET(0)), srcptr, OP_U32(4));
-		vm->iptr += 8;
-		break;
-	}
+	case LOL_ADD_8:
+	case LOL_ADD_32:
+	case LOL_ADD_64:
+	case LOL_ADD_F32:
+	case LOL_ADD_F64:
+	case LOL_EQ_8:
+	case LOL_EQ_32:
+	case LOL_EQ_64:
+	case LOL_EQ_F32:
+	case LOL_EQ_F64:
+	case LOL_NEQ_8:
+	case LOL_NEQ_32:
+	case LOL_NEQ_64:
+	case LOL_NEQ_F32:
+	case LOL_NEQ_F64:
+	case LOL_LT_U8:
+	case LOL_LT_I32:
+	case LOL_LT_I64:
+	case LOL_LT_F32:
+	case LOL_LT_F64:
+	case LOL_LE_U8:
+	case LOL_LE_I32:
+	case LOL_LE_I64:
+	case LOL_LE_F32:
+	case LOL_LE_F64:
+		NEED(6);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->c = OP_OFFSET(4);
+		return 6;
 
-	case LOL_STORE_8: {
-		uint64_t dest;
-		memcpy(&dest, STACK(OP_OFFSET(0)), 8);
-		unsigned char *destptr = (unsigned char *)dest;
-		*destptr = *STACK(OP_OFFSET(2));
-		vm->iptr += 4;
-		break;
-	}
-	case LOL_STORE_32: {
-		uint64_t dest;
-		memcpy(&dest, STACK(OP_OFFSET(0)), 8);
-		unsigned char *destptr = (unsigned char *)dest;
-		memcpy(destptr, STACK(OP_OFFSET(2)), 4);
-		vm->iptr += 4;
-		break;
-	}
-	case LOL_STORE_64: {
-		uint64_t dest;
-		memcpy(&dest, STACK(OP_OFFSET(0)), 8);
-		unsigned char *destptr = (unsigned char *)dest;
-		memcpy(destptr, STACK(OP_OFFSET(2)), 8);
-		vm->iptr += 4;
-		break;
-	}
-	case LOL_STORE_N: {
-		uint64_t dest;
-		memcpy(&dest, STACK(OP_OFFSET(0)), 8);
-		unsigned char *destptr = (unsigned char *)dest;
-		memcpy(destptr, STACK(OP_OFFSET(2)), OP_U32(4));
-		vm->iptr += 8;
-		break;
-	}
+	case LOL_ADDI_8:
+		NEED(5);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->imm = OP_U8(4);
+		return 5;
+	case LOL_ADDI_32:
+		NEED(8);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->imm = OP_U32(4);
+		return 8;
+	case LOL_ADDI_64:
+		NEED(12);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->imm = OP_U64(4);
+		return 12;
 
 	case LOL_CALL:
-		vm->callstack[vm->cptr].sptr = vm->sptr;
-		vm->callstack[vm->cptr].iptr = vm->iptr + 6;
-		vm->cptr += 1;
-		vm->sptr += OP_OFFSET(0);
-		vm->iptr = OP_U32(2);
-		break;
+	case LOL_SPAWN:
+		NEED(6);
+		instr->a = OP_OFFSET(0);
+		instr->target = OP_U32(2);
+		return 6;
+	case LOL_TAILCALL:
+		NEED(8);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->target = OP_U32(4);
+		return 8;
 	case LOL_RETURN:
-		vm->cptr -= 1;
-		vm->sptr = vm->callstack[vm->cptr].sptr;
-		vm->iptr = vm->callstack[vm->cptr].iptr;
-		break;
+	case LOL_YIELD:
+	case LOL_FLUSH:
+		return 0;
 
 	case LOL_BRANCH:
-		vm->iptr += OP_OFFSET(0) - 1;
-		break;
+		NEED(2);
+		instr->target = addr + OP_OFFSET(0);
+		return 2;
 	case LOL_BRANCH_Z:
-		if (*STACK(OP_OFFSET(0)) == 0) {
-			vm->iptr += OP_OFFSET(2) - 1;
-		} else {
-			vm->iptr += 4;
-		}
-		break;
 	case LOL_BRANCH_NZ:
-		if (*STACK(OP_OFFSET(0)) != 0) {
-			vm->iptr += OP_OFFSET(2) - 1;
-		} else {
-			vm->iptr += 4;
-		}
-		break;
+		NEED(4);
+		instr->a = OP_OFFSET(0);
+		instr->target = addr + OP_OFFSET(2);
+		return 4;
 
-	case LOL_DBG_PRINT_U8: {
-		uint8_t val = *STACK(OP_OFFSET(0));
-		printf("DBG PRINT @%" PRIi16 ": %" PRIu8 "\n", OP_OFFSET(0), val);
-		vm->iptr += 2;
-		break;
-	}
-	case LOL_DBG_PRINT_I32: {
-		int32_t val;
-		memcpy(&val, STACK(OP_OFFSET(0)), 4);
-		printf("DBG PRINT @%" PRIi16 ": %" PRIi32 "\n", OP_OFFSET(0), val);
-		vm->iptr += 2;
-		break;
-	}
-	case LOL_DBG_PRINT_I64: {
-		int64_t val;
-		memcpy(&val, STACK(OP_OFFSET(0)), 8);
-		printf("DBG PRINT @%" PRIi16 ": %" PRIi64 "\n", OP_OFFSET(0), val);
-		vm->iptr += 2;
-		break;
-	}
-	case LOL_DBG_PRINT_F32: {
-		float val;
-		memcpy(&val, STACK(OP_OFFSET(0)), 4);
-		printf("DBG PRINT @%" PRIi16 ": %g\n", OP_OFFSET(0), val);
-		vm->iptr += 2;
-		break;
-	}
-	case LOL_DBG_PRINT_F64: {
-		double val;
-		memcpy(&val, STACK(OP_OFFSET(0)), 8);
-		printf("DBG PRINT @%" PRIi16 ": %g\n", OP_OFFSET(0), val);
-		vm->iptr += 2;
-		break;
-	}
+	case LOL_DBG_PRINT_U8:
+	case LOL_DBG_PRINT_I32:
+	case LOL_DBG_PRINT_I64:
+	case LOL_DBG_PRINT_F32:
+	case LOL_DBG_PRINT_F64:
+	case LOL_PRINT_U8:
+	case LOL_PRINT_I32:
+	case LOL_PRINT_I64:
+	case LOL_PRINT_F32:
+	case LOL_PRINT_F64:
+	case LOL_ARENA_BEGIN:
+	case LOL_ARENA_RESET:
+	case LOL_CHAN_NEW:
+		NEED(2);
+		instr->a = OP_OFFSET(0);
+		return 2;
+
+	case LOL_ALLOC:
+	case LOL_FREE:
+	case LOL_WRITE_N:
+		NEED(6);
+		instr->a = OP_OFFSET(0);
+		instr->imm = OP_U32(2);
+		return 6;
 
 	case LOL_HALT:
-		vm->halted = 1;
-		break;
+		return 0;
+
+	case LOL_BR_NEQ_8:
+	case LOL_BR_NEQ_32:
+	case LOL_BR_NEQ_64:
+	case LOL_BR_NEQ_F32:
+	case LOL_BR_NEQ_F64:
+	case LOL_BR_EQ_8:
+	case LOL_BR_EQ_32:
+	case LOL_BR_EQ_64:
+	case LOL_BR_EQ_F32:
+	case LOL_BR_EQ_F64:
+	case LOL_BR_GE_U8:
+	case LOL_BR_GE_I32:
+	case LOL_BR_GE_I64:
+	case LOL_BR_GE_F32:
+	case LOL_BR_GE_F64:
+	case LOL_BR_GT_U8:
+	case LOL_BR_GT_I32:
+	case LOL_BR_GT_I64:
+	case LOL_BR_GT_F32:
+	case LOL_BR_GT_F64:
+		NEED(8);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->c = OP_OFFSET(4);
+		instr->target = addr + OP_OFFSET(6);
+		return 8;
+
+	case LOL_BRI_NEQ_32:
+	case LOL_BRI_EQ_32:
+	case LOL_BRI_GE_I32:
+	case LOL_BRI_GT_I32:
+	case LOL_ADDI_32_BR:
+	case LOL_ADDI_64_BR:
+	case LOL_LOOP_INC_LT_I32:
+	case LOL_LOOP_INC_LE_I32:
+		NEED(10);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->imm32 = OP_U32(4);
+		instr->target = addr + OP_OFFSET(8);
+		return 10;
+
+	case LOL_SETI_ADD_32_BR:
+	case LOL_SETI_ADD_64_BR:
+		NEED(12);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->c = OP_OFFSET(4);
+		instr->imm32 = OP_U32(6);
+		instr->target = addr + OP_OFFSET(10);
+		return 12;
+
+	case LOL_COPY2_32:
+	case LOL_COPY2_64:
+		NEED(8);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->c = OP_OFFSET(4);
+		instr->d = OP_OFFSET(6);
+		return 8;
+
+	case LOL_VADD_I32:
+	case LOL_VADD_F32:
+	case LOL_VEQ_I32:
+	case LOL_VLT_I32:
+	case LOL_VLE_I32:
+		NEED(10);
+		instr->a = OP_OFFSET(0);
+		instr->b = OP_OFFSET(2);
+		instr->c = OP_OFFSET(4);
+		instr->imm = OP_U32(6);
+		return 10;
 	}
 
 	#undef OP_U8
 	#undef OP_OFFSET
 	#undef OP_U32
-	#undef OP_I32
 	#undef OP_U64
-	#undef OP_I64
-	#undef STACK
+	#undef NEED
+
+	// Unknown opcodes are kept as one-byte instructions which do nothing.
+	return 0;
 }
 
-void lolvm_run(struct lolvm *vm)
+// Whether 'op' has a branch or call target
+static int lolvm_is_jump(enum lolvm_op op)
 {
-	while (!vm->halted) {
-		lolvm_step(vm);
+	switch (op) {
+	case LOL_CALL:
+	case LOL_SPAWN:
+	case LOL_TAILCALL:
+	case LOL_BRANCH:
+	case LOL_BRANCH_Z:
+	case LOL_BRANCH_NZ:
+	case LOL_BR_NEQ_8:
+	case LOL_BR_NEQ_32:
+	case LOL_BR_NEQ_64:
+	case LOL_BR_NEQ_F32:
+	case LOL_BR_NEQ_F64:
+	case LOL_BR_EQ_8:
+	case LOL_BR_EQ_32:
+	case LOL_BR_EQ_64:
+	case LOL_BR_EQ_F32:
+	case LOL_BR_EQ_F64:
+	case LOL_BR_GE_U8:
+	case LOL_BR_GE_I32:
+	case LOL_BR_GE_I64:
+	case LOL_BR_GE_F32:
+	case LOL_BR_GE_F64:
+	case LOL_BR_GT_U8:
+	case LOL_BR_GT_I32:
+	case LOL_BR_GT_I64:
+	case LOL_BR_GT_F32:
+	case LOL_BR_GT_F64:
+	case LOL_BRI_NEQ_32:
+	case LOL_BRI_EQ_32:
+	case LOL_BRI_GE_I32:
+	case LOL_BRI_GT_I32:
+	case LOL_ADDI_32_BR:
+	case LOL_ADDI_64_BR:
+	case LOL_SETI_ADD_32_BR:
+	case LOL_SETI_ADD_64_BR:
+	case LOL_LOOP_INC_LT_I32:
+	case LOL_LOOP_INC_LE_I32:
+		return 1;
+	default:
+		return 0;
 	}
 }
 
-void lolvm_step_manually(struct lolvm *vm)
+// Whether 'op' targets a function rather than a branch target
+static int lolvm_is_call(enum lolvm_op op)
 {
-	while (!vm->halted) {
-		printf("sptr: %zu, cptr: %zu\n", vm->sptr, vm->cptr);
-		printf("%04zu: ", vm->iptr);
-		size_t n = pretty_print_instruction(&vm->instrs[vm->iptr]);
-		for (size_t i = 0; i < n + 1; ++i) {
-			if (i == n) {
-				printf("%02x\n", vm->instrs[vm->iptr + i]);
-			} else {
-				printf("%02x ", vm->instrs[vm->iptr + i]);
+	return op == LOL_CALL || op == LOL_SPAWN || op == LOL_TAILCALL;
+}
+
+// Find the index of the instruction at byte address 'addr',
+// or (size_t)-1 if no instruction starts there.
+size_t lolvm_program_find(struct lolvm_program *prog, size_t addr)
+{
+	size_t lo = 0;
+	size_t hi = prog->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (prog->addrs[mid] < addr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo < prog->count && prog->addrs[lo] == addr) {
+		return lo;
+	}
+
+	return (size_t)-1;
+}
+
+// Translate raw bytecode into the decoded form executed by the interpreter.
+// The bytecode must outlive the program.
+int lolvm_program_init(struct lolvm_program *prog, const unsigned char *bytecode, size_t size)
+{
+	prog->bytecode = bytecode;
+	prog->size = size;
+	prog->code = NULL;
+	prog->addrs = NULL;
+	prog->count = 0;
+	prog->error = NULL;
+	prog->error_addr = 0;
+	prog->sandbox = 0;
+	prog->verified = 0;
+
+	// Every instruction is at least one byte, so 'size' instructions
+	// plus the trailing HALT is an upper bound.
+	prog->code = malloc((size + 1) * sizeof(*prog->code));
+	prog->addrs = malloc((size + 1) * sizeof(*prog->addrs));
+	if (!prog->code || !prog->addrs) {
+		return lolvm_program_fail(prog, "Out of memory", 0);
+	}
+
+	size_t addr = 0;
+	while (addr < size) {
+		struct lolvm_instr *instr = &prog->code[prog->count];
+		int n = lolvm_decode_instruction(bytecode, size, addr, instr);
+		if (n < 0) {
+			return lolvm_program_fail(prog, "Truncated instruction", addr);
+		}
+
+		prog->addrs[prog->count++] = addr;
+		addr += n + 1;
+	}
+
+	memset(&prog->code[prog->count], 0, sizeof(*prog->code));
+	prog->code[prog->count].op = LOL_HALT;
+	prog->code[prog->count].len = 1;
+	prog->addrs[prog->count++] = size;
+
+	// Replace byte addresses with instruction indices
+	for (size_t i = 0; i < prog->count; ++i) {
+		struct lolvm_instr *instr = &prog->code[i];
+		if (!lolvm_is_jump(instr->op)) {
+			continue;
+		}
+
+		size_t index = lolvm_program_find(prog, instr->target);
+		if (index == (size_t)-1) {
+			return lolvm_program_fail(prog, "Jump to the middle of an instruction", prog->addrs[i]);
+		}
+
+		instr->target = index;
+	}
+
+	return 0;
+}
+
+void lolvm_program_destroy(struct lolvm_program *prog)
+{
+	free(prog->code);
+	free(prog->addrs);
+	prog->code = NULL;
+	prog->addrs = NULL;
+	prog->count = 0;
+}
+
+// The size of 'count' elements of 'size' bytes. Sizes too big for 32 bits
+// saturate, so they fail any bounds check.
+static uint32_t lolvm_vector_size(uint64_t count, uint32_t size)
+{
+	return count * size > UINT32_MAX ? UINT32_MAX : (uint32_t)(count * size);
+}
+
+// How many bytes of the stack the operands a, b, c and d access,
+// relative to the frame. Returns -1 for unknown opcodes.
+static int lolvm_operand_sizes(
+		const struct lolvm_program *prog, const struct lolvm_instr *instr, uint32_t sizes[4])
+{
+	uint32_t ptr = prog->sandbox ? 4 : 8;
+	sizes[0] = sizes[1] = sizes[2] = sizes[3] = 0;
+
+	switch ((enum lolvm_op)instr->op) {
+	case LOL_SETI_8: sizes[0] = 1; return 0;
+	case LOL_SETI_32: sizes[0] = 4; return 0;
+	case LOL_SETI_64: sizes[0] = 8; return 0;
+
+	case LOL_COPY_8: sizes[0] = sizes[1] = 1; return 0;
+	case LOL_COPY_32: sizes[0] = sizes[1] = 4; return 0;
+	case LOL_COPY_64: sizes[0] = sizes[1] = 8; return 0;
+	case LOL_COPY_N: sizes[0] = sizes[1] = (uint32_t)instr->imm; return 0;
+
+	case LOL_ADD_8: sizes[0] = sizes[1] = sizes[2] = 1; return 0;
+	case LOL_ADD_32:
+	case LOL_ADD_F32: sizes[0] = sizes[1] = sizes[2] = 4; return 0;
+	case LOL_ADD_64:
+	case LOL_ADD_F64: sizes[0] = sizes[1] = sizes[2] = 8; return 0;
+
+	case LOL_ADDI_8: sizes[0] = sizes[1] = 1; return 0;
+	case LOL_ADDI_32: sizes[0] = sizes[1] = 4; return 0;
+	case LOL_ADDI_64: sizes[0] = sizes[1] = 8; return 0;
+
+	case LOL_EQ_8:
+	case LOL_NEQ_8:
+	case LOL_LT_U8:
+	case LOL_LE_U8: sizes[0] = sizes[1] = sizes[2] = 1; return 0;
+	case LOL_EQ_32:
+	case LOL_EQ_F32:
+	case LOL_NEQ_32:
+	case LOL_NEQ_F32:
+	case LOL_LT_I32:
+	case LOL_LT_F32:
+	case LOL_LE_I32:
+	case LOL_LE_F32: sizes[0] = 1; sizes[1] = sizes[2] = 4; return 0;
+	case LOL_EQ_64:
+	case LOL_EQ_F64:
+	case LOL_NEQ_64:
+	case LOL_NEQ_F64:
+	case LOL_LT_I64:
+	case LOL_LT_F64:
+	case LOL_LE_I64:
+	case LOL_LE_F64: sizes[0] = 1; sizes[1] = sizes[2] = 8; return 0;
+
+	// The pointer operands; what they point to is checked at runtime
+	case LOL_REF: sizes[0] = ptr; return 0;
+	case LOL_LOAD_8: sizes[0] = 1; sizes[1] = ptr; return 0;
+	case LOL_LOAD_32: sizes[0] = 4; sizes[1] = ptr; return 0;
+	case LOL_LOAD_64: sizes[0] = 8; sizes[1] = ptr; return 0;
+	case LOL_LOAD_N: sizes[0] = (uint32_t)instr->imm; sizes[1] = ptr; return 0;
+	case LOL_STORE_8: sizes[0] = ptr; sizes[1] = 1; return 0;
+	case LOL_STORE_32: sizes[0] = ptr; sizes[1] = 4; return 0;
+	case LOL_STORE_64: sizes[0] = ptr; sizes[1] = 8; return 0;
+	case LOL_STORE_N: sizes[0] = ptr; sizes[1] = (uint32_t)instr->imm; return 0;
+
+	case LOL_ALLOC:
+	case LOL_FREE: sizes[0] = ptr; return 0;
+	case LOL_ARENA_BEGIN:
+	case LOL_ARENA_RESET: sizes[0] = 8; return 0;
+
+	case LOL_CHAN_NEW: sizes[0] = 4; return 0;
+	case LOL_CHAN_SEND:
+	case LOL_CHAN_RECV: sizes[0] = 4; sizes[1] = (uint32_t)instr->imm; return 0;
+
+	case LOL_WRITE_N: sizes[0] = (uint32_t)instr->imm; return 0;
+
+	case LOL_CALL:
+	case LOL_SPAWN:
+	case LOL_RETURN:
+	case LOL_YIELD:
+	case LOL_FLUSH:
+	case LOL_BRANCH:
+	case LOL_HALT:
+		return 0;
+	case LOL_BRANCH_Z:
+	case LOL_BRANCH_NZ:
+	case LOL_DBG_PRINT_U8:
+	case LOL_PRINT_U8: sizes[0] = 1; return 0;
+	case LOL_DBG_PRINT_I32:
+	case LOL_DBG_PRINT_F32:
+	case LOL_PRINT_I32:
+	case LOL_PRINT_F32: sizes[0] = 4; return 0;
+	case LOL_DBG_PRINT_I64:
+	case LOL_DBG_PRINT_F64:
+	case LOL_PRINT_I64:
+	case LOL_PRINT_F64: sizes[0] = 8; return 0;
+
+	case LOL_BR_NEQ_8:
+	case LOL_BR_EQ_8:
+	case LOL_BR_GE_U8:
+	case LOL_BR_GT_U8: sizes[0] = sizes[1] = sizes[2] = 1; return 0;
+	case LOL_BR_NEQ_32:
+	case LOL_BR_NEQ_F32:
+	case LOL_BR_EQ_32:
+	case LOL_BR_EQ_F32:
+	case LOL_BR_GE_I32:
+	case LOL_BR_GE_F32:
+	case LOL_BR_GT_I32:
+	case LOL_BR_GT_F32: sizes[0] = 1; sizes[1] = sizes[2] = 4; return 0;
+	case LOL_BR_NEQ_64:
+	case LOL_BR_NEQ_F64:
+	case LOL_BR_EQ_64:
+	case LOL_BR_EQ_F64:
+	case LOL_BR_GE_I64:
+	case LOL_BR_GE_F64:
+	case LOL_BR_GT_I64:
+	case LOL_BR_GT_F64: sizes[0] = 1; sizes[1] = sizes[2] = 8; return 0;
+
+	case LOL_BRI_NEQ_32:
+	case LOL_BRI_EQ_32:
+	case LOL_BRI_GE_I32:
+	case LOL_BRI_GT_I32:
+	case LOL_ADDI_32_BR:
+	case LOL_LOOP_INC_LT_I32:
+	case LOL_LOOP_INC_LE_I32: sizes[0] = sizes[1] = 4; return 0;
+	case LOL_ADDI_64_BR: sizes[0] = sizes[1] = 8; return 0;
+	case LOL_SETI_ADD_32_BR: sizes[0] = sizes[1] = sizes[2] = 4; return 0;
+	case LOL_SETI_ADD_64_BR: sizes[0] = sizes[1] = sizes[2] = 8; return 0;
+	case LOL_COPY2_32: sizes[0] = sizes[1] = sizes[2] = sizes[3] = 4; return 0;
+	case LOL_COPY2_64: sizes[0] = sizes[1] = sizes[2] = sizes[3] = 8; return 0;
+
+	// The parameters end where the frame starts
+	case LOL_TAILCALL: sizes[0] = sizes[1] = instr->b < 0 ? (uint32_t)-instr->b : 0; return 0;
+
+	case LOL_VADD_I32:
+	case LOL_VADD_F32: sizes[0] = sizes[1] = sizes[2] = lolvm_vector_size(instr->imm, 4); return 0;
+	case LOL_VEQ_I32:
+	case LOL_VLT_I32:
+	case LOL_VLE_I32:
+		sizes[0] = lolvm_vector_size(instr->imm, 1);
+		sizes[1] = sizes[2] = lolvm_vector_size(instr->imm, 4);
+		return 0;
+	case LOL_VSUM_I32:
+	case LOL_VSUM_F32:
+	case LOL_VMIN_I32:
+	case LOL_VMAX_I32: sizes[0] = 4; sizes[1] = lolvm_vector_size(instr->imm, 4); return 0;
+	case LOL_FILL_8: sizes[0] = lolvm_vector_size(instr->imm, 1); sizes[1] = 1; return 0;
+	case LOL_FILL_32: sizes[0] = lolvm_vector_size(instr->imm, 4); sizes[1] = 4; return 0;
+	case LOL_FILL_64: sizes[0] = lolvm_vector_size(instr->imm, 8); sizes[1] = 8; return 0;
+	}
+
+	return -1;
+}
+
+static int16_t lolvm_operand(const struct lolvm_instr *instr, int n)
+{
+	switch (n) {
+	case 0: return instr->a;
+	case 1: return instr->b;
+	case 2: return instr->c;
+	default: return instr->d;
+	}
+}
+
+// Whether execution never continues with the next instruction
+static int lolvm_is_terminator(enum lolvm_op op)
+{
+	switch (op) {
+	case LOL_RETURN:
+	case LOL_TAILCALL:
+	case LOL_BRANCH:
+	case LOL_HALT:
+	case LOL_ADDI_32_BR:
+	case LOL_ADDI_64_BR:
+	case LOL_SETI_ADD_32_BR:
+	case LOL_SETI_ADD_64_BR:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int lolvm_verify_fail(struct lolvm_program *prog, const char *error, size_t index)
+{
+	prog->error = error;
+	prog->error_addr = prog->addrs[index];
+	prog->verified = 0;
+	return -1;
+}
+
+struct lolvm_verify_func {
+	int64_t low; // Lowest frame offset accessed
+	int64_t high; // One past the highest frame offset accessed
+	size_t calls_start; // Range in the list of calls
+	size_t calls_end;
+	int state; // -1: not a function, 0: not summed up, 1: in progress, 2: done
+	size_t depth; // Deepest call chain starting here
+	size_t stack; // Stack used by the deepest chain
+};
+
+struct lolvm_verify_call {
+	size_t callee;
+	size_t bump;
+	size_t caller; // Tail calls run the callee in the caller's frame
+	int tail;
+};
+
+struct lolvm_verify {
+	struct lolvm_program *prog;
+	struct lolvm_verify_func *funcs; // Indexed by entry instruction
+	size_t *seen; // Which function last visited each instruction, plus one
+	size_t *worklist;
+	size_t *funclist;
+	size_t nfuncs;
+	struct lolvm_verify_call *calls;
+	size_t ncalls;
+	size_t calls_cap;
+	int recursive;
+};
+
+// Walk one function's control flow graph, collecting its frame extent
+// and the functions it calls
+static int lolvm_verify_function(struct lolvm_verify *v, size_t entry)
+{
+	struct lolvm_program *prog = v->prog;
+	struct lolvm_verify_func *func = &v->funcs[entry];
+	func->calls_start = v->ncalls;
+
+	size_t top = 0;
+	v->worklist[top++] = entry;
+	v->seen[entry] = entry + 1;
+	while (top > 0) {
+		size_t i = v->worklist[--top];
+		struct lolvm_instr *instr = &prog->code[i];
+
+		uint32_t sizes[4];
+		if (lolvm_operand_sizes(prog, instr, sizes) < 0) {
+			return lolvm_verify_fail(prog, "Unknown opcode", i);
+		}
+
+		switch (instr->op) {
+		// In a sandbox, pointers can't reach outside the VM's memory
+		case LOL_LOAD_8:
+		case LOL_LOAD_32:
+		case LOL_LOAD_64:
+		case LOL_LOAD_N:
+		case LOL_STORE_8:
+		case LOL_STORE_32:
+		case LOL_STORE_64:
+		case LOL_STORE_N:
+			if (!prog->sandbox) {
+				return lolvm_verify_fail(prog, "Memory access through a pointer", i);
+			}
+			break;
+		case LOL_RETURN:
+			if (entry == 0) {
+				return lolvm_verify_fail(prog, "RETURN outside of a function", i);
 			}
+			break;
+		case LOL_TAILCALL:
+			if (entry == 0) {
+				return lolvm_verify_fail(prog, "TAILCALL outside of a function", i);
+			} else if (instr->b > 0) {
+				return lolvm_verify_fail(prog, "TAILCALL with parameters above the frame", i);
+			}
+			break;
 		}
 
-		int ch = getchar();
-		if (ch == 'c') {
-			lolvm_run(vm);
-			return;
+		for (int n = 0; n < 4; ++n) {
+			if (sizes[n] == 0) {
+				continue;
+			}
+
+			int64_t offset = lolvm_operand(instr, n);
+			if (offset < func->low) {
+				func->low = offset;
+			}
+			if (offset + sizes[n] > func->high) {
+				func->high = offset + sizes[n];
+			}
 		}
 
-		lolvm_step(vm);
+		// A spawned fiber's stack starts with the frame up to the bump,
+		// so it's checked like a call from here, which can only need
+		// more stack than the fiber does
+		if (lolvm_is_call(instr->op)) {
+			int tail = instr->op == LOL_TAILCALL;
+			if (!tail && instr->a < 0) {
+				return lolvm_verify_fail(prog, "CALL with a negative stack bump", i);
+			}
+
+			if (v->ncalls == v->calls_cap) {
+				size_t cap = v->calls_cap ? v->calls_cap * 2 : 64;
+				struct lolvm_verify_call *calls = realloc(v->calls, cap * sizeof(*calls));
+				if (!calls) {
+					return lolvm_verify_fail(prog, "Out of memory", i);
+				}
+
+				v->calls = calls;
+				v->calls_cap = cap;
+			}
+
+			v->calls[v->ncalls].callee = instr->target;
+			v->calls[v->ncalls].bump = tail ? 0 : instr->a;
+			v->calls[v->ncalls].caller = entry;
+			v->calls[v->ncalls].tail = tail;
+			v->ncalls += 1;
+			if (v->funcs[instr->target].state < 0) {
+				v->funcs[instr->target].state = 0;
+				v->funclist[v->nfuncs++] = instr->target;
+			}
+		}
+
+		if (lolvm_is_jump(instr->op) && !lolvm_is_call(instr->op) && v->seen[instr->target] != entry + 1) {
+			v->seen[instr->target] = entry + 1;
+			v->worklist[top++] = instr->target;
+		}
+
+		size_t next = i + instr->len;
+		if (!lolvm_is_terminator(instr->op) && next < prog->count && v->seen[next] != entry + 1) {
+			v->seen[next] = entry + 1;
+			v->worklist[top++] = next;
+		}
 	}
+
+	func->calls_end = v->ncalls;
+	return 0;
 }
 
-int main(int argc, char **argv)
+// Add up the stack used and call depth through each function's callees.
+// Uses 'worklist' as an explicit stack, since call chains can be long.
+static void lolvm_verify_sum(struct lolvm_verify *v)
 {
-	int do_print = 0;
-	int do_step = 0;
-	int do_run = -1;
-	const char *path = NULL;
+	size_t top = 0;
+	v->worklist[top++] = 0;
+	v->funcs[0].state = 1;
+	while (top > 0) {
+		size_t f = v->worklist[top - 1];
+		struct lolvm_verify_func *func = &v->funcs[f];
 
-	for (int i = 1; i < argc; ++i) {
-		if (strcmp(argv[i], "--step") == 0) {
-			do_step = 1;
-			if (do_run < 0) do_run = 0;
-		} else if (strcmp(argv[i], "--print") == 0) {
-			do_print = 1;
-			if (do_run < 0) do_run = 0;
-		} else if (strcmp(argv[i], "--run") == 0) {
-			do_run = 1;
-		} else if (argv[i][0] == '-') {
-			printf("Unknown option: %s\n", argv[i]);
-			return 1;
-		} else {
-			path = argv[i];
+		// Descend into the first callee which hasn't been summed up yet
+		// A function which tail calls itself doesn't use any more
+		// stack for it, so that isn't counted as recursion
+		int descended = 0;
+		for (size_t c = func->calls_start; c < func->calls_end; ++c) {
+			struct lolvm_verify_func *callee = &v->funcs[v->calls[c].callee];
+			if (v->calls[c].tail && v->calls[c].callee == f) {
+				continue;
+			} else if (callee->state == 1) {
+				v->recursive = 1;
+			} else if (callee->state == 0) {
+				callee->state = 1;
+				v->worklist[top++] = v->calls[c].callee;
+				descended = 1;
+				break;
+			}
 		}
+
+		if (descended) {
+			continue;
+		}
+
+		func->depth = 0;
+		func->stack = func->high;
+		for (size_t c = func->calls_start; c < func->calls_end; ++c) {
+			struct lolvm_verify_func *callee = &v->funcs[v->calls[c].callee];
+			if (v->calls[c].tail && v->calls[c].callee == f) {
+				continue;
+			}
+
+			size_t depth = callee->depth + !v->calls[c].tail;
+			if (depth > func->depth) {
+				func->depth = depth;
+			}
+			if (v->calls[c].bump + callee->stack > func->stack) {
+				func->stack = v->calls[c].bump + callee->stack;
+			}
+		}
+
+		func->state = 2;
+		top -= 1;
 	}
+}
 
-	if (do_run < 0) {
-		do_run = 1;
+int lolvm_program_verify(struct lolvm_program *prog)
+{
+	struct lolvm_verify v = {0};
+	v.prog = prog;
+	v.funcs = calloc(prog->count, sizeof(*v.funcs));
+	v.seen = calloc(prog->count, sizeof(*v.seen));
+	v.worklist = malloc(prog->count * sizeof(*v.worklist));
+	v.funclist = malloc(prog->count * sizeof(*v.funclist));
+	int ret = -1;
+	if (!v.funcs || !v.seen || !v.worklist || !v.funclist) {
+		lolvm_verify_fail(prog, "Out of memory", 0);
+		goto out;
 	}
 
-	if (!path) {
-		printf("Usage: %s <path>\n", argv[0]);
-		return 1;
+	for (size_t i = 0; i < prog->count; ++i) {
+		v.funcs[i].state = -1;
 	}
 
-	unsigned char bytecode[1024];
-	bytecode[0] = LOL_HALT;
-	FILE *f = fopen(path, "rb");
-	if (!f) {
-		return 1;
+	// The entry code runs with the stack pointer at 0
+	v.funcs[0].state = 0;
+	v.funclist[v.nfuncs++] = 0;
+	for (size_t f = 0; f < v.nfuncs; ++f) {
+		if (lolvm_verify_function(&v, v.funclist[f]) < 0) {
+			goto out;
+		}
+	}
+
+	// A function's stack pointer is at least the stack bump of the CALL
+	// which got there, so that's how far back it can safely reach
+	if (v.funcs[0].low < 0) {
+		lolvm_verify_fail(prog, "Stack underflow", 0);
+		goto out;
 	}
 
-	size_t n = fread(bytecode, 1, sizeof(bytecode), f);
-	fclose(f);
+	// A tail call's callee can reach as far back as its caller could
+	for (size_t c = 0; c < v.ncalls; ++c) {
+		if (v.calls[c].tail) {
+			if (v.funcs[v.calls[c].callee].low < v.funcs[v.calls[c].caller].low) {
+				lolvm_verify_fail(prog, "Function reads below its tail caller's frame", v.calls[c].callee);
+				goto out;
+			}
+		} else if ((int64_t)v.calls[c].bump + v.funcs[v.calls[c].callee].low < 0) {
+			lolvm_verify_fail(prog, "Function reads below its caller's stack bump", v.calls[c].callee);
+			goto out;
+		}
+	}
+
+	lolvm_verify_sum(&v);
+
+	prog->max_bump = 0;
+	for (size_t c = 0; c < v.ncalls; ++c) {
+		if (v.calls[c].bump > prog->max_bump) {
+			prog->max_bump = v.calls[c].bump;
+		}
+	}
+
+	if (v.recursive) {
+		prog->max_calls = SIZE_MAX;
+		prog->max_stack = 0;
+		for (size_t f = 0; f < v.nfuncs; ++f) {
+			size_t high = v.funcs[v.funclist[f]].high;
+			if (high > prog->max_stack) {
+				prog->max_stack = high;
+			}
+		}
+	} else {
+		prog->max_calls = v.funcs[0].depth;
+		prog->max_stack = v.funcs[0].stack;
+	}
+
+	prog->verified = 1;
+	ret = 0;
+
+out:
+	free(v.funcs);
+	free(v.seen);
+	free(v.worklist);
+	free(v.funclist);
+	free(v.calls);
+	return ret;
+}
+
+// The superinstruction for a comparison followed by BRANCH_Z on its result
+static int lolvm_compare_branch_op(enum lolvm_op op)
+{
+	switch (op) {
+	case LOL_EQ_8: return LOL_BR_NEQ_8;
+	case LOL_EQ_32: return LOL_BR_NEQ_32;
+	case LOL_EQ_64: return LOL_BR_NEQ_64;
+	case LOL_EQ_F32: return LOL_BR_NEQ_F32;
+	case LOL_EQ_F64: return LOL_BR_NEQ_F64;
+	case LOL_NEQ_8: return LOL_BR_EQ_8;
+	case LOL_NEQ_32: return LOL_BR_EQ_32;
+	case LOL_NEQ_64: return LOL_BR_EQ_64;
+	case LOL_NEQ_F32: return LOL_BR_EQ_F32;
+	case LOL_NEQ_F64: return LOL_BR_EQ_F64;
+	case LOL_LT_U8: return LOL_BR_GE_U8;
+	case LOL_LT_I32: return LOL_BR_GE_I32;
+	case LOL_LT_I64: return LOL_BR_GE_I64;
+	case LOL_LT_F32: return LOL_BR_GE_F32;
+	case LOL_LT_F64: return LOL_BR_GE_F64;
+	case LOL_LE_U8: return LOL_BR_GT_U8;
+	case LOL_LE_I32: return LOL_BR_GT_I32;
+	case LOL_LE_I64: return LOL_BR_GT_I64;
+	case LOL_LE_F32: return LOL_BR_GT_F32;
+	case LOL_LE_F64: return LOL_BR_GT_F64;
+	default: return -1;
+	}
+}
+
+// The superinstruction for SETI_32, a comparison against the constant
+// and BRANCH_Z on its result
+static int lolvm_compare_imm_branch_op(enum lolvm_op op)
+{
+	switch (op) {
+	case LOL_EQ_32: return LOL_BRI_NEQ_32;
+	case LOL_NEQ_32: return LOL_BRI_EQ_32;
+	case LOL_LT_I32: return LOL_BRI_GE_I32;
+	case LOL_LE_I32: return LOL_BRI_GT_I32;
+	default: return -1;
+	}
+}
+
+static int lolvm_fits_i32(uint64_t imm)
+{
+	return (int64_t)imm >= INT32_MIN && (int64_t)imm <= INT32_MAX;
+}
+
+// The comparison a BR_* superinstruction starts with
+static enum lolvm_op lolvm_branch_compare_op(enum lolvm_op op)
+{
+	for (int cmp = LOL_EQ_8; cmp <= LOL_LE_F64; ++cmp) {
+		if (lolvm_compare_branch_op(cmp) == (int)op) {
+			return cmp;
+		}
+	}
+
+	return op;
+}
+
+// Try to fuse the sequence starting at code[i] into a superinstruction.
+// 'n' is the number of instructions available from code[i] onwards.
+// Returns the length of the fused sequence, or 0.
+static int lolvm_fuse_at(struct lolvm_instr *code, size_t n)
+{
+	struct lolvm_instr *x = &code[0];
+	struct lolvm_instr *y = &code[1];
+	struct lolvm_instr *z = n >= 3 ? &code[2] : NULL;
+	struct lolvm_instr fused = {0};
+	int op;
+
+	// SETI_32 t, imm; EQ_32 t, a, t; BRANCH_Z t, delta
+	if (
+			z && x->op == LOL_SETI_32 &&
+			(op = lolvm_compare_imm_branch_op(y->op)) >= 0 &&
+			y->a == x->a && y->c == x->a &&
+			z->op == LOL_BRANCH_Z && z->a == x->a) {
+		fused.op = op;
+		fused.len = 3;
+		fused.a = x->a;
+		fused.b = y->b;
+		fused.imm32 = (uint32_t)x->imm;
+		fused.target = z->target;
+		*x = fused;
+		return 3;
+	}
+
+	// SETI_32 t, imm; ADD_32 dest, a, t; BRANCH delta
+	if (
+			z && (
+				(x->op == LOL_SETI_32 && y->op == LOL_ADD_32) ||
+				(x->op == LOL_SETI_64 && y->op == LOL_ADD_64 && lolvm_fits_i32(x->imm))) &&
+			(y->b == x->a || y->c == x->a) &&
+			z->op == LOL_BRANCH) {
+		fused.op = x->op == LOL_SETI_32 ? LOL_SETI_ADD_32_BR : LOL_SETI_ADD_64_BR;
+		fused.len = 3;
+		fused.a = y->a;
+		fused.b = y->c == x->a ? y->b : y->c;
+		fused.c = x->a;
+		fused.imm32 = (uint32_t)x->imm;
+		fused.target = z->target;
+		*x = fused;
+		return 3;
+	}
+
+	// EQ_32 cond, a, b; BRANCH_Z cond, delta
+	if ((op = lolvm_compare_branch_op(x->op)) >= 0 && y->op == LOL_BRANCH_Z && y->a == x->a) {
+		fused.op = op;
+		fused.len = 2;
+		fused.a = x->a;
+		fused.b = x->b;
+		fused.c = x->c;
+		fused.target = y->target;
+		*x = fused;
+		return 2;
+	}
 
-	if (do_print) {
-		pretty_print(bytecode, n);
+	// ADDI_32 dest, a, imm; BRANCH delta
+	if (
+			(x->op == LOL_ADDI_32 || (x->op == LOL_ADDI_64 && lolvm_fits_i32(x->imm))) &&
+			y->op == LOL_BRANCH) {
+		fused.op = x->op == LOL_ADDI_32 ? LOL_ADDI_32_BR : LOL_ADDI_64_BR;
+		fused.len = 2;
+		fused.a = x->a;
+		fused.b = x->b;
+		fused.imm32 = (uint32_t)x->imm;
+		fused.target = y->target;
+		*x = fused;
+		return 2;
+	}
+
+	// COPY_32 dest, src; COPY_32 dest2, src2
+	if (
+			(x->op == LOL_COPY_32 && y->op == LOL_COPY_32) ||
+			(x->op == LOL_COPY_64 && y->op == LOL_COPY_64)) {
+		fused.op = x->op == LOL_COPY_32 ? LOL_COPY2_32 : LOL_COPY2_64;
+		fused.len = 2;
+		fused.a = x->a;
+		fused.b = x->b;
+		fused.c = y->a;
+		fused.d = y->b;
+		*x = fused;
+		return 2;
 	}
 
-	if (do_step) {
-		struct lolvm vm;
-		lolvm_init(&vm, bytecode);
-		lolvm_step_manually(&vm);
+	return 0;
+}
+
+// Fuse instruction sequences which lie entirely within [start, end).
+// Fusion leaves the rest of each sequence intact, so the thread which runs
+// the program can do this between instructions, as tier-up does.
+size_t lolvm_program_fuse_range(struct lolvm_program *prog, size_t start, size_t end)
+{
+	size_t fused = 0;
+	size_t i = start;
+	while (i + 1 < end) {
+		int n = lolvm_fuse_at(&prog->code[i], end - i);
+		if (n > 0) {
+			fused += 1;
+			i += n;
+		} else {
+			i += 1;
+		}
 	}
 
-	if (do_run) {
-		struct lolvm vm;
-		lolvm_init(&vm, bytecode);
-		lolvm_run(&vm);
+	return fused;
+}
+
+// Rewrite common instruction sequences into superinstructions.
+// A superinstruction replaces the first instruction of its sequence and
+// continues after the last one. The rest of the sequence is left in place,
+// so jumps into the middle of it still run the original instructions.
+// Returns the number of sequences fused.
+size_t lolvm_program_fuse(struct lolvm_program *prog)
+{
+	return lolvm_program_fuse_range(prog, 0, prog->count);
+}
+
+// Find the end of the function starting at 'start': the first RETURN
+// or HALT which no branch in the function jumps past
+static size_t lolvm_program_function_end(struct lolvm_program *prog, size_t start)
+{
+	size_t furthest = start;
+	for (size_t i = start; i < prog->count; ++i) {
+		struct lolvm_instr *ip = &prog->code[i];
+		if (!lolvm_is_call(ip->op) && lolvm_is_jump(ip->op) && ip->target > furthest) {
+			furthest = ip->target;
+		}
+
+		if ((ip->op == LOL_RETURN || ip->op == LOL_HALT) && i >= furthest) {
+			return i + 1;
+		}
 	}
+
+	return prog->count;
+}
+
+// Stack offsets are 16 bits, so it takes more than one guard page
+// to make sure that any access past either end of the stack faults
+#define LOLVM_STACK_GUARD (64 * 1024)
+
+static size_t lolvm_round_to_page(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) / page * page;
+}
+
+// Map 'size' bytes of memory with at least 'guard' bytes of inaccessible
+// memory on either side, so running off either end traps.
+// Pages are only allocated once they're touched.
+static void *lolvm_map_guarded(size_t size, size_t guard)
+{
+	size = lolvm_round_to_page(size);
+	guard = lolvm_round_to_page(guard);
+	unsigned char *mem = mmap(
+		NULL, guard + size + guard, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (mprotect(mem + guard, size, PROT_READ | PROT_WRITE) < 0) {
+		munmap(mem, guard + size + guard);
+		return NULL;
+	}
+
+	return mem + guard;
+}
+
+static void lolvm_unmap_guarded(void *ptr, size_t size, size_t guard)
+{
+	if (ptr) {
+		size = lolvm_round_to_page(size);
+		guard = lolvm_round_to_page(guard);
+		munmap((unsigned char *)ptr - guard, guard + size + guard);
+	}
+}
+
+/*
+ * A sandboxed VM's pointers are 32-bit offsets into its memory, and no
+ * access is longer than 4 GiB, so reserving 8 GiB means every pointer
+ * lands inside the reservation. Only the stack and the heap are
+ * accessible; the rest faults. The stack starts LOLVM_STACK_GUARD bytes
+ * in, which also makes null pointers fault, and the heap comes after
+ * another guard.
+ */
+#define LOLVM_SANDBOX_SIZE ((size_t)8 << 30)
+
+static int lolvm_map_sandbox(struct lolvm *vm)
+{
+	size_t guard = lolvm_round_to_page(LOLVM_STACK_GUARD);
+	size_t stack_size = lolvm_round_to_page(vm->stack_size);
+	if (stack_size > UINT32_MAX - 2 * guard - LOLVM_HEAP_SIZE) {
+		return -1;
+	}
+
+	unsigned char *mem = mmap(
+		NULL, LOLVM_SANDBOX_SIZE, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		return -1;
+	}
+
+	vm->memory = mem;
+	unsigned char *heap = mem + guard + stack_size + guard;
+	if (mprotect(mem + guard, stack_size, PROT_READ | PROT_WRITE) < 0 ||
+			mprotect(heap, LOLVM_HEAP_SIZE, PROT_READ | PROT_WRITE) < 0) {
+		return -1;
+	}
+
+	vm->stack = mem + guard;
+	vm->heap.base = heap;
+	return 0;
+}
+
+// Whether the program uses fibers or channels
+static int lolvm_has_fibers(const struct lolvm_program *prog)
+{
+	for (size_t i = 0; i < prog->count; ++i) {
+		if (prog->code[i].op == LOL_SPAWN || prog->code[i].op == LOL_CHAN_NEW) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Every fiber after the main one gets a stack and a call stack of the
+ * same size as the main fiber's, so the verifier's limits hold for all
+ * of them. They're reserved up front, each followed by a guard, and made
+ * accessible the first time they're used. A sandbox's fiber stacks go
+ * after its heap, within reach of 32-bit pointers.
+ */
+static int lolvm_fibers_init(struct lolvm *vm)
+{
+	struct lolvm_fibers *fibers = &vm->fibers;
+	size_t guard = lolvm_round_to_page(LOLVM_STACK_GUARD);
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t extra = LOLVM_FIBERS - 1;
+	fibers->stack_stride = lolvm_round_to_page(vm->stack_size) + guard;
+	fibers->callstack_stride = lolvm_round_to_page(vm->callstack_size * sizeof(*vm->callstack)) + page;
+
+	if (vm->memory) {
+		fibers->stacks = vm->heap.base + LOLVM_HEAP_SIZE + guard;
+		size_t start = fibers->stacks - vm->memory;
+		size_t room = start < UINT32_MAX ? UINT32_MAX - start : 0;
+		if (room / fibers->stack_stride < extra) {
+			extra = room / fibers->stack_stride;
+		}
+	} else {
+		unsigned char *mem = mmap(
+			NULL, guard + extra * fibers->stack_stride, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED) {
+			return -1;
+		}
+
+		fibers->stacks = mem + guard;
+	}
+
+	fibers->count = extra + 1;
+	void *callstacks = mmap(
+		NULL, extra * fibers->callstack_stride, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	fibers->fibers = calloc(fibers->count, sizeof(*fibers->fibers));
+	fibers->channels = malloc(LOLVM_CHANNELS * sizeof(*fibers->channels));
+	if (callstacks == MAP_FAILED || !fibers->fibers || !fibers->channels) {
+		fibers->callstacks = NULL;
+		return -1;
+	}
+
+	fibers->callstacks = callstacks;
+	fibers->fibers[0].stack = vm->stack;
+	fibers->fibers[0].callstack = vm->callstack;
+	for (size_t i = 1; i < fibers->count; ++i) {
+		fibers->fibers[i].stack = fibers->stacks + (i - 1) * fibers->stack_stride;
+		fibers->fibers[i].callstack = (void *)(
+			(unsigned char *)fibers->callstacks + (i - 1) * fibers->callstack_stride);
+	}
+
+	return 0;
+}
+
+static void lolvm_fibers_destroy(struct lolvm *vm)
+{
+	struct lolvm_fibers *fibers = &vm->fibers;
+	size_t guard = lolvm_round_to_page(LOLVM_STACK_GUARD);
+	size_t extra = fibers->count ? fibers->count - 1 : 0;
+	if (fibers->stacks && !vm->memory) {
+		munmap(fibers->stacks - guard, guard + extra * fibers->stack_stride);
+	}
+
+	if (fibers->callstacks) {
+		munmap(fibers->callstacks, extra * fibers->callstack_stride);
+	}
+
+	free(fibers->fibers);
+	free(fibers->channels);
+	memset(fibers, 0, sizeof(*fibers));
+}
+
+/*
+ * Vector instructions work on arrays of 'n' elements on the stack. Each
+ * has a plain C version, and on x86-64 SSE2 and AVX2 versions, and
+ * lolvm_vector_init picks the best ones the CPU supports. All of them
+ * give the same results: VSUM_F32 adds up the elements in 8 lanes and
+ * combines them in a fixed order, however wide the vectors really are.
+ * The destination can be the same array as a source.
+ */
+
+enum lolvm_vector_compare {
+	LOLVM_VECTOR_EQ,
+	LOLVM_VECTOR_LT,
+	LOLVM_VECTOR_LE,
+};
+
+typedef void (*lolvm_vector_binary_fn)(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n);
+typedef void (*lolvm_vector_unary_fn)(unsigned char *dest, const unsigned char *src, uint32_t n);
+
+static struct {
+	lolvm_vector_binary_fn add_i32;
+	lolvm_vector_binary_fn add_f32;
+	lolvm_vector_binary_fn eq_i32;
+	lolvm_vector_binary_fn lt_i32;
+	lolvm_vector_binary_fn le_i32;
+	lolvm_vector_unary_fn sum_i32;
+	lolvm_vector_unary_fn sum_f32;
+	lolvm_vector_unary_fn min_i32;
+	lolvm_vector_unary_fn max_i32;
+	lolvm_vector_unary_fn fill_32;
+} lolvm_vector;
+
+static pthread_once_t lolvm_vector_once = PTHREAD_ONCE_INIT;
+
+static void lolvm_vadd_i32_c(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; ++i) {
+		uint32_t x, y;
+		memcpy(&x, a + i * 4, 4);
+		memcpy(&y, b + i * 4, 4);
+		x += y;
+		memcpy(dest + i * 4, &x, 4);
+	}
+}
+
+static void lolvm_vadd_f32_c(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; ++i) {
+		float x, y;
+		memcpy(&x, a + i * 4, 4);
+		memcpy(&y, b + i * 4, 4);
+		x += y;
+		memcpy(dest + i * 4, &x, 4);
+	}
+}
+
+static void lolvm_vcompare_i32_c(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n,
+		enum lolvm_vector_compare cmp)
+{
+	for (uint32_t i = 0; i < n; ++i) {
+		int32_t x, y;
+		memcpy(&x, a + i * 4, 4);
+		memcpy(&y, b + i * 4, 4);
+		switch (cmp) {
+		case LOLVM_VECTOR_EQ: dest[i] = x == y; break;
+		case LOLVM_VECTOR_LT: dest[i] = x < y; break;
+		case LOLVM_VECTOR_LE: dest[i] = x <= y; break;
+		}
+	}
+}
+
+#if !LOLVM_SIMD
+static void lolvm_veq_i32_c(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	lolvm_vcompare_i32_c(dest, a, b, n, LOLVM_VECTOR_EQ);
+}
+
+static void lolvm_vlt_i32_c(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	lolvm_vcompare_i32_c(dest, a, b, n, LOLVM_VECTOR_LT);
+}
+
+static void lolvm_vle_i32_c(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	lolvm_vcompare_i32_c(dest, a, b, n, LOLVM_VECTOR_LE);
+}
+#endif
+
+static void lolvm_vsum_i32_c(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	uint32_t sum = 0;
+	for (uint32_t i = 0; i < n; ++i) {
+		uint32_t x;
+		memcpy(&x, src + i * 4, 4);
+		sum += x;
+	}
+	memcpy(dest, &sum, 4);
+}
+
+// Combine the 8 lanes of a VSUM_F32, then add the elements after the
+// last full group of 8 one at a time
+static float lolvm_vsum_f32_finish(const float lanes[8], const unsigned char *rest, uint32_t n)
+{
+	float sum = ((lanes[0] + lanes[4]) + (lanes[2] + lanes[6])) +
+		((lanes[1] + lanes[5]) + (lanes[3] + lanes[7]));
+	for (uint32_t i = 0; i < n; ++i) {
+		float x;
+		memcpy(&x, rest + i * 4, 4);
+		sum += x;
+	}
+	return sum;
+}
+
+#if !LOLVM_SIMD
+static void lolvm_vsum_f32_c(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	float lanes[8] = {0};
+	uint32_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		for (int l = 0; l < 8; ++l) {
+			float x;
+			memcpy(&x, src + (i + l) * 4, 4);
+			lanes[l] += x;
+		}
+	}
+
+	float sum = lolvm_vsum_f32_finish(lanes, src + i * 4, n - i);
+	memcpy(dest, &sum, 4);
+}
+#endif
+
+static void lolvm_vmin_i32_c(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	int32_t min = INT32_MAX;
+	for (uint32_t i = 0; i < n; ++i) {
+		int32_t x;
+		memcpy(&x, src + i * 4, 4);
+		if (x < min) {
+			min = x;
+		}
+	}
+	memcpy(dest, &min, 4);
+}
+
+static void lolvm_vmax_i32_c(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	int32_t max = INT32_MIN;
+	for (uint32_t i = 0; i < n; ++i) {
+		int32_t x;
+		memcpy(&x, src + i * 4, 4);
+		if (x > max) {
+			max = x;
+		}
+	}
+	memcpy(dest, &max, 4);
+}
+
+static void lolvm_fill_32_c(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	uint32_t val;
+	memcpy(&val, src, 4);
+	for (uint32_t i = 0; i < n; ++i) {
+		memcpy(dest + i * 4, &val, 4);
+	}
+}
+
+// FILL_64 is only used for arrays of long and double, so it stays scalar
+static void lolvm_fill_64(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	for (uint32_t i = 0; i < n; ++i) {
+		memcpy(dest + i * 8, src, 8);
+	}
+}
+
+#if LOLVM_SIMD
+#define LOLVM_LOAD128(p) _mm_loadu_si128((const __m128i *)(p))
+#define LOLVM_STORE128(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+#define LOLVM_LOAD256(p) _mm256_loadu_si256((const __m256i *)(p))
+#define LOLVM_STORE256(p, v) _mm256_storeu_si256((__m256i *)(p), (v))
+
+// 4 comparison results from 'mask' as 0 or 1 bytes, in the low 32 bits
+static inline __m128i lolvm_vector_mask_bytes(__m128i mask)
+{
+	mask = _mm_packs_epi32(mask, mask);
+	mask = _mm_packs_epi16(mask, mask);
+	return _mm_and_si128(mask, _mm_set1_epi8(1));
+}
+
+static inline __m128i lolvm_vcompare_sse2(__m128i x, __m128i y, enum lolvm_vector_compare cmp)
+{
+	switch (cmp) {
+	case LOLVM_VECTOR_EQ: return _mm_cmpeq_epi32(x, y);
+	case LOLVM_VECTOR_LT: return _mm_cmpgt_epi32(y, x);
+	default: return _mm_xor_si128(_mm_cmpgt_epi32(x, y), _mm_set1_epi32(-1));
+	}
+}
+
+static void lolvm_vadd_i32_sse2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	uint32_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = LOLVM_LOAD128(a + i * 4);
+		__m128i y = LOLVM_LOAD128(b + i * 4);
+		LOLVM_STORE128(dest + i * 4, _mm_add_epi32(x, y));
+	}
+	lolvm_vadd_i32_c(dest + i * 4, a + i * 4, b + i * 4, n - i);
+}
+
+static void lolvm_vadd_f32_sse2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	uint32_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps((const float *)(a + i * 4));
+		__m128 y = _mm_loadu_ps((const float *)(b + i * 4));
+		_mm_storeu_ps((float *)(dest + i * 4), _mm_add_ps(x, y));
+	}
+	lolvm_vadd_f32_c(dest + i * 4, a + i * 4, b + i * 4, n - i);
+}
+
+static void lolvm_vcompare_i32_sse2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n,
+		enum lolvm_vector_compare cmp)
+{
+	uint32_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i mask = lolvm_vcompare_sse2(LOLVM_LOAD128(a + i * 4), LOLVM_LOAD128(b + i * 4), cmp);
+		int32_t bytes = _mm_cvtsi128_si32(lolvm_vector_mask_bytes(mask));
+		memcpy(dest + i, &bytes, 4);
+	}
+	lolvm_vcompare_i32_c(dest + i, a + i * 4, b + i * 4, n - i, cmp);
+}
+
+static void lolvm_veq_i32_sse2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	lolvm_vcompare_i32_sse2(dest, a, b, n, LOLVM_VECTOR_EQ);
+}
+
+static void lolvm_vlt_i32_sse2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	lolvm_vcompare_i32_sse2(dest, a, b, n, LOLVM_VECTOR_LT);
+}
+
+static void lolvm_vle_i32_sse2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	lolvm_vcompare_i32_sse2(dest, a, b, n, LOLVM_VECTOR_LE);
+}
+
+static void lolvm_vsum_i32_sse2(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	__m128i acc = _mm_setzero_si128();
+	uint32_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		acc = _mm_add_epi32(acc, LOLVM_LOAD128(src + i * 4));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	uint32_t rest;
+	lolvm_vsum_i32_c((unsigned char *)&rest, src + i * 4, n - i);
+	uint32_t sum = (uint32_t)_mm_cvtsi128_si32(acc) + rest;
+	memcpy(dest, &sum, 4);
+}
+
+static void lolvm_vsum_f32_sse2(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	__m128 lo = _mm_setzero_ps();
+	__m128 hi = _mm_setzero_ps();
+	uint32_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		lo = _mm_add_ps(lo, _mm_loadu_ps((const float *)(src + i * 4)));
+		hi = _mm_add_ps(hi, _mm_loadu_ps((const float *)(src + i * 4 + 16)));
+	}
+
+	float lanes[8];
+	_mm_storeu_ps(lanes, lo);
+	_mm_storeu_ps(lanes + 4, hi);
+	float sum = lolvm_vsum_f32_finish(lanes, src + i * 4, n - i);
+	memcpy(dest, &sum, 4);
+}
+
+// SSE2 has no 32-bit min and max, so they're a compare and a select
+static inline __m128i lolvm_vselect_sse2(__m128i mask, __m128i x, __m128i y)
+{
+	return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+static void lolvm_vminmax_i32_sse2(unsigned char *dest, const unsigned char *src, uint32_t n, int max)
+{
+	__m128i acc = _mm_set1_epi32(max ? INT32_MIN : INT32_MAX);
+	uint32_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i x = LOLVM_LOAD128(src + i * 4);
+		__m128i greater = _mm_cmpgt_epi32(x, acc);
+		acc = max ? lolvm_vselect_sse2(greater, x, acc) : lolvm_vselect_sse2(greater, acc, x);
+	}
+
+	int32_t lanes[5];
+	LOLVM_STORE128(lanes, acc);
+	if (max) {
+		lolvm_vmax_i32_c((unsigned char *)&lanes[4], src + i * 4, n - i);
+	} else {
+		lolvm_vmin_i32_c((unsigned char *)&lanes[4], src + i * 4, n - i);
+	}
+
+	int32_t result = lanes[0];
+	for (int l = 1; l < 5; ++l) {
+		if (max ? lanes[l] > result : lanes[l] < result) {
+			result = lanes[l];
+		}
+	}
+	memcpy(dest, &result, 4);
+}
+
+static void lolvm_vmin_i32_sse2(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	lolvm_vminmax_i32_sse2(dest, src, n, 0);
+}
+
+static void lolvm_vmax_i32_sse2(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	lolvm_vminmax_i32_sse2(dest, src, n, 1);
+}
+
+static void lolvm_fill_32_sse2(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	int32_t val;
+	memcpy(&val, src, 4);
+	__m128i v = _mm_set1_epi32(val);
+	uint32_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		LOLVM_STORE128(dest + i * 4, v);
+	}
+	lolvm_fill_32_c(dest + i * 4, src, n - i);
+}
+
+#define LOLVM_AVX2 __attribute__((target("avx2")))
+
+LOLVM_AVX2 static void lolvm_vadd_i32_avx2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	uint32_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = LOLVM_LOAD256(a + i * 4);
+		__m256i y = LOLVM_LOAD256(b + i * 4);
+		LOLVM_STORE256(dest + i * 4, _mm256_add_epi32(x, y));
+	}
+	lolvm_vadd_i32_sse2(dest + i * 4, a + i * 4, b + i * 4, n - i);
+}
+
+LOLVM_AVX2 static void lolvm_vadd_f32_avx2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	uint32_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_loadu_ps((const float *)(a + i * 4));
+		__m256 y = _mm256_loadu_ps((const float *)(b + i * 4));
+		_mm256_storeu_ps((float *)(dest + i * 4), _mm256_add_ps(x, y));
+	}
+	lolvm_vadd_f32_sse2(dest + i * 4, a + i * 4, b + i * 4, n - i);
+}
+
+LOLVM_AVX2 static void lolvm_vcompare_i32_avx2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n,
+		enum lolvm_vector_compare cmp)
+{
+	uint32_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = LOLVM_LOAD256(a + i * 4);
+		__m256i y = LOLVM_LOAD256(b + i * 4);
+		__m256i mask;
+		switch (cmp) {
+		case LOLVM_VECTOR_EQ: mask = _mm256_cmpeq_epi32(x, y); break;
+		case LOLVM_VECTOR_LT: mask = _mm256_cmpgt_epi32(y, x); break;
+		default: mask = _mm256_xor_si256(_mm256_cmpgt_epi32(x, y), _mm256_set1_epi32(-1)); break;
+		}
+
+		__m128i words = _mm_packs_epi32(
+			_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1));
+		__m128i bytes = _mm_and_si128(_mm_packs_epi16(words, words), _mm_set1_epi8(1));
+		_mm_storel_epi64((__m128i *)(dest + i), bytes);
+	}
+	lolvm_vcompare_i32_sse2(dest + i, a + i * 4, b + i * 4, n - i, cmp);
+}
+
+LOLVM_AVX2 static void lolvm_veq_i32_avx2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	lolvm_vcompare_i32_avx2(dest, a, b, n, LOLVM_VECTOR_EQ);
+}
+
+LOLVM_AVX2 static void lolvm_vlt_i32_avx2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	lolvm_vcompare_i32_avx2(dest, a, b, n, LOLVM_VECTOR_LT);
+}
+
+LOLVM_AVX2 static void lolvm_vle_i32_avx2(
+		unsigned char *dest, const unsigned char *a, const unsigned char *b, uint32_t n)
+{
+	lolvm_vcompare_i32_avx2(dest, a, b, n, LOLVM_VECTOR_LE);
+}
+
+LOLVM_AVX2 static void lolvm_vsum_i32_avx2(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	uint32_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		acc = _mm256_add_epi32(acc, LOLVM_LOAD256(src + i * 4));
+	}
+	__m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(1, 0, 3, 2)));
+	half = _mm_add_epi32(half, _mm_shuffle_epi32(half, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	uint32_t rest;
+	lolvm_vsum_i32_sse2((unsigned char *)&rest, src + i * 4, n - i);
+	uint32_t sum = (uint32_t)_mm_cvtsi128_si32(half) + rest;
+	memcpy(dest, &sum, 4);
+}
+
+LOLVM_AVX2 static void lolvm_vsum_f32_avx2(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	__m256 acc = _mm256_setzero_ps();
+	uint32_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		acc = _mm256_add_ps(acc, _mm256_loadu_ps((const float *)(src + i * 4)));
+	}
+
+	float lanes[8];
+	_mm256_storeu_ps(lanes, acc);
+	float sum = lolvm_vsum_f32_finish(lanes, src + i * 4, n - i);
+	memcpy(dest, &sum, 4);
+}
+
+LOLVM_AVX2 static void lolvm_vminmax_i32_avx2(
+		unsigned char *dest, const unsigned char *src, uint32_t n, int max)
+{
+	__m256i acc = _mm256_set1_epi32(max ? INT32_MIN : INT32_MAX);
+	uint32_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i x = LOLVM_LOAD256(src + i * 4);
+		acc = max ? _mm256_max_epi32(acc, x) : _mm256_min_epi32(acc, x);
+	}
+
+	int32_t lanes[9];
+	LOLVM_STORE256(lanes, acc);
+	if (max) {
+		lolvm_vmax_i32_sse2((unsigned char *)&lanes[8], src + i * 4, n - i);
+	} else {
+		lolvm_vmin_i32_sse2((unsigned char *)&lanes[8], src + i * 4, n - i);
+	}
+
+	int32_t result = lanes[0];
+	for (int l = 1; l < 9; ++l) {
+		if (max ? lanes[l] > result : lanes[l] < result) {
+			result = lanes[l];
+		}
+	}
+	memcpy(dest, &result, 4);
+}
+
+LOLVM_AVX2 static void lolvm_vmin_i32_avx2(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	lolvm_vminmax_i32_avx2(dest, src, n, 0);
+}
+
+LOLVM_AVX2 static void lolvm_vmax_i32_avx2(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	lolvm_vminmax_i32_avx2(dest, src, n, 1);
+}
+
+LOLVM_AVX2 static void lolvm_fill_32_avx2(unsigned char *dest, const unsigned char *src, uint32_t n)
+{
+	int32_t val;
+	memcpy(&val, src, 4);
+	__m256i v = _mm256_set1_epi32(val);
+	uint32_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		LOLVM_STORE256(dest + i * 4, v);
+	}
+	lolvm_fill_32_sse2(dest + i * 4, src, n - i);
+}
+#endif
+
+#define LOLVM_VECTOR_USE(level) \
+	lolvm_vector.add_i32 = lolvm_vadd_i32_ ## level; \
+	lolvm_vector.add_f32 = lolvm_vadd_f32_ ## level; \
+	lolvm_vector.eq_i32 = lolvm_veq_i32_ ## level; \
+	lolvm_vector.lt_i32 = lolvm_vlt_i32_ ## level; \
+	lolvm_vector.le_i32 = lolvm_vle_i32_ ## level; \
+	lolvm_vector.sum_i32 = lolvm_vsum_i32_ ## level; \
+	lolvm_vector.sum_f32 = lolvm_vsum_f32_ ## level; \
+	lolvm_vector.min_i32 = lolvm_vmin_i32_ ## level; \
+	lolvm_vector.max_i32 = lolvm_vmax_i32_ ## level; \
+	lolvm_vector.fill_32 = lolvm_fill_32_ ## level
+
+static void lolvm_vector_init(void)
+{
+#if LOLVM_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		LOLVM_VECTOR_USE(avx2);
+	} else {
+		LOLVM_VECTOR_USE(sse2);
+	}
+#else
+	LOLVM_VECTOR_USE(c);
+#endif
+}
+
+/*
+ * Output. Values are formatted straight into the VM's buffer, which
+ * always has room for a formatted value after lolvm_output_reserve.
+ */
+
+// The longest formatted DBG_PRINT_* line
+#define LOLVM_OUTPUT_LINE 64
+
+static int lolvm_write_all(int fd, const unsigned char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(fd, data, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			return -1;
+		}
+
+		data += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+static void lolvm_output_emit(struct lolvm_output *out, const unsigned char *data, size_t size)
+{
+	if (out->failed || size == 0) {
+		return;
+	}
+
+	if (out->fd >= 0) {
+		if (lolvm_write_all(out->fd, data, size) < 0) {
+			out->failed = 1;
+		}
+	} else if (out->file && fwrite(data, 1, size, out->file) != size) {
+		out->failed = 1;
+	}
+}
+
+static void lolvm_output_drain(struct lolvm_output *out)
+{
+	lolvm_output_emit(out, out->buf, out->len);
+	out->len = 0;
+}
+
+static void lolvm_output_flush(struct lolvm_output *out)
+{
+	lolvm_output_drain(out);
+	if (out->fd < 0 && out->file && fflush(out->file) != 0) {
+		out->failed = 1;
+	}
+}
+
+static inline char *lolvm_output_reserve(struct lolvm_output *out)
+{
+	if (LOLVM_OUTPUT_SIZE - out->len < LOLVM_OUTPUT_LINE) {
+		lolvm_output_drain(out);
+	}
+
+	return (char *)out->buf + out->len;
+}
+
+static void lolvm_output_write(struct lolvm_output *out, const unsigned char *src, size_t size)
+{
+	if (LOLVM_OUTPUT_SIZE - out->len < size) {
+		lolvm_output_drain(out);
+
+		// Too big to be worth copying
+		if (size > LOLVM_OUTPUT_SIZE) {
+			lolvm_output_emit(out, src, size);
+			return;
+		}
+	}
+
+	memcpy(out->buf + out->len, src, size);
+	out->len += size;
+}
+
+static const char lolvm_digits[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// Write 'val' in decimal at 'p' and return the end,
+// two digits at a time from the right
+static char *lolvm_format_u64(char *p, uint64_t val)
+{
+	char tmp[20];
+	char *end = tmp + sizeof(tmp);
+	char *start = end;
+	while (val >= 100) {
+		start -= 2;
+		memcpy(start, &lolvm_digits[(val % 100) * 2], 2);
+		val /= 100;
+	}
+
+	if (val >= 10) {
+		start -= 2;
+		memcpy(start, &lolvm_digits[val * 2], 2);
+	} else {
+		*--start = '0' + val;
+	}
+
+	memcpy(p, start, end - start);
+	return p + (end - start);
+}
+
+static char *lolvm_format_i64(char *p, int64_t val)
+{
+	if (val < 0) {
+		*p++ = '-';
+		return lolvm_format_u64(p, -(uint64_t)val);
+	}
+
+	return lolvm_format_u64(p, val);
+}
+
+// Like printf's %g. Numbers which %g writes without an exponent are
+// formatted by hand from their 6 significant digits; the rest, and ones
+// too close to halfway between two roundings to be sure which way
+// printf would round them, go through snprintf.
+static char *lolvm_format_double(char *p, double val)
+{
+	static const double pow10[] = {
+		1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+	};
+
+	if (val > -1e6 && val < 1e6 && val == (double)(int64_t)val && (val != 0 || !signbit(val))) {
+		return lolvm_format_i64(p, (int64_t)val);
+	}
+
+	double abs = fabs(val);
+	if (!(abs >= 1e-4 && abs < 1e6)) {
+		return p + snprintf(p, 32, "%g", val);
+	}
+
+	// The exponent, between -4 and 5
+	int exp = 5;
+	while (abs < pow10[exp + 4]) {
+		exp -= 1;
+	}
+
+	double scaled = abs * pow10[5 - exp + 4];
+	uint64_t digits = (uint64_t)scaled;
+	double frac = scaled - (double)digits;
+	if (frac > 0.499999 && frac < 0.500001) {
+		return p + snprintf(p, 32, "%g", val);
+	}
+
+	digits += frac > 0.5;
+	if (digits < 100000 || digits >= 1000000) {
+		return p + snprintf(p, 32, "%g", val);
+	}
+
+	char buf[6];
+	lolvm_format_u64(buf, digits);
+	if (val < 0) {
+		*p++ = '-';
+	}
+
+	int point;
+	if (exp >= 0) {
+		memcpy(p, buf, exp + 1);
+		p += exp + 1;
+		point = exp + 1;
+	} else {
+		*p++ = '0';
+		point = 0;
+	}
+
+	int end = 6;
+	while (end > point && buf[end - 1] == '0') {
+		end -= 1;
+	}
+
+	if (end > point) {
+		*p++ = '.';
+		for (int i = exp; i < -1; ++i) {
+			*p++ = '0';
+		}
+
+		memcpy(p, buf + point, end - point);
+		p += end - point;
+	}
+
+	return p;
+}
+
+enum lolvm_print_kind {
+	LOLVM_PRINT_U8,
+	LOLVM_PRINT_I32,
+	LOLVM_PRINT_I64,
+	LOLVM_PRINT_F32,
+	LOLVM_PRINT_F64,
+};
+
+// Print the value at 'src' as a line, for PRINT_*, or for DBG_PRINT_*
+// if 'dbg' is set, which also shows where on the stack it is
+static void lolvm_output_print(
+		struct lolvm_output *out, int dbg, int16_t addr,
+		const unsigned char *src, enum lolvm_print_kind kind)
+{
+	static const unsigned char sizes[] = {1, 4, 8, 4, 8};
+	if (out->binary) {
+		lolvm_output_write(out, src, sizes[kind]);
+		return;
+	}
+
+	char *start = lolvm_output_reserve(out);
+	char *p = start;
+	if (dbg) {
+		memcpy(p, "DBG PRINT @", 11);
+		p = lolvm_format_i64(p + 11, addr);
+		*p++ = ':';
+		*p++ = ' ';
+	}
+
+	switch (kind) {
+	case LOLVM_PRINT_U8:
+		p = lolvm_format_u64(p, *src);
+		break;
+	case LOLVM_PRINT_I32: {
+		int32_t val;
+		memcpy(&val, src, 4);
+		p = lolvm_format_i64(p, val);
+		break;
+	}
+	case LOLVM_PRINT_I64: {
+		int64_t val;
+		memcpy(&val, src, 8);
+		p = lolvm_format_i64(p, val);
+		break;
+	}
+	case LOLVM_PRINT_F32: {
+		float val;
+		memcpy(&val, src, 4);
+		p = lolvm_format_double(p, val);
+		break;
+	}
+	case LOLVM_PRINT_F64: {
+		double val;
+		memcpy(&val, src, 8);
+		p = lolvm_format_double(p, val);
+		break;
+	}
+	}
+
+	*p++ = '\n';
+	out->len += p - start;
+}
+
+int lolvm_flush(struct lolvm *vm)
+{
+	lolvm_output_flush(&vm->out);
+	return vm->out.failed ? -1 : 0;
+}
+
+// 'stack_size' is in bytes, 'callstack_size' is in frames
+int lolvm_init(
+		struct lolvm *vm, struct lolvm_program *prog,
+		size_t stack_size, size_t callstack_size)
+{
+	pthread_once(&lolvm_vector_once, lolvm_vector_init);
+
+	vm->prog = prog;
+	vm->code = prog->code;
+	vm->out.buf = malloc(LOLVM_OUTPUT_SIZE);
+	vm->out.len = 0;
+	vm->out.fd = -1;
+	vm->out.file = stdout;
+	vm->out.binary = 0;
+	vm->out.failed = 0;
+	memset(&vm->fibers, 0, sizeof(vm->fibers));
+	vm->stack = NULL;
+	vm->heap.base = NULL;
+	vm->heap.top = 0;
+	lolvm_reset(vm);
+
+	vm->stack_size = stack_size;
+	vm->callstack_size = callstack_size;
+	vm->memory = NULL;
+	vm->stack = NULL;
+	vm->heap.base = NULL;
+	vm->heap.size = LOLVM_HEAP_SIZE;
+	if (prog->sandbox) {
+		lolvm_map_sandbox(vm);
+	} else {
+		vm->stack = lolvm_map_guarded(stack_size, LOLVM_STACK_GUARD);
+		vm->heap.base = lolvm_map_guarded(LOLVM_HEAP_SIZE, LOLVM_STACK_GUARD);
+	}
+
+	vm->callstack = lolvm_map_guarded(
+		callstack_size * sizeof(*vm->callstack), sizeof(*vm->callstack));
+	if (!vm->out.buf || !vm->stack || !vm->heap.base || !vm->callstack ||
+			(lolvm_has_fibers(prog) && lolvm_fibers_init(vm) < 0)) {
+		lolvm_destroy(vm);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Make 'size' bytes from the page-aligned 'p' read as zeroes. Dropping the
+// pages is cheaper than clearing them, since most are usually untouched.
+static void lolvm_zero_pages(unsigned char *p, size_t size)
+{
+	size = lolvm_round_to_page(size);
+	if (size > 0 && madvise(p, size, MADV_DONTNEED) < 0) {
+		memset(p, 0, size);
+	}
+}
+
+void lolvm_reset(struct lolvm *vm)
+{
+	size_t heap_top = vm->heap.top;
+	vm->sptr = 0;
+	vm->iptr = 0;
+	vm->cptr = 0;
+	vm->halted = 0;
+	vm->sample_ip = NULL;
+	vm->error = NULL;
+	lolvm_output_flush(&vm->out);
+	vm->out.failed = 0;
+
+	vm->heap.top = 0;
+	vm->heap.arena = SIZE_MAX;
+	for (int i = 0; i < LOLVM_HEAP_CLASSES; ++i) {
+		vm->heap.free[i] = UINT32_MAX;
+	}
+
+	vm->heap.in_use = 0;
+	vm->heap.peak = 0;
+	vm->heap.allocs = 0;
+	vm->heap.frees = 0;
+	vm->heap.failed = 0;
+
+	// Back to the main fiber, with every other one free
+	struct lolvm_fibers *fibers = &vm->fibers;
+	if (fibers->fibers) {
+		vm->stack = fibers->fibers[0].stack;
+		vm->callstack = fibers->fibers[0].callstack;
+	}
+
+	fibers->current = 0;
+	fibers->ready.head = LOLVM_FIBER_NONE;
+	fibers->ready.tail = LOLVM_FIBER_NONE;
+	fibers->free = LOLVM_FIBER_NONE;
+	fibers->used = 0;
+	fibers->nchannels = 0;
+	fibers->spawned = 0;
+	fibers->switches = 0;
+
+	// The next run mustn't see what this one left on its stacks or heap
+	if (vm->stack) {
+		lolvm_zero_pages(vm->stack, vm->stack_size);
+	}
+	if (vm->heap.base) {
+		lolvm_zero_pages(vm->heap.base, heap_top);
+	}
+	for (size_t i = 1; i <= fibers->mapped; ++i) {
+		lolvm_zero_pages(fibers->fibers[i].stack, vm->stack_size);
+	}
+}
+
+void lolvm_destroy(struct lolvm *vm)
+{
+	if (vm->out.buf) {
+		lolvm_output_flush(&vm->out);
+		free(vm->out.buf);
+		vm->out.buf = NULL;
+	}
+
+	if (vm->fibers.fibers) {
+		vm->stack = vm->fibers.fibers[0].stack;
+		vm->callstack = vm->fibers.fibers[0].callstack;
+	}
+
+	lolvm_fibers_destroy(vm);
+	if (vm->memory) {
+		munmap(vm->memory, LOLVM_SANDBOX_SIZE);
+	} else {
+		lolvm_unmap_guarded(vm->stack, vm->stack_size, LOLVM_STACK_GUARD);
+		lolvm_unmap_guarded(vm->heap.base, vm->heap.size, LOLVM_STACK_GUARD);
+	}
+
+	lolvm_unmap_guarded(
+		vm->callstack, vm->callstack_size * sizeof(*vm->callstack),
+		sizeof(*vm->callstack));
+	vm->memory = NULL;
+	vm->stack = NULL;
+	vm->heap.base = NULL;
+	vm->callstack = NULL;
+}
+
+// Pointers are host addresses, or offsets into the VM's memory
+// if it's sandboxed
+static inline unsigned char *lolvm_load_ptr(struct lolvm *vm, const unsigned char *src)
+{
+	if (vm->memory) {
+		uint32_t offset;
+		memcpy(&offset, src, 4);
+		return vm->memory + offset;
+	}
+
+	uint64_t ptr;
+	memcpy(&ptr, src, 8);
+	return (unsigned char *)ptr;
+}
+
+static inline void lolvm_store_ptr(struct lolvm *vm, unsigned char *dest, unsigned char *ptr)
+{
+	if (vm->memory) {
+		uint32_t offset = ptr - vm->memory;
+		memcpy(dest, &offset, 4);
+	} else {
+		uint64_t val = (uint64_t)ptr;
+		memcpy(dest, &val, 8);
+	}
+}
+
+/*
+ * The heap. Free list links live in the freed blocks, where the program
+ * can overwrite them, so every offset is checked against the top of
+ * the heap before it's used.
+ */
+
+static inline unsigned lolvm_heap_class(uint32_t size)
+{
+	unsigned c = 0;
+	while (((size_t)16 << c) < size) {
+		c += 1;
+	}
+
+	return c;
+}
+
+static inline void lolvm_heap_count(struct lolvm_heap *heap, size_t block)
+{
+	heap->allocs += 1;
+	heap->in_use += block;
+	if (heap->in_use > heap->peak) {
+		heap->peak = heap->in_use;
+	}
+}
+
+static inline unsigned char *lolvm_heap_alloc(struct lolvm_heap *heap, uint32_t size)
+{
+	size_t block;
+	if (heap->arena == SIZE_MAX) {
+		unsigned c = lolvm_heap_class(size);
+		if (c >= LOLVM_HEAP_CLASSES) {
+			heap->failed += 1;
+			return NULL;
+		}
+
+		block = (size_t)16 << c;
+		uint32_t offset = heap->free[c];
+		if (offset != UINT32_MAX && offset + block <= heap->top) {
+			memcpy(&heap->free[c], heap->base + offset, 4);
+			lolvm_heap_count(heap, block);
+			return heap->base + offset;
+		}
+
+		heap->free[c] = UINT32_MAX;
+	} else {
+		block = ((size_t)size + 15) & ~(size_t)15;
+	}
+
+	if (block > heap->size - heap->top) {
+		heap->failed += 1;
+		return NULL;
+	}
+
+	unsigned char *ptr = heap->base + heap->top;
+	heap->top += block;
+	lolvm_heap_count(heap, block);
+	return ptr;
+}
+
+static inline void lolvm_heap_free(struct lolvm_heap *heap, unsigned char *ptr, uint32_t size)
+{
+	// Null and foreign pointers are ignored, as are blocks in the current
+	// arena, which go away when it's reset
+	size_t offset = ptr - heap->base;
+	unsigned c = lolvm_heap_class(size);
+	size_t block = (size_t)16 << c;
+	if (offset >= heap->top || c >= LOLVM_HEAP_CLASSES ||
+			offset + block > heap->top || offset >= heap->arena) {
+		return;
+	}
+
+	memcpy(ptr, &heap->free[c], 4);
+	heap->free[c] = offset;
+	heap->frees += 1;
+	heap->in_use -= block < heap->in_use ? block : heap->in_use;
+}
+
+static inline uint64_t lolvm_heap_arena_begin(struct lolvm_heap *heap)
+{
+	uint64_t mark = heap->arena == SIZE_MAX ? UINT64_MAX : heap->arena;
+	heap->arena = heap->top;
+	return mark;
+}
+
+static inline void lolvm_heap_arena_reset(struct lolvm_heap *heap, uint64_t mark)
+{
+	if (heap->arena == SIZE_MAX) {
+		return;
+	}
+
+	size_t freed = heap->top - heap->arena;
+	heap->in_use -= freed < heap->in_use ? freed : heap->in_use;
+	heap->top = heap->arena;
+
+	// The outer arena can't start above this one
+	heap->arena = mark <= heap->top ? mark : SIZE_MAX;
+}
+
+/*
+ * Fibers. Queues are linked through lolvm_fiber.next, so a fiber is in
+ * at most one of them: the ready queue, a channel's, or the free list.
+ */
+
+static inline void lolvm_fiber_push(
+		struct lolvm_fibers *fibers, struct lolvm_fiber_queue *queue, uint32_t id)
+{
+	fibers->fibers[id].next = LOLVM_FIBER_NONE;
+	if (queue->head == LOLVM_FIBER_NONE) {
+		queue->head = id;
+	} else {
+		fibers->fibers[queue->tail].next = id;
+	}
+
+	queue->tail = id;
+}
+
+static inline uint32_t lolvm_fiber_pop(struct lolvm_fibers *fibers, struct lolvm_fiber_queue *queue)
+{
+	uint32_t id = queue->head;
+	if (id != LOLVM_FIBER_NONE) {
+		queue->head = fibers->fibers[id].next;
+	}
+
+	return id;
+}
+
+// Remember where the current fiber continues
+static inline void lolvm_fiber_save(struct lolvm *vm, size_t iptr, size_t sptr)
+{
+	struct lolvm_fiber *fiber = &vm->fibers.fibers[vm->fibers.current];
+	fiber->iptr = iptr;
+	fiber->sptr = sptr;
+	fiber->cptr = vm->cptr;
+}
+
+// Switch to the next ready fiber. Returns the index to continue at and
+// sets 'sptr', vm->stack and vm->callstack. Returns SIZE_MAX and sets
+// vm->error if every fiber is waiting.
+static inline size_t lolvm_fiber_switch(struct lolvm *vm, size_t *sptr)
+{
+	struct lolvm_fibers *fibers = &vm->fibers;
+	uint32_t id = lolvm_fiber_pop(fibers, &fibers->ready);
+	if (id == LOLVM_FIBER_NONE) {
+		vm->error = "Every fiber is waiting on a channel";
+		return SIZE_MAX;
+	}
+
+	struct lolvm_fiber *fiber = &fibers->fibers[id];
+	fibers->current = id;
+	fibers->switches += 1;
+	vm->stack = fiber->stack;
+	vm->callstack = fiber->callstack;
+	vm->cptr = fiber->cptr;
+	*sptr = fiber->sptr;
+	return fiber->iptr;
+}
+
+// Start a fiber at 'iptr' whose stack begins with the 'bump' bytes at
+// 'frame'. It returns into the HALT after the program, which ends it.
+// Returns -1 and sets vm->error if there are too many fibers.
+static int lolvm_fiber_spawn(struct lolvm *vm, const unsigned char *frame, size_t bump, size_t iptr)
+{
+	struct lolvm_fibers *fibers = &vm->fibers;
+	uint32_t id = fibers->free;
+	if (id != LOLVM_FIBER_NONE) {
+		fibers->free = fibers->fibers[id].next;
+	} else if (fibers->used + 1 < fibers->count) {
+		id = ++fibers->used;
+		if (fibers->used > fibers->mapped) {
+			struct lolvm_fiber *fiber = &fibers->fibers[id];
+			size_t guard = lolvm_round_to_page(LOLVM_STACK_GUARD);
+			size_t page = sysconf(_SC_PAGESIZE);
+			if (mprotect(fiber->stack, fibers->stack_stride - guard, PROT_READ | PROT_WRITE) < 0 ||
+					mprotect(fiber->callstack, fibers->callstack_stride - page, PROT_READ | PROT_WRITE) < 0) {
+				fibers->used -= 1;
+				vm->error = "Out of memory for fiber stacks";
+				return -1;
+			}
+
+			fibers->mapped = fibers->used;
+		}
+	} else {
+		vm->error = "Too many fibers";
+		return -1;
+	}
+
+	struct lolvm_fiber *fiber = &fibers->fibers[id];
+	memcpy(fiber->stack, frame, bump);
+	fiber->callstack[0].sptr = 0;
+	fiber->callstack[0].iptr = vm->prog->count - 1;
+	fiber->cptr = 1;
+	fiber->sptr = bump;
+	fiber->iptr = iptr;
+	fibers->spawned += 1;
+	lolvm_fiber_push(fibers, &fibers->ready, id);
+	return 0;
+}
+
+// End the current fiber; the caller switches away from it
+static inline void lolvm_fiber_exit(struct lolvm *vm)
+{
+	struct lolvm_fibers *fibers = &vm->fibers;
+	fibers->fibers[fibers->current].next = fibers->free;
+	fibers->free = fibers->current;
+}
+
+// Returns the new channel's handle, or UINT32_MAX and sets vm->error
+static inline uint32_t lolvm_channel_new(struct lolvm *vm)
+{
+	struct lolvm_fibers *fibers = &vm->fibers;
+	if (fibers->nchannels >= LOLVM_CHANNELS || !fibers->channels) {
+		vm->error = "Too many channels";
+		return UINT32_MAX;
+	}
+
+	struct lolvm_channel *chan = &fibers->channels[fibers->nchannels];
+	chan->senders.head = LOLVM_FIBER_NONE;
+	chan->receivers.head = LOLVM_FIBER_NONE;
+	return fibers->nchannels++;
+}
+
+static inline struct lolvm_channel *lolvm_channel_get(struct lolvm *vm, const unsigned char *src)
+{
+	uint32_t handle;
+	memcpy(&handle, src, 4);
+	if (handle >= vm->fibers.nchannels) {
+		vm->error = "Bad channel";
+		return NULL;
+	}
+
+	return &vm->fibers.channels[handle];
+}
+
+// Hand 'size' bytes at 'src' to a waiting receiver, or queue the current
+// fiber as a sender. Returns 0 if it was handed over, 1 if the current
+// fiber has to wait, and -1 with vm->error set for a bad channel.
+// CHAN_RECV is the same thing the other way around.
+static inline int lolvm_channel_send(
+		struct lolvm *vm, const unsigned char *chan_src, unsigned char *src, uint32_t size)
+{
+	struct lolvm_channel *chan = lolvm_channel_get(vm, chan_src);
+	if (!chan) {
+		return -1;
+	}
+
+	struct lolvm_fibers *fibers = &vm->fibers;
+	uint32_t id = lolvm_fiber_pop(fibers, &chan->receivers);
+	if (id != LOLVM_FIBER_NONE) {
+		struct lolvm_fiber *receiver = &fibers->fibers[id];
+		memcpy(receiver->value, src, size < receiver->size ? size : receiver->size);
+		lolvm_fiber_push(fibers, &fibers->ready, id);
+		return 0;
+	}
+
+	struct lolvm_fiber *fiber = &fibers->fibers[fibers->current];
+	fiber->value = src;
+	fiber->size = size;
+	lolvm_fiber_push(fibers, &chan->senders, fibers->current);
+	return 1;
+}
+
+static inline int lolvm_channel_recv(
+		struct lolvm *vm, const unsigned char *chan_src, unsigned char *dest, uint32_t size)
+{
+	struct lolvm_channel *chan = lolvm_channel_get(vm, chan_src);
+	if (!chan) {
+		return -1;
+	}
+
+	struct lolvm_fibers *fibers = &vm->fibers;
+	uint32_t id = lolvm_fiber_pop(fibers, &chan->senders);
+	if (id != LOLVM_FIBER_NONE) {
+		struct lolvm_fiber *sender = &fibers->fibers[id];
+		memcpy(dest, sender->value, size < sender->size ? size : sender->size);
+		lolvm_fiber_push(fibers, &fibers->ready, id);
+		return 0;
+	}
+
+	struct lolvm_fiber *fiber = &fibers->fibers[fibers->current];
+	fiber->value = dest;
+	fiber->size = size;
+	lolvm_fiber_push(fibers, &chan->receivers, fibers->current);
+	return 1;
+}
+
+void *lolvm_alloc(struct lolvm *vm, uint32_t size)
+{
+	return lolvm_heap_alloc(&vm->heap, size);
+}
+
+void lolvm_free(struct lolvm *vm, void *ptr, uint32_t size)
+{
+	lolvm_heap_free(&vm->heap, ptr, size);
+}
+
+uint64_t lolvm_arena_begin(struct lolvm *vm)
+{
+	return lolvm_heap_arena_begin(&vm->heap);
+}
+
+void lolvm_arena_reset(struct lolvm *vm, uint64_t mark)
+{
+	lolvm_heap_arena_reset(&vm->heap, mark);
+}
+
+/*
+ * Snapshots. The file has a header and the call stack, then, each
+ * starting on a page boundary, the stack up to its last non-zero page
+ * and the used part of the heap. Everything is in the host's byte order.
+ */
+
+#define LOLVM_SNAPSHOT_MAGIC "LOLSNAP1"
+
+struct lolvm_snapshot_header {
+	char magic[8];
+	uint64_t prog_hash;
+	uint64_t sandbox;
+	uint64_t stack_size;
+	uint64_t callstack_size;
+	uint64_t addr; // Bytecode address of the next instruction
+	uint64_t sptr;
+	uint64_t cptr;
+	uint64_t stack_bytes;
+	uint64_t heap_bytes;
+	uint64_t heap_top;
+	uint64_t heap_arena;
+	uint32_t heap_free[LOLVM_HEAP_CLASSES];
+	uint64_t heap_in_use;
+	uint64_t heap_peak;
+	uint64_t heap_allocs;
+	uint64_t heap_frees;
+	uint64_t heap_failed;
+};
+
+// A call stack entry, with a bytecode address instead of an index
+struct lolvm_snapshot_frame {
+	uint64_t sptr;
+	uint64_t addr;
+};
+
+uint64_t lolvm_program_hash(const struct lolvm_program *prog)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < prog->size; ++i) {
+		hash = (hash ^ prog->bytecode[i]) * 0x100000001b3;
+	}
+
+	return hash;
+}
+
+int lolvm_run_until(struct lolvm *vm, size_t index, int checked)
+{
+	struct lolvm_instr *instr = &vm->code[index];
+	struct lolvm_instr saved = *instr;
+	instr->op = LOL_HALT;
+	instr->len = 1;
+
+	int ret = 0;
+	if (checked) {
+		ret = lolvm_run_checked(vm);
+	} else {
+		lolvm_run(vm);
+	}
+
+	*instr = saved;
+	if (ret < 0) {
+		return -1;
+	}
+
+	// HALT leaves iptr after itself
+	if (vm->halted && vm->iptr == index + 1) {
+		vm->halted = 0;
+		vm->iptr = index;
+		return 1;
+	}
+
+	return 0;
+}
+
+// Whether the program can put host pointers on the stack
+static int lolvm_has_pointers(const struct lolvm_program *prog)
+{
+	for (size_t i = 0; i < prog->count; ++i) {
+		if (prog->code[i].op == LOL_REF || prog->code[i].op == LOL_ALLOC) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int lolvm_snapshot_write(FILE *out, const void *data, size_t size)
+{
+	return fwrite(data, 1, size, out) == size ? 0 : -1;
+}
+
+static int lolvm_snapshot_pad(FILE *out)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	long pos = ftell(out);
+	if (pos < 0) {
+		return -1;
+	}
+
+	while (pos % page != 0) {
+		if (fputc(0, out) == EOF) {
+			return -1;
+		}
+		pos += 1;
+	}
+
+	return 0;
+}
+
+int lolvm_snapshot_save(struct lolvm *vm, FILE *out)
+{
+	struct lolvm_program *prog = vm->prog;
+	if (!prog->sandbox && lolvm_has_pointers(prog)) {
+		vm->error = "Programs with pointers can only be snapshotted in a sandbox";
+		return -1;
+	}
+
+	if (vm->halted) {
+		vm->error = "The program has halted";
+		return -1;
+	}
+
+	if (vm->fibers.fibers) {
+		vm->error = "Programs with fibers can't be snapshotted";
+		return -1;
+	}
+
+	// Untouched stack pages read as zeroes, and so will the ones
+	// after the saved part
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t stack_bytes = lolvm_round_to_page(vm->stack_size);
+	while (stack_bytes > 0) {
+		const unsigned char *p = &vm->stack[stack_bytes - page];
+		if (p[0] != 0 || memcmp(p, p + 1, page - 1) != 0) {
+			break;
+		}
+		stack_bytes -= page;
+	}
+
+	struct lolvm_heap *heap = &vm->heap;
+	struct lolvm_snapshot_header header = {0};
+	memcpy(header.magic, LOLVM_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.prog_hash = lolvm_program_hash(prog);
+	header.sandbox = prog->sandbox;
+	header.stack_size = vm->stack_size;
+	header.callstack_size = vm->callstack_size;
+	header.addr = prog->addrs[vm->iptr];
+	header.sptr = vm->sptr;
+	header.cptr = vm->cptr;
+	header.stack_bytes = stack_bytes;
+	header.heap_bytes = lolvm_round_to_page(heap->top);
+	header.heap_top = heap->top;
+	header.heap_arena = heap->arena;
+	memcpy(header.heap_free, heap->free, sizeof(header.heap_free));
+	header.heap_in_use = heap->in_use;
+	header.heap_peak = heap->peak;
+	header.heap_allocs = heap->allocs;
+	header.heap_frees = heap->frees;
+	header.heap_failed = heap->failed;
+
+	int ret = lolvm_snapshot_write(out, &header, sizeof(header));
+	for (size_t i = 0; ret == 0 && i < vm->cptr; ++i) {
+		struct lolvm_snapshot_frame frame;
+		frame.sptr = vm->callstack[i].sptr;
+		frame.addr = prog->addrs[vm->callstack[i].iptr];
+		ret = lolvm_snapshot_write(out, &frame, sizeof(frame));
+	}
+
+	if (ret == 0) ret = lolvm_snapshot_pad(out);
+	if (ret == 0) ret = lolvm_snapshot_write(out, vm->stack, stack_bytes);
+	if (ret == 0) ret = lolvm_snapshot_write(out, heap->base, header.heap_bytes);
+	if (ret < 0 || fflush(out) == EOF) {
+		vm->error = "Failed to write the snapshot";
+		return -1;
+	}
+
+	return 0;
+}
+
+static int lolvm_snapshot_fail(struct lolvm_snapshot *snap, const char *error)
+{
+	snap->prog->error = error;
+	snap->prog->error_addr = 0;
+	lolvm_snapshot_close(snap);
+	return -1;
+}
+
+int lolvm_snapshot_open(struct lolvm_snapshot *snap, struct lolvm_program *prog, const char *path)
+{
+	snap->prog = prog;
+	snap->data = NULL;
+	snap->fd = open(path, O_RDONLY);
+	if (snap->fd < 0) {
+		return lolvm_snapshot_fail(snap, "Failed to open the snapshot");
+	}
+
+	struct lolvm_snapshot_header header;
+	if (pread(snap->fd, &header, sizeof(header), 0) != sizeof(header) ||
+			memcmp(header.magic, LOLVM_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+		return lolvm_snapshot_fail(snap, "Not a snapshot");
+	}
+
+	if (header.prog_hash != lolvm_program_hash(prog)) {
+		return lolvm_snapshot_fail(snap, "Snapshot is of a different program");
+	}
+
+	if (header.sandbox != (uint64_t)prog->sandbox) {
+		return lolvm_snapshot_fail(snap, "Snapshot was saved with a different kind of pointer");
+	}
+
+	if (header.cptr > header.callstack_size ||
+			header.stack_bytes > lolvm_round_to_page(header.stack_size) ||
+			header.heap_bytes > LOLVM_HEAP_SIZE || header.heap_top > header.heap_bytes ||
+			header.sptr > header.stack_size || header.heap_in_use > header.heap_top ||
+			(header.heap_arena != (uint64_t)SIZE_MAX && header.heap_arena > header.heap_top)) {
+		return lolvm_snapshot_fail(snap, "Corrupt snapshot");
+	}
+
+	// Free blocks have to be inside the saved part of the heap
+	for (size_t c = 0; c < LOLVM_HEAP_CLASSES; ++c) {
+		uint64_t offset = header.heap_free[c];
+		if (offset != UINT32_MAX && (offset % 16 != 0 || offset + ((uint64_t)16 << c) > header.heap_top)) {
+			return lolvm_snapshot_fail(snap, "Corrupt snapshot");
+		}
+	}
+
+	size_t meta = sizeof(header) + header.cptr * sizeof(struct lolvm_snapshot_frame);
+	snap->data = malloc(meta);
+	if (!snap->data) {
+		return lolvm_snapshot_fail(snap, "Out of memory");
+	}
+
+	if (pread(snap->fd, snap->data, meta, 0) != (ssize_t)meta) {
+		return lolvm_snapshot_fail(snap, "Truncated snapshot");
+	}
+
+	const struct lolvm_snapshot_frame *frames = (const void *)((struct lolvm_snapshot_header *)snap->data + 1);
+	for (size_t i = 0; i < header.cptr; ++i) {
+		if (frames[i].sptr > header.stack_size) {
+			return lolvm_snapshot_fail(snap, "Corrupt snapshot");
+		}
+	}
+
+	snap->stack_size = header.stack_size;
+	snap->callstack_size = header.callstack_size;
+	snap->stack_offset = lolvm_round_to_page(meta);
+	snap->heap_offset = snap->stack_offset + header.stack_bytes;
+	return 0;
+}
+
+void lolvm_snapshot_close(struct lolvm_snapshot *snap)
+{
+	if (snap->fd >= 0) {
+		close(snap->fd);
+	}
+
+	free(snap->data);
+	snap->fd = -1;
+	snap->data = NULL;
+}
+
+// Map 'size' bytes of the snapshot copy-on-write over 'dest'
+static int lolvm_snapshot_map(const struct lolvm_snapshot *snap, void *dest, size_t size, size_t offset)
+{
+	if (size == 0) {
+		return 0;
+	}
+
+	void *mem = mmap(
+		dest, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, snap->fd, offset);
+	return mem == MAP_FAILED ? -1 : 0;
+}
+
+int lolvm_snapshot_restore(struct lolvm *vm, const struct lolvm_snapshot *snap)
+{
+	const struct lolvm_snapshot_header *header = snap->data;
+	const struct lolvm_snapshot_frame *frames = (const void *)(header + 1);
+	struct lolvm_program *prog = vm->prog;
+	if (prog != snap->prog || vm->stack_size != header->stack_size ||
+			vm->callstack_size < header->cptr) {
+		vm->error = "The VM doesn't match the snapshot";
+		return -1;
+	}
+
+	lolvm_reset(vm);
+	vm->iptr = lolvm_program_find(prog, header->addr);
+	for (size_t i = 0; i < header->cptr; ++i) {
+		vm->callstack[i].sptr = frames[i].sptr;
+		vm->callstack[i].iptr = lolvm_program_find(prog, frames[i].addr);
+		if (vm->callstack[i].iptr == (size_t)-1) {
+			vm->iptr = (size_t)-1;
+		}
+	}
+
+	if (vm->iptr == (size_t)-1) {
+		vm->error = "Corrupt snapshot";
+		return -1;
+	}
+
+	// The rest of the stack has to read as zeroes, like in a new VM
+	size_t stack_size = lolvm_round_to_page(vm->stack_size);
+	if (lolvm_snapshot_map(snap, vm->stack, header->stack_bytes, snap->stack_offset) < 0 ||
+			madvise(vm->stack + header->stack_bytes, stack_size - header->stack_bytes, MADV_DONTNEED) < 0 ||
+			lolvm_snapshot_map(snap, vm->heap.base, header->heap_bytes, snap->heap_offset) < 0) {
+		vm->error = "Failed to map the snapshot";
+		return -1;
+	}
+
+	vm->sptr = header->sptr;
+	vm->cptr = header->cptr;
+
+	struct lolvm_heap *heap = &vm->heap;
+	heap->top = header->heap_top;
+	heap->arena = header->heap_arena;
+	memcpy(heap->free, header->heap_free, sizeof(heap->free));
+	heap->in_use = header->heap_in_use;
+	heap->peak = header->heap_peak;
+	heap->allocs = header->heap_allocs;
+	heap->frees = header->heap_frees;
+	heap->failed = header->heap_failed;
+	return 0;
+}
+
+void lolvm_step(struct lolvm *vm)
+{
+	struct lolvm_instr *code = vm->code;
+	struct lolvm_instr *ip = &code[vm->iptr];
+	unsigned char *stack = vm->stack;
+	size_t sptr = vm->sptr;
+
+	#define CASE(name) case LOL_ ## name
+	#define NEXT() { ip += 1; goto out; }
+	#define NEXT_LEN() { ip += ip->len; goto out; }
+	#define JUMP(index) { ip = &code[index]; goto out; }
+	#define EXIT() goto out
+
+	switch ((enum lolvm_op)ip->op) {
+	#include "lolvm_ops.inc"
+	}
+
+	// Unknown opcode
+	ip += 1;
+
+	#undef CASE
+	#undef NEXT
+	#undef NEXT_LEN
+	#undef JUMP
+	#undef EXIT
+
+out:
+	vm->iptr = ip - code;
+	vm->sptr = sptr;
+}
+
+#if LOLVM_THREADED
+
+// Direct-threaded run loop: every handler ends in its own indirect jump
+// to the next handler, so the branch predictor gets one entry per opcode
+// instead of one shared entry for the whole switch.
+void lolvm_run(struct lolvm *vm)
+{
+	static void *const dispatch[256] = {
+		[0 ... 255] = &&op_invalid,
+#define X(name) [LOL_ ## name] = &&op_ ## name,
+LOLVM_OPS
+#undef X
+	};
+
+	struct lolvm_instr *code = vm->code;
+	struct lolvm_instr *ip = &code[vm->iptr];
+	unsigned char *stack = vm->stack;
+	size_t sptr = vm->sptr;
+
+	#define CASE(name) op_ ## name
+	#define NEXT() { ip += 1; goto *dispatch[ip->op]; }
+	#define NEXT_LEN() { ip += ip->len; goto *dispatch[ip->op]; }
+	#define JUMP(index) { ip = &code[index]; goto *dispatch[ip->op]; }
+	#define EXIT() goto out
+
+	if (vm->halted) {
+		return;
+	}
+
+	goto *dispatch[ip->op];
+	#include "lolvm_ops.inc"
+op_invalid:
+	NEXT();
+
+	#undef CASE
+	#undef NEXT
+	#undef NEXT_LEN
+	#undef JUMP
+	#undef EXIT
+
+out:
+	vm->iptr = ip - code;
+	vm->sptr = sptr;
+}
+
+#else
+
+void lolvm_run(struct lolvm *vm)
+{
+	struct lolvm_instr *code = vm->code;
+	struct lolvm_instr *ip = &code[vm->iptr];
+	unsigned char *stack = vm->stack;
+	size_t sptr = vm->sptr;
+
+	#define CASE(name) case LOL_ ## name
+	#define NEXT() { ip += 1; continue; }
+	#define NEXT_LEN() { ip += ip->len; continue; }
+	#define JUMP(index) { ip = &code[index]; continue; }
+	#define EXIT() goto out
+
+	while (!vm->halted) {
+		switch ((enum lolvm_op)ip->op) {
+		#include "lolvm_ops.inc"
+		}
+
+		// Unknown opcode
+		ip += 1;
+	}
+
+	#undef CASE
+	#undef NEXT
+	#undef NEXT_LEN
+	#undef JUMP
+	#undef EXIT
+
+out:
+	vm->iptr = ip - code;
+	vm->sptr = sptr;
+}
+
+#endif
+
+uint64_t lolvm_run_budget(struct lolvm *vm, uint64_t budget)
+{
+#if LOLVM_THREADED
+	static void *const dispatch[256] = {
+		[0 ... 255] = &&op_invalid,
+#define X(name) [LOL_ ## name] = &&op_ ## name,
+LOLVM_OPS
+#undef X
+	};
+#endif
+
+	struct lolvm_instr *code = vm->code;
+	struct lolvm_instr *ip = &code[vm->iptr];
+	unsigned char *stack = vm->stack;
+	size_t sptr = vm->sptr;
+	uint64_t left = budget;
+
+	// A superinstruction which would take us over the budget
+	// is left for the next call
+#if LOLVM_THREADED
+	#define CASE(name) op_ ## name
+	#define DISPATCH() { \
+		if (ip->len > left) goto out; \
+		left -= ip->len; \
+		goto *dispatch[ip->op]; \
+	}
+#else
+	#define CASE(name) case LOL_ ## name
+	#define DISPATCH() continue
+#endif
+	#define NEXT() { ip += 1; DISPATCH(); }
+	#define NEXT_LEN() { ip += ip->len; DISPATCH(); }
+	#define JUMP(index) { ip = &code[index]; DISPATCH(); }
+	#define EXIT() goto out
+
+	if (vm->halted) {
+		return 0;
+	}
+
+#if LOLVM_THREADED
+	DISPATCH();
+	#include "lolvm_ops.inc"
+op_invalid:
+	NEXT();
+#else
+	while (ip->len <= left) {
+		left -= ip->len;
+		switch ((enum lolvm_op)ip->op) {
+		#include "lolvm_ops.inc"
+		}
+
+		// Unknown opcode
+		ip += 1;
+	}
+#endif
+
+	#undef CASE
+	#undef DISPATCH
+	#undef NEXT
+	#undef NEXT_LEN
+	#undef JUMP
+	#undef EXIT
+
+out:
+	vm->iptr = ip - code;
+	vm->sptr = sptr;
+	return budget - left;
+}
+
+// Like lolvm_run, but counts what gets executed.
+// Used by --stats to show how much superinstructions save.
+void lolvm_run_counted(struct lolvm *vm, struct lolvm_counters *counters)
+{
+	struct lolvm_instr *code = vm->code;
+	struct lolvm_instr *ip = &code[vm->iptr];
+	unsigned char *stack = vm->stack;
+	size_t sptr = vm->sptr;
+
+	#define CASE(name) case LOL_ ## name
+	#define NEXT() { ip += 1; continue; }
+	#define NEXT_LEN() { ip += ip->len; continue; }
+	#define JUMP(index) { ip = &code[index]; continue; }
+	#define EXIT() goto out
+
+	while (!vm->halted) {
+		counters->dispatches += 1;
+		counters->instrs += ip->len;
+
+		switch ((enum lolvm_op)ip->op) {
+		#include "lolvm_ops.inc"
+		}
+
+		// Unknown opcode
+		ip += 1;
+	}
+
+	#undef CASE
+	#undef NEXT
+	#undef NEXT_LEN
+	#undef JUMP
+	#undef EXIT
+
+out:
+	vm->iptr = ip - code;
+	vm->sptr = sptr;
+}
+
+int lolvm_verified(const struct lolvm_program *prog, size_t stack_size, size_t callstack_size)
+{
+	if (!prog->verified || prog->max_stack > stack_size) {
+		return 0;
+	}
+
+	if (prog->max_calls != SIZE_MAX) {
+		return prog->max_calls <= callstack_size;
+	}
+
+	// With recursion, the guard page after the callstack stops the program
+	// once it's callstack_size calls deep, which also bounds the stack
+	return prog->max_bump == 0 ||
+		callstack_size <= (stack_size - prog->max_stack) / prog->max_bump;
+}
+
+// The part of the frame an instruction accesses, from its operands
+struct lolvm_check_bounds {
+	int32_t low;
+	int32_t high;
+	int known;
+};
+
+static void lolvm_check_bounds(
+		const struct lolvm_program *prog, const struct lolvm_instr *ip,
+		struct lolvm_check_bounds *bounds)
+{
+	uint32_t sizes[4];
+	bounds->known = lolvm_operand_sizes(prog, ip, sizes) >= 0;
+	bounds->low = 0;
+	bounds->high = 0;
+	for (int n = 0; bounds->known && n < 4; ++n) {
+		if (sizes[n] == 0) {
+			continue;
+		}
+
+		int64_t offset = lolvm_operand(ip, n);
+		if (offset < bounds->low) {
+			bounds->low = offset;
+		}
+
+		// Sizes come from 32-bit immediates; keep the sum from overflowing
+		int64_t end = offset + sizes[n];
+		if (end > bounds->high) {
+			bounds->high = end > INT32_MAX ? INT32_MAX : end;
+		}
+	}
+}
+
+// Whether 'size' bytes at 'ptr' are within 'len' bytes at 'mem'
+static int lolvm_check_range(uint64_t ptr, size_t size, const unsigned char *mem, size_t len)
+{
+	uint64_t base = (uint64_t)mem;
+	return ptr >= base && ptr - base <= len && size <= len - (ptr - base);
+}
+
+// Check that 'ip' can run with the stack pointer at 'sptr'.
+// Returns NULL if it can, and an error message otherwise.
+static const char *lolvm_check(
+		struct lolvm *vm, const struct lolvm_instr *ip,
+		const struct lolvm_check_bounds *bounds, size_t sptr)
+{
+	if (!bounds->known) {
+		return "Unknown opcode";
+	}
+
+	if ((int64_t)sptr + bounds->low < 0 || sptr + bounds->high > vm->stack_size) {
+		return "Stack access out of bounds";
+	}
+
+	const unsigned char *at;
+	size_t size;
+	switch (ip->op) {
+	case LOL_CALL:
+		if (vm->cptr >= vm->callstack_size) {
+			return "Call stack overflow";
+		}
+		if (ip->a < 0) {
+			return "CALL with a negative stack bump";
+		}
+		if (sptr + ip->a > vm->stack_size) {
+			return "Stack overflow";
+		}
+		return NULL;
+	case LOL_SPAWN:
+		// The fiber's stack is a copy of the frame up to the bump
+		if (ip->a < 0) {
+			return "SPAWN with a negative stack bump";
+		}
+		if (sptr + ip->a > vm->stack_size) {
+			return "Stack overflow";
+		}
+		return NULL;
+	case LOL_RETURN:
+		if (vm->cptr == 0) {
+			return "RETURN with an empty call stack";
+		}
+		return NULL;
+	case LOL_TAILCALL:
+		if (ip->b > 0) {
+			return "TAILCALL with parameters above the frame";
+		}
+		return NULL;
+
+	// Pointers can only point into the stack or the used part
+	// of the heap, unless they're offsets into a sandbox
+	case LOL_LOAD_8: size = 1; goto load;
+	case LOL_LOAD_32: size = 4; goto load;
+	case LOL_LOAD_64: size = 8; goto load;
+	case LOL_LOAD_N: size = (uint32_t)ip->imm; goto load;
+	load:
+		at = &vm->stack[sptr + ip->b];
+		break;
+	case LOL_STORE_8: size = 1; goto store;
+	case LOL_STORE_32: size = 4; goto store;
+	case LOL_STORE_64: size = 8; goto store;
+	case LOL_STORE_N: size = (uint32_t)ip->imm; goto store;
+	store:
+		at = &vm->stack[sptr + ip->a];
+		break;
+	default:
+		return NULL;
+	}
+
+	if (vm->memory) {
+		return NULL;
+	}
+
+	uint64_t ptr;
+	memcpy(&ptr, at, 8);
+	if (lolvm_check_range(ptr, size, vm->stack, vm->stack_size) ||
+			lolvm_check_range(ptr, size, vm->heap.base, vm->heap.top)) {
+		return NULL;
+	}
+
+	return "Pointer out of bounds";
+}
+
+int lolvm_run_checked(struct lolvm *vm)
+{
+	struct lolvm_instr *code = vm->code;
+	struct lolvm_instr *ip = &code[vm->iptr];
+	unsigned char *stack = vm->stack;
+	size_t sptr = vm->sptr;
+	int ret = 0;
+
+	struct lolvm_check_bounds *bounds = malloc(vm->prog->count * sizeof(*bounds));
+	if (!bounds) {
+		vm->error = "Out of memory";
+		return -1;
+	}
+
+	for (size_t i = 0; i < vm->prog->count; ++i) {
+		lolvm_check_bounds(vm->prog, &code[i], &bounds[i]);
+	}
+
+	#define CASE(name) case LOL_ ## name
+	#define NEXT() { ip += 1; continue; }
+	#define NEXT_LEN() { ip += ip->len; continue; }
+	#define JUMP(index) { ip = &code[index]; continue; }
+	#define EXIT() goto out
+
+	while (!vm->halted) {
+		const char *error = lolvm_check(vm, ip, &bounds[ip - code], sptr);
+		if (error) {
+			vm->error = error;
+			vm->halted = 1;
+			ret = -1;
+			break;
+		}
+
+		switch ((enum lolvm_op)ip->op) {
+		#include "lolvm_ops.inc"
+		}
+	}
+
+	#undef CASE
+	#undef NEXT
+	#undef NEXT_LEN
+	#undef JUMP
+	#undef EXIT
+
+out:
+	free(bounds);
+	vm->iptr = ip - code;
+	vm->sptr = sptr;
+	return vm->error ? -1 : ret;
+}
+
+/*
+ * Profiling.
+ *
+ * lolvm_run_profiled is its own run loop, so the other loops pay nothing
+ * for it. It reads the timestamp counter before every instruction and
+ * charges the time since the previous read to the previous instruction,
+ * its opcode, and the function it ran in. Functions are tracked by
+ * following CALL and RETURN, which also builds a tree of call paths for
+ * folded-stack output.
+ */
+
+static uint64_t lolvm_profile_now(void)
+{
+#if LOLVM_PROFILE_RDTSC
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static size_t lolvm_profile_node(struct lolvm_profile *prof, size_t parent, size_t func)
+{
+	if (parent != (size_t)-1) {
+		size_t child = prof->nodes[parent].first_child;
+		while (child != (size_t)-1) {
+			if (prof->nodes[child].func == func) {
+				return child;
+			}
+
+			child = prof->nodes[child].next_sibling;
+		}
+	}
+
+	if (prof->nnodes == prof->nodes_cap) {
+		size_t cap = prof->nodes_cap ? prof->nodes_cap * 2 : 64;
+		struct lolvm_profile_node *nodes = realloc(prof->nodes, cap * sizeof(*nodes));
+		if (!nodes) {
+			// Charge the call to the caller rather than failing the run
+			return parent != (size_t)-1 ? parent : 0;
+		}
+
+		prof->nodes = nodes;
+		prof->nodes_cap = cap;
+	}
+
+	size_t index = prof->nnodes++;
+	struct lolvm_profile_node *node = &prof->nodes[index];
+	node->func = func;
+	node->parent = parent;
+	node->first_child = (size_t)-1;
+	node->next_sibling = (size_t)-1;
+	node->self = 0;
+	if (parent != (size_t)-1) {
+		node->next_sibling = prof->nodes[parent].first_child;
+		prof->nodes[parent].first_child = index;
+	}
+
+	return index;
+}
+
+int lolvm_profile_init(struct lolvm_profile *prof, struct lolvm_program *prog)
+{
+	memset(prof, 0, sizeof(*prof));
+	prof->prog = prog;
+	prof->counts = calloc(prog->count, sizeof(*prof->counts));
+	prof->cycles = calloc(prog->count, sizeof(*prof->cycles));
+	prof->func_calls = calloc(prog->count, sizeof(*prof->func_calls));
+	prof->func_inclusive = calloc(prog->count, sizeof(*prof->func_inclusive));
+	prof->func_exclusive = calloc(prog->count, sizeof(*prof->func_exclusive));
+	prof->func_depth = calloc(prog->count, sizeof(*prof->func_depth));
+	prof->func_start = calloc(prog->count, sizeof(*prof->func_start));
+	prof->node = (size_t)-1;
+	if (
+			!prof->counts || !prof->cycles || !prof->func_calls ||
+			!prof->func_inclusive || !prof->func_exclusive ||
+			!prof->func_depth || !prof->func_start) {
+		lolvm_profile_destroy(prof);
+		return -1;
+	}
+
+	return 0;
+}
+
+void lolvm_profile_destroy(struct lolvm_profile *prof)
+{
+	free(prof->counts);
+	free(prof->cycles);
+	free(prof->func_calls);
+	free(prof->func_inclusive);
+	free(prof->func_exclusive);
+	free(prof->func_depth);
+	free(prof->func_start);
+	free(prof->nodes);
+	memset(prof, 0, sizeof(*prof));
+}
+
+static void lolvm_profile_enter(struct lolvm_profile *prof, size_t func, uint64_t now)
+{
+	prof->node = lolvm_profile_node(prof, prof->node, func);
+	prof->func_calls[func] += 1;
+
+	// Recursive calls are already covered by the outermost one
+	if (prof->func_depth[func]++ == 0) {
+		prof->func_start[func] = now;
+	}
+}
+
+static void lolvm_profile_leave(struct lolvm_profile *prof, uint64_t now)
+{
+	size_t func = prof->nodes[prof->node].func;
+	if (--prof->func_depth[func] == 0) {
+		prof->func_inclusive[func] += now - prof->func_start[func];
+	}
+
+	prof->node = prof->nodes[prof->node].parent;
+}
+
+// Charge the time since 'last' to the instruction at 'prev', which ran
+// in the current call path. CALL and RETURN switch paths once they're
+// done, so their own time goes to the caller and the callee respectively.
+static void lolvm_profile_charge(
+		struct lolvm_profile *prof, struct lolvm_instr *code,
+		size_t prev, uint64_t last, uint64_t now)
+{
+	uint64_t elapsed = now - last;
+	struct lolvm_profile_node *node = &prof->nodes[prof->node];
+	prof->cycles[prev] += elapsed;
+	prof->op_cycles[code[prev].op] += elapsed;
+	prof->func_exclusive[node->func] += elapsed;
+	prof->total_cycles += elapsed;
+	node->self += elapsed;
+
+	if (code[prev].op == LOL_CALL) {
+		lolvm_profile_enter(prof, code[prev].target, now);
+	} else if (code[prev].op == LOL_RETURN && node->parent != (size_t)-1) {
+		lolvm_profile_leave(prof, now);
+	} else if (code[prev].op == LOL_TAILCALL) {
+		// The callee takes the caller's place in the call path
+		if (node->parent != (size_t)-1) {
+			lolvm_profile_leave(prof, now);
+		}
+		lolvm_profile_enter(prof, code[prev].target, now);
+	}
+}
+
+void lolvm_run_profiled(struct lolvm *vm, struct lolvm_profile *prof)
+{
+	struct lolvm_instr *code = vm->code;
+	struct lolvm_instr *ip = &code[vm->iptr];
+	unsigned char *stack = vm->stack;
+	size_t sptr = vm->sptr;
+
+	uint64_t last = lolvm_profile_now();
+	size_t prev = (size_t)-1;
+	if (prof->node == (size_t)-1) {
+		lolvm_profile_enter(prof, vm->iptr, last);
+	}
+
+	#define CASE(name) case LOL_ ## name
+	#define NEXT() { ip += 1; continue; }
+	#define NEXT_LEN() { ip += ip->len; continue; }
+	#define JUMP(index) { ip = &code[index]; continue; }
+	#define EXIT() goto out
+
+	while (!vm->halted) {
+		if (prev != (size_t)-1) {
+			uint64_t now = lolvm_profile_now();
+			lolvm_profile_charge(prof, code, prev, last, now);
+			last = now;
+		}
+
+		prev = ip - code;
+		prof->counts[prev] += 1;
+		prof->op_counts[ip->op] += 1;
+		prof->total_instrs += ip->len;
+
+		switch ((enum lolvm_op)ip->op) {
+		#include "lolvm_ops.inc"
+		}
+
+		// Unknown opcode
+		ip += 1;
+	}
+
+	#undef CASE
+	#undef NEXT
+	#undef NEXT_LEN
+	#undef JUMP
+	#undef EXIT
+
+out:
+	vm->iptr = ip - code;
+	vm->sptr = sptr;
+
+	uint64_t now = lolvm_profile_now();
+	if (prev != (size_t)-1) {
+		lolvm_profile_charge(prof, code, prev, last, now);
+	}
+
+	// Close the functions which are still running
+	if (vm->halted) {
+		while (prof->node != (size_t)-1) {
+			lolvm_profile_leave(prof, now);
+		}
+	}
+}
+
+static double lolvm_profile_percent(struct lolvm_profile *prof, uint64_t cycles)
+{
+	return prof->total_cycles ? 100.0 * cycles / prof->total_cycles : 0.0;
+}
+
+struct lolvm_profile_entry {
+	uint64_t key;
+	size_t index;
+};
+
+static int lolvm_profile_compare(const void *a, const void *b)
+{
+	uint64_t ka = ((const struct lolvm_profile_entry *)a)->key;
+	uint64_t kb = ((const struct lolvm_profile_entry *)b)->key;
+	return ka < kb ? 1 : ka > kb ? -1 : 0;
+}
+
+// Indices [0, n) sorted by 'keys', largest first, leaving out zero keys.
+// Returns the number of entries, or 0 on allocation failure.
+static size_t lolvm_profile_sorted(
+		const uint64_t *keys, size_t n, struct lolvm_profile_entry **out)
+{
+	struct lolvm_profile_entry *entries = malloc(n * sizeof(*entries));
+	*out = entries;
+	if (!entries) {
+		return 0;
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (keys[i]) {
+			entries[count].key = keys[i];
+			entries[count].index = i;
+			count += 1;
+		}
+	}
+
+	qsort(entries, count, sizeof(*entries), lolvm_profile_compare);
+	return count;
+}
+
+void lolvm_profile_print(struct lolvm_profile *prof, FILE *out)
+{
+	struct lolvm_program *prog = prof->prog;
+	struct lolvm_profile_entry *order;
+	size_t n;
+
+	fprintf(out, "Total: %" PRIu64 " instructions, %" PRIu64 " %s\n\n",
+		prof->total_instrs, prof->total_cycles, LOLVM_PROFILE_UNIT);
+
+	fprintf(out, "Opcodes:\n");
+	fprintf(out, "%12s %14s %6s  %s\n", "count", LOLVM_PROFILE_UNIT, "%", "opcode");
+	n = lolvm_profile_sorted(prof->op_cycles, 256, &order);
+	for (size_t i = 0; i < n; ++i) {
+		size_t op = order[i].index;
+		fprintf(out, "%12" PRIu64 " %14" PRIu64 " %5.1f%%  %s\n",
+			prof->op_counts[op], prof->op_cycles[op],
+			lolvm_profile_percent(prof, prof->op_cycles[op]), lolvm_op_name(op));
+	}
+	free(order);
+
+	fprintf(out, "\nFunctions:\n");
+	fprintf(out, "%12s %14s %6s %14s %6s  %s\n",
+		"calls", "inclusive", "%", "exclusive", "%", "function");
+	n = lolvm_profile_sorted(prof->func_inclusive, prog->count, &order);
+	for (size_t i = 0; i < n; ++i) {
+		size_t func = order[i].index;
+		fprintf(out, "%12" PRIu64 " %14" PRIu64 " %5.1f%% %14" PRIu64 " %5.1f%%  lol_%04" PRIu32 "\n",
+			prof->func_calls[func],
+			prof->func_inclusive[func], lolvm_profile_percent(prof, prof->func_inclusive[func]),
+			prof->func_exclusive[func], lolvm_profile_percent(prof, prof->func_exclusive[func]),
+			prog->addrs[func]);
+	}
+	free(order);
+
+	fprintf(out, "\nAnnotated disassembly:\n");
+	fprintf(out, "%12s %14s %6s  %s\n", "count", LOLVM_PROFILE_UNIT, "%", "instruction");
+	for (size_t i = 0; i < prog->count; ++i) {
+		size_t addr = prog->addrs[i];
+		if (prof->func_calls[i]) {
+			fprintf(out, "lol_%04zu:\n", addr);
+		}
+
+		fprintf(out, "%12" PRIu64 " %14" PRIu64 " %5.1f%%  %04zu ",
+			prof->counts[i], prof->cycles[i], lolvm_profile_percent(prof, prof->cycles[i]), addr);
+		if (addr >= prog->size) {
+			fprintf(out, "HALT (end of program)\n");
+		} else {
+			pretty_print_instruction(out, &prog->bytecode[addr]);
+		}
+
+		if (prog->code[i].len > 1) {
+			fprintf(out, "%36s(%s, %u instructions)\n", "",
+				lolvm_op_name(prog->code[i].op), prog->code[i].len);
+		}
+	}
+}
+
+static void lolvm_profile_print_path(struct lolvm_profile *prof, size_t node, FILE *out)
+{
+	if (prof->nodes[node].parent != (size_t)-1) {
+		lolvm_profile_print_path(prof, prof->nodes[node].parent, out);
+		fprintf(out, ";");
+	}
+
+	fprintf(out, "lol_%04" PRIu32, prof->prog->addrs[prof->nodes[node].func]);
+}
+
+void lolvm_profile_print_folded(struct lolvm_profile *prof, FILE *out)
+{
+	for (size_t i = 0; i < prof->nnodes; ++i) {
+		if (prof->nodes[i].self) {
+			lolvm_profile_print_path(prof, i, out);
+			fprintf(out, " %" PRIu64 "\n", prof->nodes[i].self);
+		}
+	}
+}
+
+/*
+ * Sampling profiler.
+ *
+ * A SIGPROF timer interrupts whichever thread is using the CPU. If that
+ * thread is inside lolvm_run_sampled, the handler copies the VM's current
+ * instruction and call stack into a ring buffer. A background thread
+ * drains the ring and adds the samples to the histograms.
+ *
+ * The only cost to the run loop is publishing 'ip' on every dispatch,
+ * so the sampler can be left on for long-running jobs.
+ */
+
+#define LOLVM_SAMPLE_RING_SIZE 1024
+
+// Milliseconds between each time the drain thread empties the ring
+#define LOLVM_SAMPLE_DRAIN_MS 10
+
+struct lolvm_sample {
+	_Atomic size_t seq;
+	uint32_t iptr;
+	uint32_t depth; // Return addresses in 'frames', innermost first
+	uint32_t cptr; // Total depth of the call stack
+	uint32_t frames[LOLVM_SAMPLE_DEPTH];
+};
+
+// Bounded multi-producer ring: several threads can be in the signal
+// handler at once, and the handler mustn't block, so full means dropped.
+struct lolvm_sampler_state {
+	struct lolvm_sample ring[LOLVM_SAMPLE_RING_SIZE];
+	_Atomic size_t head;
+	size_t tail;
+	_Atomic uint64_t dropped;
+
+	pthread_t thread;
+	_Atomic int running;
+	uint64_t *stamps; // Last sample each function was counted in
+	struct sigaction old_action;
+};
+
+static struct lolvm_sampler *_Atomic lolvm_sampler_active;
+
+// Signal handlers which might still be using lolvm_sampler_active
+static _Atomic int lolvm_sampler_inflight;
+
+// The VM being run by lolvm_run_sampled on this thread
+static _Thread_local struct lolvm *lolvm_sample_vm;
+
+static void lolvm_sample_record(struct lolvm_sampler *s, struct lolvm *vm)
+{
+	struct lolvm_sampler_state *st = s->state;
+	size_t pos = atomic_load_explicit(&st->head, memory_order_relaxed);
+	struct lolvm_sample *sample;
+	while (1) {
+		sample = &st->ring[pos % LOLVM_SAMPLE_RING_SIZE];
+		size_t seq = atomic_load_explicit(&sample->seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak_explicit(
+					&st->head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (seq < pos) {
+			atomic_fetch_add_explicit(&st->dropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			pos = atomic_load_explicit(&st->head, memory_order_relaxed);
+		}
+	}
+
+	struct lolvm_instr *ip = vm->sample_ip;
+	size_t cptr = vm->cptr;
+	if (cptr > vm->callstack_size) {
+		cptr = vm->callstack_size;
+	}
+
+	sample->iptr = ip ? (size_t)(ip - vm->code) : vm->iptr;
+	sample->cptr = cptr;
+	sample->depth = 0;
+	while (sample->depth < LOLVM_SAMPLE_DEPTH && sample->depth < cptr) {
+		sample->frames[sample->depth] = vm->callstack[cptr - 1 - sample->depth].iptr;
+		sample->depth += 1;
+	}
+
+	atomic_store_explicit(&sample->seq, pos + 1, memory_order_release);
+}
+
+static void lolvm_sample_handler(int sig)
+{
+	(void)sig;
+	int saved_errno = errno;
+	atomic_fetch_add(&lolvm_sampler_inflight, 1);
+	struct lolvm_sampler *s = atomic_load(&lolvm_sampler_active);
+	struct lolvm *vm = lolvm_sample_vm;
+	if (s && vm && vm->prog == s->prog) {
+		lolvm_sample_record(s, vm);
+	}
+
+	atomic_fetch_sub(&lolvm_sampler_inflight, 1);
+	errno = saved_errno;
+}
+
+// The function a return address points into is the target of
+// the CALL right before it
+static size_t lolvm_sample_caller(struct lolvm_program *prog, uint32_t ret)
+{
+	if (ret == 0 || ret > prog->count || prog->code[ret - 1].op != LOL_CALL) {
+		return (size_t)-1;
+	}
+
+	return prog->code[ret - 1].target;
+}
+
+static void lolvm_sample_count_func(struct lolvm_sampler *s, size_t func)
+{
+	if (func >= s->prog->count || s->state->stamps[func] == s->samples) {
+		return;
+	}
+
+	s->state->stamps[func] = s->samples;
+	s->func_total[func] += 1;
+}
+
+static void lolvm_sampler_drain(struct lolvm_sampler *s)
+{
+	struct lolvm_sampler_state *st = s->state;
+	while (1) {
+		struct lolvm_sample *sample = &st->ring[st->tail % LOLVM_SAMPLE_RING_SIZE];
+		size_t seq = atomic_load_explicit(&sample->seq, memory_order_acquire);
+		if (seq != st->tail + 1) {
+			break;
+		}
+
+		s->samples += 1;
+		if (sample->iptr < s->prog->count) {
+			s->addr_samples[sample->iptr] += 1;
+		}
+
+		// The innermost function is the one that was called last;
+		// the root is the code the VM started in
+		size_t func = sample->depth > 0 ? lolvm_sample_caller(s->prog, sample->frames[0]) : 0;
+		if (func < s->prog->count) {
+			s->func_self[func] += 1;
+		}
+
+		lolvm_sample_count_func(s, func);
+		for (uint32_t i = 1; i < sample->depth; ++i) {
+			lolvm_sample_count_func(s, lolvm_sample_caller(s->prog, sample->frames[i]));
+		}
+
+		if (sample->depth < sample->cptr) {
+			s->truncated += 1;
+		} else if (sample->depth > 0) {
+			lolvm_sample_count_func(s, 0);
+		}
+
+		atomic_store_explicit(&sample->seq, st->tail + LOLVM_SAMPLE_RING_SIZE, memory_order_release);
+		st->tail += 1;
+	}
+
+	s->dropped = atomic_load(&st->dropped);
+}
+
+static void *lolvm_sampler_main(void *arg)
+{
+	struct lolvm_sampler *s = arg;
+	struct timespec delay = {0, LOLVM_SAMPLE_DRAIN_MS * 1000000L};
+	while (atomic_load(&s->state->running)) {
+		lolvm_sampler_drain(s);
+		nanosleep(&delay, NULL);
+	}
+
+	return NULL;
+}
+
+int lolvm_sampler_start(struct lolvm_sampler *s, struct lolvm_program *prog, int hz)
+{
+	memset(s, 0, sizeof(*s));
+	s->prog = prog;
+	if (hz <= 0 || hz > 1000000) {
+		return -1;
+	}
+
+	s->addr_samples = calloc(prog->count, sizeof(*s->addr_samples));
+	s->func_self = calloc(prog->count, sizeof(*s->func_self));
+	s->func_total = calloc(prog->count, sizeof(*s->func_total));
+	s->state = calloc(1, sizeof(*s->state));
+	if (!s->addr_samples || !s->func_self || !s->func_total || !s->state) {
+		goto err;
+	}
+
+	struct lolvm_sampler_state *st = s->state;
+	st->stamps = malloc(prog->count * sizeof(*st->stamps));
+	if (!st->stamps) {
+		goto err;
+	}
+
+	// No sample has number -1, so nothing starts out counted
+	memset(st->stamps, 0xff, prog->count * sizeof(*st->stamps));
+	for (size_t i = 0; i < LOLVM_SAMPLE_RING_SIZE; ++i) {
+		atomic_init(&st->ring[i].seq, i);
+	}
+
+	// There's only one profiling timer per process
+	struct lolvm_sampler *expected = NULL;
+	if (!atomic_compare_exchange_strong(&lolvm_sampler_active, &expected, s)) {
+		goto err;
+	}
+
+	atomic_init(&st->running, 1);
+	if (pthread_create(&st->thread, NULL, lolvm_sampler_main, s) != 0) {
+		atomic_store(&lolvm_sampler_active, NULL);
+		goto err;
+	}
+
+	struct sigaction action = {0};
+	action.sa_handler = lolvm_sample_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, &st->old_action);
+
+	struct itimerval timer = {0};
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 1000000 / hz;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL) < 0) {
+		lolvm_sampler_stop(s);
+		lolvm_sampler_destroy(s);
+		return -1;
+	}
+
+	return 0;
+
+err:
+	lolvm_sampler_destroy(s);
+	return -1;
+}
+
+void lolvm_sampler_stop(struct lolvm_sampler *s)
+{
+	struct lolvm_sampler_state *st = s->state;
+	if (!st || !atomic_load(&st->running)) {
+		return;
+	}
+
+	struct itimerval timer = {0};
+	setitimer(ITIMER_PROF, &timer, NULL);
+	atomic_store(&lolvm_sampler_active, NULL);
+	while (atomic_load(&lolvm_sampler_inflight) > 0) {
+		sched_yield();
+	}
+
+	sigaction(SIGPROF, &st->old_action, NULL);
+	atomic_store(&st->running, 0);
+	pthread_join(st->thread, NULL);
+	lolvm_sampler_drain(s);
+}
+
+void lolvm_sampler_destroy(struct lolvm_sampler *s)
+{
+	lolvm_sampler_stop(s);
+	if (s->state) {
+		free(s->state->stamps);
+	}
+
+	free(s->state);
+	free(s->addr_samples);
+	free(s->func_self);
+	free(s->func_total);
+	memset(s, 0, sizeof(*s));
+}
+
+void lolvm_run_sampled(struct lolvm *vm)
+{
+#if LOLVM_THREADED
+	static void *const dispatch[256] = {
+		[0 ... 255] = &&op_invalid,
+#define X(name) [LOL_ ## name] = &&op_ ## name,
+LOLVM_OPS
+#undef X
+	};
+#endif
+
+	struct lolvm_instr *code = vm->code;
+	struct lolvm_instr *ip = &code[vm->iptr];
+	unsigned char *stack = vm->stack;
+	size_t sptr = vm->sptr;
+
+	// Put back whatever was there before, in case runs nest
+	struct lolvm *prev_vm = lolvm_sample_vm;
+	vm->sample_ip = ip;
+	lolvm_sample_vm = vm;
+
+#if LOLVM_THREADED
+	#define CASE(name) op_ ## name
+	#define DISPATCH() { vm->sample_ip = ip; goto *dispatch[ip->op]; }
+#else
+	#define CASE(name) case LOL_ ## name
+	#define DISPATCH() continue
+#endif
+	#define NEXT() { ip += 1; DISPATCH(); }
+	#define NEXT_LEN() { ip += ip->len; DISPATCH(); }
+	#define JUMP(index) { ip = &code[index]; DISPATCH(); }
+	#define EXIT() goto out
+
+	if (vm->halted) {
+		goto out;
+	}
+
+#if LOLVM_THREADED
+	DISPATCH();
+	#include "lolvm_ops.inc"
+op_invalid:
+	NEXT();
+#else
+	while (!vm->halted) {
+		vm->sample_ip = ip;
+		switch ((enum lolvm_op)ip->op) {
+		#include "lolvm_ops.inc"
+		}
+
+		// Unknown opcode
+		ip += 1;
+	}
+#endif
+
+	#undef CASE
+	#undef DISPATCH
+	#undef NEXT
+	#undef NEXT_LEN
+	#undef JUMP
+	#undef EXIT
+
+out:
+	lolvm_sample_vm = prev_vm;
+	vm->sample_ip = NULL;
+	vm->iptr = ip - code;
+	vm->sptr = sptr;
+}
+
+void lolvm_sampler_print(struct lolvm_sampler *s, FILE *out)
+{
+	struct lolvm_program *prog = s->prog;
+	struct lolvm_profile_entry *order;
+	size_t n;
+
+	fprintf(out, "Samples: %" PRIu64 " (%" PRIu64 " dropped, %" PRIu64 " with truncated stacks)\n\n",
+		s->samples, s->dropped, s->truncated);
+
+	fprintf(out, "Functions:\n");
+	fprintf(out, "%10s %6s %10s %6s  %s\n", "self", "%", "total", "%", "function");
+	n = lolvm_profile_sorted(s->func_total, prog->count, &order);
+	for (size_t i = 0; i < n; ++i) {
+		size_t func = order[i].index;
+		fprintf(out, "%10" PRIu64 " %5.1f%% %10" PRIu64 " %5.1f%%  lol_%04" PRIu32 "\n",
+			s->func_self[func], s->samples ? 100.0 * s->func_self[func] / s->samples : 0.0,
+			s->func_total[func], s->samples ? 100.0 * s->func_total[func] / s->samples : 0.0,
+			prog->addrs[func]);
+	}
+	free(order);
+
+	fprintf(out, "\nInstructions:\n");
+	fprintf(out, "%10s %6s  %s\n", "samples", "%", "instruction");
+	n = lolvm_profile_sorted(s->addr_samples, prog->count, &order);
+	for (size_t i = 0; i < n; ++i) {
+		size_t index = order[i].index;
+		size_t addr = prog->addrs[index];
+		fprintf(out, "%10" PRIu64 " %5.1f%%  %04zu ",
+			s->addr_samples[index], 100.0 * s->addr_samples[index] / s->samples, addr);
+		if (addr >= prog->size) {
+			fprintf(out, "HALT (end of program)\n");
+		} else {
+			pretty_print_instruction(out, &prog->bytecode[addr]);
+		}
+	}
+	free(order);
+}
+
+/*
+ * Execution traces. The run loop appends records to the current block
+ * of a ring, and hands full blocks to a writer thread. If the writer
+ * falls behind by the whole ring, the VM waits for it, so nothing is
+ * dropped. An instruction's record is written before it runs, but the
+ * bytes it wrote are only copied in when the next instruction starts.
+ */
+
+#define LOLVM_TRACE_MAGIC "LOLTRAC1"
+#define LOLVM_TRACE_BLOCK_SIZE ((size_t)1 << 18)
+#define LOLVM_TRACE_BLOCKS 8
+
+// The largest record: header, offset and the most bytes a record holds
+#define LOLVM_TRACE_HEADER_SIZE 7
+#define LOLVM_TRACE_RECORD_MAX (LOLVM_TRACE_HEADER_SIZE + 4 + UINT16_MAX + 1)
+
+// Blocks and edges shown by lolvm_trace_replay
+#define LOLVM_TRACE_TOP 20
+
+// Instructions shown for each block
+#define LOLVM_TRACE_BLOCK_LINES 16
+
+struct lolvm_trace_header {
+	char magic[8];
+	uint64_t prog_hash;
+	uint32_t count; // Decoded instructions, including the trailing HALT
+	uint32_t ptr_size;
+};
+
+struct lolvm_trace_state {
+	int fd;
+	unsigned char *blocks;
+	size_t used[LOLVM_TRACE_BLOCKS];
+	size_t head; // Blocks handed to the writer
+	size_t tail; // Blocks written
+	int stopping;
+	int failed;
+	uint64_t bytes;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+// The run loop's copy of the trace, which it can keep in registers
+struct lolvm_trace_cursor {
+	unsigned char *pos;
+	unsigned char *end;
+	const uint64_t *headers;
+	const int16_t *offsets;
+
+	// What the last instruction wrote, to be copied in once it's done
+	unsigned char *dest;
+	const unsigned char *src;
+	size_t size;
+};
+
+static unsigned char *lolvm_trace_block(struct lolvm_trace_state *st, size_t n)
+{
+	return st->blocks + (n % LOLVM_TRACE_BLOCKS) * LOLVM_TRACE_BLOCK_SIZE;
+}
+
+static void *lolvm_trace_main(void *arg)
+{
+	struct lolvm_trace_state *st = arg;
+	pthread_mutex_lock(&st->lock);
+	while (1) {
+		while (st->tail == st->head && !st->stopping) {
+			pthread_cond_wait(&st->cond, &st->lock);
+		}
+
+		if (st->tail == st->head) {
+			break;
+		}
+
+		size_t n = st->tail;
+		size_t used = st->used[n % LOLVM_TRACE_BLOCKS];
+		pthread_mutex_unlock(&st->lock);
+
+		if (!st->failed && lolvm_write_all(st->fd, lolvm_trace_block(st, n), used) < 0) {
+			st->failed = 1;
+		}
+		st->bytes += used;
+
+		pthread_mutex_lock(&st->lock);
+		st->tail += 1;
+		pthread_cond_broadcast(&st->cond);
+	}
+
+	pthread_mutex_unlock(&st->lock);
+	return NULL;
+}
+
+// Hand the current block to the writer, and wait for a free one
+static void lolvm_trace_flush(struct lolvm_trace *trace, int stopping)
+{
+	struct lolvm_trace_state *st = trace->state;
+	pthread_mutex_lock(&st->lock);
+	st->used[st->head % LOLVM_TRACE_BLOCKS] = trace->pos - lolvm_trace_block(st, st->head);
+	st->head += 1;
+	st->stopping = stopping;
+	pthread_cond_broadcast(&st->cond);
+	while (st->head - st->tail >= LOLVM_TRACE_BLOCKS) {
+		pthread_cond_wait(&st->cond, &st->lock);
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	trace->pos = lolvm_trace_block(st, st->head);
+	trace->end = trace->pos + LOLVM_TRACE_BLOCK_SIZE;
+}
+
+// The stack bytes an instruction writes, relative to sptr.
+// Fused instructions which write two places get the span of both.
+static void lolvm_instr_writes(
+		const struct lolvm_instr *ip, size_t ptr_size, int16_t *offset, uint32_t *size)
+{
+	int32_t a = ip->a;
+	int32_t b = -1;
+	uint32_t width = 0;
+	switch ((enum lolvm_op)ip->op) {
+	case LOL_SETI_8: case LOL_COPY_8: case LOL_ADD_8: case LOL_ADDI_8:
+	case LOL_EQ_8: case LOL_EQ_32: case LOL_EQ_64: case LOL_EQ_F32: case LOL_EQ_F64:
+	case LOL_NEQ_8: case LOL_NEQ_32: case LOL_NEQ_64: case LOL_NEQ_F32: case LOL_NEQ_F64:
+	case LOL_LT_U8: case LOL_LT_I32: case LOL_LT_I64: case LOL_LT_F32: case LOL_LT_F64:
+	case LOL_LE_U8: case LOL_LE_I32: case LOL_LE_I64: case LOL_LE_F32: case LOL_LE_F64:
+	case LOL_LOAD_8:
+	case LOL_BR_NEQ_8: case LOL_BR_NEQ_32: case LOL_BR_NEQ_64: case LOL_BR_NEQ_F32: case LOL_BR_NEQ_F64:
+	case LOL_BR_EQ_8: case LOL_BR_EQ_32: case LOL_BR_EQ_64: case LOL_BR_EQ_F32: case LOL_BR_EQ_F64:
+	case LOL_BR_GE_U8: case LOL_BR_GE_I32: case LOL_BR_GE_I64: case LOL_BR_GE_F32: case LOL_BR_GE_F64:
+	case LOL_BR_GT_U8: case LOL_BR_GT_I32: case LOL_BR_GT_I64: case LOL_BR_GT_F32: case LOL_BR_GT_F64:
+		width = 1;
+		break;
+	case LOL_SETI_32: case LOL_COPY_32: case LOL_ADD_32: case LOL_ADD_F32: case LOL_ADDI_32:
+	case LOL_LOAD_32: case LOL_ADDI_32_BR: case LOL_CHAN_NEW:
+	case LOL_LOOP_INC_LT_I32: case LOL_LOOP_INC_LE_I32:
+	case LOL_BRI_NEQ_32: case LOL_BRI_EQ_32: case LOL_BRI_GE_I32: case LOL_BRI_GT_I32:
+		width = 4;
+		break;
+	case LOL_SETI_64: case LOL_COPY_64: case LOL_ADD_64: case LOL_ADD_F64: case LOL_ADDI_64:
+	case LOL_LOAD_64: case LOL_ADDI_64_BR: case LOL_ARENA_BEGIN:
+		width = 8;
+		break;
+	case LOL_COPY_N: case LOL_LOAD_N:
+		width = (uint32_t)ip->imm;
+		break;
+	case LOL_REF: case LOL_ALLOC:
+		width = ptr_size;
+		break;
+	case LOL_CHAN_RECV:
+		a = ip->b;
+		width = (uint32_t)ip->imm;
+		break;
+	case LOL_SETI_ADD_32_BR:
+		b = ip->c;
+		width = 4;
+		break;
+	case LOL_SETI_ADD_64_BR:
+		b = ip->c;
+		width = 8;
+		break;
+	case LOL_COPY2_32:
+		b = ip->c;
+		width = 4;
+		break;
+	case LOL_COPY2_64:
+		b = ip->c;
+		width = 8;
+		break;
+	case LOL_TAILCALL:
+		a = ip->b;
+		width = -ip->b;
+		break;
+	case LOL_VSUM_I32: case LOL_VSUM_F32: case LOL_VMIN_I32: case LOL_VMAX_I32:
+		width = 4;
+		break;
+	case LOL_VEQ_I32: case LOL_VLT_I32: case LOL_VLE_I32: case LOL_FILL_8:
+		width = lolvm_vector_size(ip->imm, 1);
+		break;
+	case LOL_VADD_I32: case LOL_VADD_F32: case LOL_FILL_32:
+		width = lolvm_vector_size(ip->imm, 4);
+		break;
+	case LOL_FILL_64:
+		width = lolvm_vector_size(ip->imm, 8);
+		break;
+	default:
+		break;
+	}
+
+	int32_t end = a + width;
+	if (b >= 0) {
+		a = b < a ? b : a;
+		end = b + (int32_t)width > end ? b + (int32_t)width : end;
+	}
+
+	*offset = a;
+	*size = end - a > UINT16_MAX ? UINT16_MAX : end - a;
+}
+
+int lolvm_trace_start(struct lolvm_trace *trace, struct lolvm *vm, const char *path)
+{
+	struct lolvm_program *prog = vm->prog;
+	memset(trace, 0, sizeof(*trace));
+	trace->prog = prog;
+	trace->headers = malloc(prog->count * sizeof(*trace->headers));
+	trace->offsets = malloc(prog->count * sizeof(*trace->offsets));
+	struct lolvm_trace_state *st = calloc(1, sizeof(*st));
+	unsigned char *blocks = malloc(LOLVM_TRACE_BLOCKS * LOLVM_TRACE_BLOCK_SIZE);
+	if (!trace->headers || !trace->offsets || !st || !blocks) {
+		goto err;
+	}
+
+	size_t ptr_size = vm->memory ? 4 : 8;
+	for (size_t i = 0; i < prog->count; ++i) {
+		uint32_t size;
+		lolvm_instr_writes(&vm->code[i], ptr_size, &trace->offsets[i], &size);
+		trace->headers[i] = (uint64_t)i | (uint64_t)vm->code[i].op << 32 | (uint64_t)size << 40;
+	}
+
+	st->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (st->fd < 0) {
+		goto err;
+	}
+
+	struct lolvm_trace_header header = {0};
+	memcpy(header.magic, LOLVM_TRACE_MAGIC, sizeof(header.magic));
+	header.prog_hash = lolvm_program_hash(prog);
+	header.count = prog->count;
+	header.ptr_size = ptr_size;
+	if (lolvm_write_all(st->fd, (unsigned char *)&header, sizeof(header)) < 0) {
+		close(st->fd);
+		goto err;
+	}
+
+	st->blocks = blocks;
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+	int err = pthread_create(&st->thread, NULL, lolvm_trace_main, st);
+	if (err != 0) {
+		pthread_mutex_destroy(&st->lock);
+		pthread_cond_destroy(&st->cond);
+		close(st->fd);
+		errno = err;
+		goto err;
+	}
+
+	trace->state = st;
+	trace->pos = blocks;
+	trace->end = blocks + LOLVM_TRACE_BLOCK_SIZE;
+	return 0;
+
+err:
+	free(trace->headers);
+	free(trace->offsets);
+	free(st);
+	free(blocks);
+	memset(trace, 0, sizeof(*trace));
+	return -1;
+}
+
+int lolvm_trace_stop(struct lolvm_trace *trace)
+{
+	struct lolvm_trace_state *st = trace->state;
+	if (!st) {
+		return 0;
+	}
+
+	lolvm_trace_flush(trace, 1);
+	pthread_join(st->thread, NULL);
+
+	int ret = st->failed ? -1 : 0;
+	if (close(st->fd) < 0) {
+		ret = -1;
+	}
+
+	trace->bytes = sizeof(struct lolvm_trace_header) + st->bytes;
+	pthread_mutex_destroy(&st->lock);
+	pthread_cond_destroy(&st->cond);
+	free(st->blocks);
+	free(st);
+	free(trace->headers);
+	free(trace->offsets);
+	trace->state = NULL;
+	trace->headers = NULL;
+	trace->offsets = NULL;
+	trace->pos = trace->end = NULL;
+	return ret;
+}
+
+// Copy in the bytes the previous instruction wrote
+static inline void lolvm_trace_settle(struct lolvm_trace_cursor *cur)
+{
+	if (cur->size == 4) {
+		memcpy(cur->dest, cur->src, 4);
+	} else if (cur->size == 8) {
+		memcpy(cur->dest, cur->src, 8);
+	} else if (cur->size == 1) {
+		*cur->dest = *cur->src;
+	} else if (cur->size) {
+		memcpy(cur->dest, cur->src, cur->size);
+	}
+}
+
+static inline void lolvm_trace_record(
+		struct lolvm_trace *trace, struct lolvm_trace_cursor *cur,
+		size_t index, unsigned char *stack, size_t sptr)
+{
+	lolvm_trace_settle(cur);
+	if (cur->end - cur->pos < LOLVM_TRACE_RECORD_MAX) {
+		trace->pos = cur->pos;
+		lolvm_trace_flush(trace, 0);
+		cur->pos = trace->pos;
+		cur->end = trace->end;
+	}
+
+	// The header is written as one word; the byte after it is
+	// overwritten by the next record or the offset
+	unsigned char *p = cur->pos;
+	uint64_t header = cur->headers[index];
+	uint16_t size = header >> 40;
+	memcpy(p, &header, 8);
+	p += LOLVM_TRACE_HEADER_SIZE;
+	if (size) {
+		uint32_t offset = sptr + cur->offsets[index];
+		memcpy(p, &offset, 4);
+		cur->dest = p + 4;
+		cur->src = stack + offset;
+		p += 4 + size;
+	}
+
+	cur->size = size;
+	cur->pos = p;
+}
+
+void lolvm_run_traced(struct lolvm *vm, struct lolvm_trace *trace)
+{
+#if LOLVM_THREADED
+	static void *const dispatch[256] = {
+		[0 ... 255] = &&op_invalid,
+#define X(name) [LOL_ ## name] = &&op_ ## name,
+LOLVM_OPS
+#undef X
+	};
+#endif
+
+	struct lolvm_instr *code = vm->code;
+	struct lolvm_instr *ip = &code[vm->iptr];
+	unsigned char *stack = vm->stack;
+	size_t sptr = vm->sptr;
+	struct lolvm_trace_cursor cur = {
+		trace->pos, trace->end, trace->headers, trace->offsets, trace->pos, trace->pos, 0,
+	};
+
+	#define TRACE() lolvm_trace_record(trace, &cur, ip - code, stack, sptr)
+#if LOLVM_THREADED
+	#define CASE(name) op_ ## name
+	#define DISPATCH() goto record
+#else
+	#define CASE(name) case LOL_ ## name
+	#define DISPATCH() continue
+#endif
+	#define NEXT() { ip += 1; DISPATCH(); }
+	#define NEXT_LEN() { ip += ip->len; DISPATCH(); }
+	#define JUMP(index) { ip = &code[index]; DISPATCH(); }
+	#define EXIT() goto out
+
+	if (vm->halted) {
+		goto out;
+	}
+
+#if LOLVM_THREADED
+record:
+	TRACE();
+	goto *dispatch[ip->op];
+	#include "lolvm_ops.inc"
+op_invalid:
+	NEXT();
+#else
+	while (!vm->halted) {
+		TRACE();
+		switch ((enum lolvm_op)ip->op) {
+		#include "lolvm_ops.inc"
+		}
+
+		// Unknown opcode
+		ip += 1;
+	}
+#endif
+
+	#undef TRACE
+	#undef CASE
+	#undef DISPATCH
+	#undef NEXT
+	#undef NEXT_LEN
+	#undef JUMP
+	#undef EXIT
+
+out:
+	lolvm_trace_settle(&cur);
+	trace->pos = cur.pos;
+	vm->iptr = ip - code;
+	vm->sptr = sptr;
+}
+
+// Control flow edges, in an open addressing table keyed on (from, to)
+struct lolvm_trace_edges {
+	uint64_t *keys;
+	uint64_t *counts; // 0 for empty slots
+	size_t cap;
+	size_t count;
+};
+
+static int lolvm_trace_edge(struct lolvm_trace_edges *edges, uint32_t from, uint32_t to)
+{
+	if ((edges->count + 1) * 2 > edges->cap) {
+		struct lolvm_trace_edges grown;
+		grown.cap = edges->cap ? edges->cap * 2 : 1024;
+		grown.count = 0;
+		grown.keys = malloc(grown.cap * sizeof(*grown.keys));
+		grown.counts = calloc(grown.cap, sizeof(*grown.counts));
+		if (!grown.keys || !grown.counts) {
+			free(grown.keys);
+			free(grown.counts);
+			return -1;
+		}
+
+		for (size_t i = 0; i < edges->cap; ++i) {
+			if (!edges->counts[i]) {
+				continue;
+			}
+
+			size_t slot = (edges->keys[i] * 0x9e3779b97f4a7c15ull) >> 20;
+			while (grown.counts[slot & (grown.cap - 1)]) {
+				slot += 1;
+			}
+			grown.keys[slot & (grown.cap - 1)] = edges->keys[i];
+			grown.counts[slot & (grown.cap - 1)] = edges->counts[i];
+			grown.count += 1;
+		}
+
+		free(edges->keys);
+		free(edges->counts);
+		*edges = grown;
+	}
+
+	uint64_t key = (uint64_t)from << 32 | to;
+	size_t slot = (key * 0x9e3779b97f4a7c15ull) >> 20;
+	while (1) {
+		size_t i = slot & (edges->cap - 1);
+		if (!edges->counts[i]) {
+			edges->keys[i] = key;
+			edges->counts[i] = 1;
+			edges->count += 1;
+			return 0;
+		} else if (edges->keys[i] == key) {
+			edges->counts[i] += 1;
+			return 0;
+		}
+
+		slot += 1;
+	}
+}
+
+// With 'fused', superinstructions are shown by name before
+// the first instruction they stand for
+static void lolvm_trace_print_instr(struct lolvm_program *prog, size_t index, int fused, FILE *out)
+{
+	size_t addr = prog->addrs[index];
+	fprintf(out, "%04zu ", addr);
+	if (fused && prog->code[index].len > 1) {
+		fprintf(out, "[%s] ", lolvm_op_name(prog->code[index].op));
+	}
+	if (addr >= prog->size) {
+		fprintf(out, "HALT (end of program)\n");
+	} else {
+		pretty_print_instruction(out, &prog->bytecode[addr]);
+	}
+}
+
+static int lolvm_trace_fail(struct lolvm_program *prog, const char *error)
+{
+	prog->error = error;
+	prog->error_addr = 0;
+	return -1;
+}
+
+int lolvm_trace_replay(struct lolvm_program *prog, const char *path, int dump, FILE *out)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return lolvm_trace_fail(prog, "Failed to open the trace");
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct lolvm_trace_header)) {
+		close(fd);
+		return lolvm_trace_fail(prog, "Not a trace");
+	}
+
+	size_t size = st.st_size;
+	unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return lolvm_trace_fail(prog, "Failed to map the trace");
+	}
+
+	int ret = -1;
+	struct lolvm_trace_header header;
+	memcpy(&header, data, sizeof(header));
+	uint64_t *hits = calloc(prog->count, sizeof(*hits));
+	uint64_t *blocks = calloc(prog->count, sizeof(*blocks));
+	uint64_t *block_ends = calloc(prog->count, sizeof(*block_ends));
+	struct lolvm_trace_edges edges = {0};
+	struct lolvm_profile_entry *order = NULL;
+	if (!hits || !blocks || !block_ends) {
+		lolvm_trace_fail(prog, "Out of memory");
+		goto out;
+	}
+
+	if (memcmp(header.magic, LOLVM_TRACE_MAGIC, sizeof(header.magic)) != 0) {
+		lolvm_trace_fail(prog, "Not a trace");
+		goto out;
+	} else if (header.prog_hash != lolvm_program_hash(prog)) {
+		lolvm_trace_fail(prog, "Trace is of a different program");
+		goto out;
+	} else if (header.count != prog->count) {
+		lolvm_trace_fail(prog, "Trace was recorded with different options");
+		goto out;
+	}
+
+	uint64_t records = 0;
+	uint64_t written = 0;
+	size_t prev = SIZE_MAX;
+	size_t block = SIZE_MAX;
+	const unsigned char *p = data + sizeof(header);
+	const unsigned char *end = data + size;
+	while (p < end) {
+		uint32_t index;
+		uint16_t nbytes;
+		if (end - p < LOLVM_TRACE_HEADER_SIZE) {
+			lolvm_trace_fail(prog, "Truncated trace");
+			goto out;
+		}
+
+		memcpy(&index, p, 4);
+		memcpy(&nbytes, p + 5, 2);
+		if (index >= prog->count || p[4] != prog->code[index].op) {
+			lolvm_trace_fail(prog, "Trace was recorded with different options");
+			goto out;
+		}
+
+		uint32_t offset = 0;
+		const unsigned char *bytes = p + LOLVM_TRACE_HEADER_SIZE + 4;
+		if (nbytes) {
+			if ((size_t)(end - p) < (size_t)LOLVM_TRACE_HEADER_SIZE + 4 + nbytes) {
+				lolvm_trace_fail(prog, "Truncated trace");
+				goto out;
+			}
+
+			memcpy(&offset, p + LOLVM_TRACE_HEADER_SIZE, 4);
+			p += LOLVM_TRACE_HEADER_SIZE + 4 + nbytes;
+		} else {
+			p += LOLVM_TRACE_HEADER_SIZE;
+		}
+
+		if (dump) {
+			lolvm_trace_print_instr(prog, index, 1, out);
+			if (nbytes) {
+				fprintf(out, "     @%" PRIu32 ":", offset);
+				for (size_t i = 0; i < nbytes && i < 16; ++i) {
+					fprintf(out, " %02x", bytes[i]);
+				}
+				fprintf(out, nbytes > 16 ? " ...\n" : "\n");
+			}
+		}
+
+		// Anything but falling through to the next instruction ends the block
+		if (prev == SIZE_MAX || index != prev + prog->code[prev].len) {
+			if (prev != SIZE_MAX && lolvm_trace_edge(&edges, prev, index) < 0) {
+				lolvm_trace_fail(prog, "Out of memory");
+				goto out;
+			}
+
+			block = index;
+			blocks[block] += 1;
+		}
+
+		size_t next = index + prog->code[index].len;
+		if (next > block_ends[block]) {
+			block_ends[block] = next;
+		}
+
+		hits[index] += 1;
+		records += 1;
+		written += nbytes;
+		prev = index;
+	}
+
+	if (dump) {
+		fprintf(out, "\n");
+	}
+
+	fprintf(out, "Trace: %" PRIu64 " instructions, %" PRIu64 " bytes written to the stack\n\n",
+		records, written);
+
+	fprintf(out, "Blocks:\n");
+	fprintf(out, "%12s %8s  %s\n", "count", "instrs", "block");
+	size_t n = lolvm_profile_sorted(blocks, prog->count, &order);
+	for (size_t i = 0; i < n && i < LOLVM_TRACE_TOP; ++i) {
+		size_t start = order[i].index;
+		uint64_t instrs = 0;
+		for (size_t j = start; j < block_ends[start]; j += prog->code[j].len) {
+			instrs += hits[j];
+		}
+
+		fprintf(out, "%12" PRIu64 " %8.1f  %04" PRIu32 "-%04" PRIu32 "\n",
+			blocks[start], (double)instrs / blocks[start],
+			prog->addrs[start], prog->addrs[block_ends[start] - 1]);
+		for (size_t j = start; j < block_ends[start]; ++j) {
+			if (j - start == LOLVM_TRACE_BLOCK_LINES) {
+				fprintf(out, "%24s...\n", "");
+				break;
+			}
+
+			fprintf(out, "%23s", "");
+			lolvm_trace_print_instr(prog, j, 0, out);
+		}
+	}
+	free(order);
+	order = NULL;
+
+	fprintf(out, "\nEdges:\n");
+	fprintf(out, "%12s  %s\n", "count", "edge");
+	n = lolvm_profile_sorted(edges.counts, edges.cap, &order);
+	for (size_t i = 0; i < n && i < LOLVM_TRACE_TOP; ++i) {
+		uint64_t key = edges.keys[order[i].index];
+		uint32_t from = key >> 32;
+		uint32_t to = key;
+		fprintf(out, "%12" PRIu64 "  %04" PRIu32 " -> %04" PRIu32 "%s\n",
+			order[i].key, prog->addrs[from], prog->addrs[to],
+			to <= from ? " (back edge)" : "");
+	}
+
+	ret = 0;
+
+out:
+	free(order);
+	free(hits);
+	free(blocks);
+	free(block_ends);
+	free(edges.keys);
+	free(edges.counts);
+	munmap(data, size);
+	return ret;
+}
+
+#if LOLVM_JIT
+
+/*
+ * Template JIT for x86-64.
+ *
+ * Every decoded instruction is translated on its own into a fixed machine
+ * code sequence. JIT'd code keeps the VM state in callee-saved registers:
+ *   rbx  &vm->stack[sptr]
+ *   r12  vm
+ *   r13  jit->entries
+ *   r14  &vm->stack[0]
+ * CALL and RETURN go through vm->callstack just like in the interpreter,
+ * which means control can move between JIT'd code and the interpreter
+ * at any instruction boundary. Instructions the JIT has no template for
+ * leave JIT'd code with vm->iptr pointing at them, lolvm_run_jit steps
+ * them in the interpreter, and then re-enters JIT'd code.
+ */
+
+enum {
+	JIT_RAX, JIT_RCX, JIT_RDX, JIT_RBX, JIT_RSP, JIT_RBP, JIT_RSI, JIT_RDI,
+	JIT_R8, JIT_R9, JIT_R10, JIT_R11, JIT_R12, JIT_R13, JIT_R14, JIT_R15,
+};
+
+#define JIT_FRAME JIT_RBX
+#define JIT_VM JIT_R12
+#define JIT_ENTRIES JIT_R13
+#define JIT_STACK JIT_R14
+
+// x86 condition codes
+enum {
+	JIT_CC_B = 0x2, JIT_CC_AE = 0x3, JIT_CC_E = 0x4, JIT_CC_NE = 0x5,
+	JIT_CC_BE = 0x6, JIT_CC_A = 0x7, JIT_CC_P = 0xa, JIT_CC_NP = 0xb,
+	JIT_CC_L = 0xc, JIT_CC_LE = 0xe,
+};
+
+struct lolvm_jit_fixup {
+	size_t pos;
+	size_t target;
+};
+
+struct lolvm_jit_buf {
+	unsigned char *data;
+	size_t len;
+	size_t cap;
+	int oom;
+
+	// Offset of the code for each instruction in the range being compiled
+	size_t *offsets;
+	struct lolvm_jit_fixup *fixups;
+	size_t nfixups;
+	size_t fixups_cap;
+};
+
+static void jit_byte(struct lolvm_jit_buf *b, uint8_t v)
+{
+	if (b->oom) {
+		return;
+	}
+
+	if (b->len == b->cap) {
+		size_t cap = b->cap ? b->cap * 2 : 4096;
+		unsigned char *data = realloc(b->data, cap);
+		if (!data) {
+			b->oom = 1;
+			return;
+		}
+
+		b->data = data;
+		b->cap = cap;
+	}
+
+	b->data[b->len++] = v;
+}
+
+static void jit_u32(struct lolvm_jit_buf *b, uint32_t v)
+{
+	for (int i = 0; i < 4; ++i) {
+		jit_byte(b, v >> (i * 8));
+	}
+}
+
+static void jit_u64(struct lolvm_jit_buf *b, uint64_t v)
+{
+	for (int i = 0; i < 8; ++i) {
+		jit_byte(b, v >> (i * 8));
+	}
+}
+
+static void jit_opcode(struct lolvm_jit_buf *b, uint32_t opcode, int oplen)
+{
+	for (int i = oplen - 1; i >= 0; --i) {
+		jit_byte(b, opcode >> (i * 8));
+	}
+}
+
+static void jit_rex(struct lolvm_jit_buf *b, int w, int reg, int rm)
+{
+	int rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+	if (rex != 0x40) {
+		jit_byte(b, rex);
+	}
+}
+
+// Instruction with a register and a [base + disp] memory operand.
+// 'prefix' is a mandatory prefix (0x66, 0xf2, 0xf3) or 0,
+// 'w' selects a 64-bit operand size.
+static void jit_mem(
+		struct lolvm_jit_buf *b, int prefix, int w, uint32_t opcode, int oplen,
+		int reg, int base, int32_t disp)
+{
+	if (prefix) {
+		jit_byte(b, prefix);
+	}
+
+	jit_rex(b, w, reg, base);
+	jit_opcode(b, opcode, oplen);
+
+	int disp8 = disp >= -128 && disp <= 127;
+	jit_byte(b, (disp8 ? 0x40 : 0x80) | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == JIT_RSP) {
+		jit_byte(b, 0x24);
+	}
+
+	if (disp8) {
+		jit_byte(b, (uint8_t)disp);
+	} else {
+		jit_u32(b, disp);
+	}
+}
+
+// Instruction with two register operands
+static void jit_reg(
+		struct lolvm_jit_buf *b, int prefix, int w, uint32_t opcode, int oplen,
+		int reg, int rm)
+{
+	if (prefix) {
+		jit_byte(b, prefix);
+	}
+
+	jit_rex(b, w, reg, rm);
+	jit_opcode(b, opcode, oplen);
+	jit_byte(b, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// mov reg, [rbx + off], zero-extending 1-byte values
+static void jit_load(struct lolvm_jit_buf *b, int size, int reg, int16_t off)
+{
+	if (size == 1) {
+		jit_mem(b, 0, 0, 0x0fb6, 2, reg, JIT_FRAME, off);
+	} else {
+		jit_mem(b, 0, size == 8, 0x8b, 1, reg, JIT_FRAME, off);
+	}
+}
+
+// Load the pointer at [rbx + off] into 'reg' as a host address;
+// a sandbox's 32-bit offsets are added to vm->memory
+static void jit_load_ptr(
+		struct lolvm_jit_buf *b, const struct lolvm_program *prog, int reg, int16_t off)
+{
+	if (prog->sandbox) {
+		jit_load(b, 4, reg, off);
+		jit_mem(b, 0, 1, 0x03, 1, reg, JIT_VM, offsetof(struct lolvm, memory));
+	} else {
+		jit_load(b, 8, reg, off);
+	}
+}
+
+// mov [rbx + off], reg
+static void jit_store(struct lolvm_jit_buf *b, int size, int16_t off, int reg)
+{
+	if (size == 1) {
+		jit_mem(b, 0, 0, 0x88, 1, reg, JIT_FRAME, off);
+	} else {
+		jit_mem(b, 0, size == 8, 0x89, 1, reg, JIT_FRAME, off);
+	}
+}
+
+// mov [rbx + off], imm (sign-extended to 8 bytes for size 8)
+static void jit_store_imm(struct lolvm_jit_buf *b, int size, int16_t off, uint32_t imm)
+{
+	if (size == 1) {
+		jit_mem(b, 0, 0, 0xc6, 1, 0, JIT_FRAME, off);
+		jit_byte(b, imm);
+	} else {
+		jit_mem(b, 0, size == 8, 0xc7, 1, 0, JIT_FRAME, off);
+		jit_u32(b, imm);
+	}
+}
+
+// mov reg, imm64
+static void jit_mov_imm64(struct lolvm_jit_buf *b, int reg, uint64_t imm)
+{
+	jit_rex(b, 1, 0, reg);
+	jit_byte(b, 0xb8 + (reg & 7));
+	jit_u64(b, imm);
+}
+
+// setcc reg8
+static void jit_setcc(struct lolvm_jit_buf *b, int cc, int reg)
+{
+	jit_reg(b, 0, 0, 0x0f90 | cc, 2, 0, reg);
+}
+
+// Jump to the code for instruction 'target'
+static void jit_jmp(struct lolvm_jit_buf *b, int cc, size_t target)
+{
+	if (cc < 0) {
+		jit_byte(b, 0xe9);
+	} else {
+		jit_byte(b, 0x0f);
+		jit_byte(b, 0x80 | cc);
+	}
+
+	if (b->nfixups == b->fixups_cap) {
+		size_t cap = b->fixups_cap ? b->fixups_cap * 2 : 256;
+		struct lolvm_jit_fixup *fixups = realloc(b->fixups, cap * sizeof(*fixups));
+		if (!fixups) {
+			b->oom = 1;
+			return;
+		}
+
+		b->fixups = fixups;
+		b->fixups_cap = cap;
+	}
+
+	b->fixups[b->nfixups].pos = b->len;
+	b->fixups[b->nfixups].target = target;
+	b->nfixups += 1;
+	jit_u32(b, 0);
+}
+
+// Leave JIT'd code, continuing at instruction 'iptr' in the interpreter
+static void jit_exit(struct lolvm_jit *jit, struct lolvm_jit_buf *b, size_t iptr)
+{
+	jit_mem(b, 0, 1, 0xc7, 1, 0, JIT_VM, offsetof(struct lolvm, iptr));
+	jit_u32(b, iptr);
+	jit_mov_imm64(b, JIT_RAX, (uint64_t)jit->exit);
+	jit_reg(b, 0, 0, 0xff, 1, 4, JIT_RAX);
+}
+
+static void lolvm_jit_step(struct lolvm *vm, size_t iptr, size_t sptr)
+{
+	vm->iptr = iptr;
+	vm->sptr = sptr;
+	lolvm_step(vm);
+}
+
+// Run instruction 'iptr' through the interpreter from JIT'd code.
+// Only valid for instructions which don't change iptr or sptr.
+static void jit_call_step(struct lolvm_jit_buf *b, size_t iptr)
+{
+	jit_reg(b, 0, 1, 0x89, 1, JIT_VM, JIT_RDI);
+	jit_mov_imm64(b, JIT_RSI, iptr);
+	jit_reg(b, 0, 1, 0x89, 1, JIT_FRAME, JIT_RDX);
+	jit_reg(b, 0, 1, 0x29, 1, JIT_STACK, JIT_RDX);
+	jit_mov_imm64(b, JIT_RAX, (uint64_t)lolvm_jit_step);
+	jit_reg(b, 0, 0, 0xff, 1, 2, JIT_RAX);
+}
+
+// memcpy(dest_reg + dest_off, src_reg + src_off, size)
+static void jit_call_memcpy(
+		struct lolvm_jit_buf *b, int dest_reg, int16_t dest_off,
+		int src_reg, int16_t src_off, uint32_t size)
+{
+	jit_mem(b, 0, 1, 0x8d, 1, JIT_RDI, dest_reg, dest_off);
+	jit_mem(b, 0, 1, 0x8d, 1, JIT_RSI, src_reg, src_off);
+	jit_mov_imm64(b, JIT_RDX, size);
+	jit_mov_imm64(b, JIT_RAX, (uint64_t)memcpy);
+	jit_reg(b, 0, 0, 0xff, 1, 2, JIT_RAX);
+}
+
+// Evaluate a comparison instruction into al
+static void jit_compare(struct lolvm_jit_buf *b, enum lolvm_op op, int16_t lhs, int16_t rhs)
+{
+	int size;
+	int cc;
+	switch (op) {
+	case LOL_EQ_8: size = 1; cc = JIT_CC_E; break;
+	case LOL_EQ_32: size = 4; cc = JIT_CC_E; break;
+	case LOL_EQ_64: size = 8; cc = JIT_CC_E; break;
+	case LOL_NEQ_8: size = 1; cc = JIT_CC_NE; break;
+	case LOL_NEQ_32: size = 4; cc = JIT_CC_NE; break;
+	case LOL_NEQ_64: size = 8; cc = JIT_CC_NE; break;
+	case LOL_LT_U8: size = 1; cc = JIT_CC_B; break;
+	case LOL_LT_I32: size = 4; cc = JIT_CC_L; break;
+	case LOL_LT_I64: size = 8; cc = JIT_CC_L; break;
+	case LOL_LE_U8: size = 1; cc = JIT_CC_BE; break;
+	case LOL_LE_I32: size = 4; cc = JIT_CC_LE; break;
+	case LOL_LE_I64: size = 8; cc = JIT_CC_LE; break;
+
+	case LOL_EQ_F32:
+	case LOL_EQ_F64:
+	case LOL_NEQ_F32:
+	case LOL_NEQ_F64: {
+		int f64 = op == LOL_EQ_F64 || op == LOL_NEQ_F64;
+		jit_mem(b, f64 ? 0xf2 : 0xf3, 0, 0x0f10, 2, 0, JIT_FRAME, lhs);
+		jit_mem(b, f64 ? 0x66 : 0, 0, 0x0f2e, 2, 0, JIT_FRAME, rhs);
+		if (op == LOL_EQ_F32 || op == LOL_EQ_F64) {
+			jit_setcc(b, JIT_CC_E, JIT_RAX);
+			jit_setcc(b, JIT_CC_NP, JIT_RCX);
+			jit_reg(b, 0, 0, 0x20, 1, JIT_RCX, JIT_RAX);
+		} else {
+			jit_setcc(b, JIT_CC_NE, JIT_RAX);
+			jit_setcc(b, JIT_CC_P, JIT_RCX);
+			jit_reg(b, 0, 0, 0x08, 1, JIT_RCX, JIT_RAX);
+		}
+		return;
+	}
+
+	// a < b is b > a, which ucomis* reports as 'above',
+	// and which is false when either is NaN
+	case LOL_LT_F32:
+	case LOL_LT_F64:
+	case LOL_LE_F32:
+	case LOL_LE_F64: {
+		int f64 = op == LOL_LT_F64 || op == LOL_LE_F64;
+		jit_mem(b, f64 ? 0xf2 : 0xf3, 0, 0x0f10, 2, 0, JIT_FRAME, rhs);
+		jit_mem(b, f64 ? 0x66 : 0, 0, 0x0f2e, 2, 0, JIT_FRAME, lhs);
+		if (op == LOL_LT_F32 || op == LOL_LT_F64) {
+			jit_setcc(b, JIT_CC_A, JIT_RAX);
+		} else {
+			jit_setcc(b, JIT_CC_AE, JIT_RAX);
+		}
+		return;
+	}
+
+	default:
+		return;
+	}
+
+	jit_load(b, size, JIT_RAX, lhs);
+	if (size == 1) {
+		jit_mem(b, 0, 0, 0x3a, 1, JIT_RAX, JIT_FRAME, rhs);
+	} else {
+		jit_mem(b, 0, size == 8, 0x3b, 1, JIT_RAX, JIT_FRAME, rhs);
+	}
+	jit_setcc(b, cc, JIT_RAX);
+}
+
+// Emit code for code[i]. Returns 0 if there's no template for it,
+// in which case the caller emits an exit to the interpreter instead.
+static int jit_instr(struct lolvm_jit *jit, struct lolvm_jit_buf *b, size_t i)
+{
+	struct lolvm_instr *ip = &jit->prog->code[i];
+	size_t next = i + ip->len;
+
+	switch ((enum lolvm_op)ip->op) {
+	case LOL_SETI_8:
+		jit_store_imm(b, 1, ip->a, (uint8_t)ip->imm);
+		return 1;
+	case LOL_SETI_32:
+		jit_store_imm(b, 4, ip->a, (uint32_t)ip->imm);
+		return 1;
+	case LOL_SETI_64:
+		jit_mov_imm64(b, JIT_RAX, ip->imm);
+		jit_store(b, 8, ip->a, JIT_RAX);
+		return 1;
+
+	case LOL_COPY_8:
+		jit_load(b, 1, JIT_RAX, ip->b);
+		jit_store(b, 1, ip->a, JIT_RAX);
+		return 1;
+	case LOL_COPY_32:
+		jit_load(b, 4, JIT_RAX, ip->b);
+		jit_store(b, 4, ip->a, JIT_RAX);
+		return 1;
+	case LOL_COPY_64:
+		jit_load(b, 8, JIT_RAX, ip->b);
+		jit_store(b, 8, ip->a, JIT_RAX);
+		return 1;
+	case LOL_COPY_N:
+		jit_call_memcpy(b, JIT_FRAME, ip->a, JIT_FRAME, ip->b, (uint32_t)ip->imm);
+		return 1;
+
+	case LOL_ADD_8:
+		jit_load(b, 1, JIT_RAX, ip->b);
+		jit_mem(b, 0, 0, 0x02, 1, JIT_RAX, JIT_FRAME, ip->c);
+		jit_store(b, 1, ip->a, JIT_RAX);
+		return 1;
+	case LOL_ADD_32:
+	case LOL_ADD_64: {
+		int size = ip->op == LOL_ADD_32 ? 4 : 8;
+		jit_load(b, size, JIT_RAX, ip->b);
+		jit_mem(b, 0, size == 8, 0x03, 1, JIT_RAX, JIT_FRAME, ip->c);
+		jit_store(b, size, ip->a, JIT_RAX);
+		return 1;
+	}
+	case LOL_ADD_F32:
+	case LOL_ADD_F64: {
+		int prefix = ip->op == LOL_ADD_F32 ? 0xf3 : 0xf2;
+		jit_mem(b, prefix, 0, 0x0f10, 2, 0, JIT_FRAME, ip->b);
+		jit_mem(b, prefix, 0, 0x0f58, 2, 0, JIT_FRAME, ip->c);
+		jit_mem(b, prefix, 0, 0x0f11, 2, 0, JIT_FRAME, ip->a);
+		return 1;
+	}
+
+	case LOL_ADDI_8:
+		jit_load(b, 1, JIT_RAX, ip->b);
+		jit_byte(b, 0x04);
+		jit_byte(b, (uint8_t)ip->imm);
+		jit_store(b, 1, ip->a, JIT_RAX);
+		return 1;
+	case LOL_ADDI_32:
+		jit_load(b, 4, JIT_RAX, ip->b);
+		jit_byte(b, 0x05);
+		jit_u32(b, (uint32_t)ip->imm);
+		jit_store(b, 4, ip->a, JIT_RAX);
+		return 1;
+	case LOL_ADDI_64:
+		jit_mov_imm64(b, JIT_RAX, ip->imm);
+		jit_mem(b, 0, 1, 0x03, 1, JIT_RAX, JIT_FRAME, ip->b);
+		jit_store(b, 8, ip->a, JIT_RAX);
+		return 1;
+
+	case LOL_EQ_8:
+	case LOL_EQ_32:
+	case LOL_EQ_64:
+	case LOL_EQ_F32:
+	case LOL_EQ_F64:
+	case LOL_NEQ_8:
+	case LOL_NEQ_32:
+	case LOL_NEQ_64:
+	case LOL_NEQ_F32:
+	case LOL_NEQ_F64:
+	case LOL_LT_U8:
+	case LOL_LT_I32:
+	case LOL_LT_I64:
+	case LOL_LT_F32:
+	case LOL_LT_F64:
+	case LOL_LE_U8:
+	case LOL_LE_I32:
+	case LOL_LE_I64:
+	case LOL_LE_F32:
+	case LOL_LE_F64:
+		jit_compare(b, ip->op, ip->b, ip->c);
+		jit_store(b, 1, ip->a, JIT_RAX);
+		return 1;
+
+	case LOL_REF:
+		jit_mem(b, 0, 1, 0x8d, 1, JIT_RAX, JIT_FRAME, ip->b);
+		if (jit->prog->sandbox) {
+			jit_mem(b, 0, 1, 0x2b, 1, JIT_RAX, JIT_VM, offsetof(struct lolvm, memory));
+			jit_store(b, 4, ip->a, JIT_RAX);
+		} else {
+			jit_store(b, 8, ip->a, JIT_RAX);
+		}
+		return 1;
+
+	case LOL_LOAD_8:
+	case LOL_LOAD_32:
+	case LOL_LOAD_64: {
+		int size = ip->op == LOL_LOAD_8 ? 1 : ip->op == LOL_LOAD_32 ? 4 : 8;
+		jit_load_ptr(b, jit->prog, JIT_RAX, ip->b);
+		if (size == 1) {
+			jit_mem(b, 0, 0, 0x0fb6, 2, JIT_RCX, JIT_RAX, 0);
+		} else {
+			jit_mem(b, 0, size == 8, 0x8b, 1, JIT_RCX, JIT_RAX, 0);
+		}
+		jit_store(b, size, ip->a, JIT_RCX);
+		return 1;
+	}
+	case LOL_LOAD_N:
+		jit_load_ptr(b, jit->prog, JIT_RSI, ip->b);
+		jit_call_memcpy(b, JIT_FRAME, ip->a, JIT_RSI, 0, (uint32_t)ip->imm);
+		return 1;
+
+	case LOL_STORE_8:
+	case LOL_STORE_32:
+	case LOL_STORE_64: {
+		int size = ip->op == LOL_STORE_8 ? 1 : ip->op == LOL_STORE_32 ? 4 : 8;
+		jit_load_ptr(b, jit->prog, JIT_RAX, ip->a);
+		jit_load(b, size, JIT_RCX, ip->b);
+		if (size == 1) {
+			jit_mem(b, 0, 0, 0x88, 1, JIT_RCX, JIT_RAX, 0);
+		} else {
+			jit_mem(b, 0, size == 8, 0x89, 1, JIT_RCX, JIT_RAX, 0);
+		}
+		return 1;
+	}
+	case LOL_STORE_N:
+		jit_load_ptr(b, jit->prog, JIT_RDI, ip->a);
+		jit_mem(b, 0, 1, 0x8d, 1, JIT_RSI, JIT_FRAME, ip->b);
+		jit_mov_imm64(b, JIT_RDX, (uint32_t)ip->imm);
+		jit_mov_imm64(b, JIT_RAX, (uint64_t)memcpy);
+		jit_reg(b, 0, 0, 0xff, 1, 2, JIT_RAX);
+		return 1;
+
+	case LOL_CALL: {
+		// rcx = &vm->callstack[vm->cptr++]
+		jit_mem(b, 0, 1, 0x8b, 1, JIT_RAX, JIT_VM, offsetof(struct lolvm, cptr));
+		jit_mem(b, 0, 1, 0x8d, 1, JIT_RDX, JIT_RAX, 1);
+		jit_mem(b, 0, 1, 0x89, 1, JIT_RDX, JIT_VM, offsetof(struct lolvm, cptr));
+		jit_reg(b, 0, 1, 0xc1, 1, 4, JIT_RAX);
+		jit_byte(b, 4);
+		jit_mem(b, 0, 1, 0x03, 1, JIT_RAX, JIT_VM, offsetof(struct lolvm, callstack));
+		jit_reg(b, 0, 1, 0x89, 1, JIT_RAX, JIT_RCX);
+
+		// frame->sptr = rbx - r14, frame->iptr = i + 1
+		jit_reg(b, 0, 1, 0x89, 1, JIT_FRAME, JIT_RDX);
+		jit_reg(b, 0, 1, 0x29, 1, JIT_STACK, JIT_RDX);
+		jit_mem(b, 0, 1, 0x89, 1, JIT_RDX, JIT_RCX, offsetof(struct lolvm_stack_frame, sptr));
+		jit_mem(b, 0, 1, 0xc7, 1, 0, JIT_RCX, offsetof(struct lolvm_stack_frame, iptr));
+		jit_u32(b, i + 1);
+
+		jit_mem(b, 0, 1, 0x8d, 1, JIT_FRAME, JIT_FRAME, ip->a);
+		jit_jmp(b, -1, ip->target);
+		return 1;
+	}
+	case LOL_TAILCALL: {
+		// Arguments are moved 4 bytes at a time, since they were usually
+		// just written as separate 4 or 8 byte values, and loading 8 bytes
+		// which two stores wrote stalls. Arguments which overlap the
+		// parameters are left to the interpreter.
+		int32_t size = -ip->b;
+		if (ip->a < 0 && ip->a + size > ip->b) {
+			return 0;
+		}
+
+		for (int32_t off = 0; off < size;) {
+			int chunk = size - off >= 4 ? 4 : 1;
+			jit_load(b, chunk, JIT_RAX, ip->a + off);
+			jit_store(b, chunk, ip->b + off, JIT_RAX);
+			off += chunk;
+		}
+
+		jit_jmp(b, -1, ip->target);
+		return 1;
+	}
+	case LOL_RETURN: {
+		// rcx = &vm->callstack[--vm->cptr]
+		jit_mem(b, 0, 1, 0x8b, 1, JIT_RAX, JIT_VM, offsetof(struct lolvm, cptr));
+		jit_mem(b, 0, 1, 0x8d, 1, JIT_RAX, JIT_RAX, -1);
+		jit_mem(b, 0, 1, 0x89, 1, JIT_RAX, JIT_VM, offsetof(struct lolvm, cptr));
+		jit_reg(b, 0, 1, 0xc1, 1, 4, JIT_RAX);
+		jit_byte(b, 4);
+		jit_mem(b, 0, 1, 0x03, 1, JIT_RAX, JIT_VM, offsetof(struct lolvm, callstack));
+		jit_reg(b, 0, 1, 0x89, 1, JIT_RAX, JIT_RCX);
+
+		// rbx = r14 + frame->sptr
+		jit_mem(b, 0, 1, 0x8b, 1, JIT_FRAME, JIT_RCX, offsetof(struct lolvm_stack_frame, sptr));
+		jit_reg(b, 0, 1, 0x01, 1, JIT_STACK, JIT_FRAME);
+
+		// Jump to entries[frame->iptr], or exit if it has no code
+		jit_mem(b, 0, 1, 0x8b, 1, JIT_RAX, JIT_RCX, offsetof(struct lolvm_stack_frame, iptr));
+		jit_byte(b, 0x49); // mov rdx, [r13 + rax * 8]
+		jit_byte(b, 0x8b);
+		jit_byte(b, 0x54);
+		jit_byte(b, 0xc5);
+		jit_byte(b, 0x00);
+		jit_reg(b, 0, 1, 0x85, 1, JIT_RDX, JIT_RDX);
+		jit_byte(b, 0x74); // jz +2
+		jit_byte(b, 0x02);
+		jit_reg(b, 0, 0, 0xff, 1, 4, JIT_RDX);
+		jit_mem(b, 0, 1, 0x89, 1, JIT_RAX, JIT_VM, offsetof(struct lolvm, iptr));
+		jit_mov_imm64(b, JIT_RAX, (uint64_t)jit->exit);
+		jit_reg(b, 0, 0, 0xff, 1, 4, JIT_RAX);
+		return 1;
+	}
+
+	case LOL_BRANCH:
+		jit_jmp(b, -1, ip->target);
+		return 1;
+	case LOL_BRANCH_Z:
+	case LOL_BRANCH_NZ:
+		jit_mem(b, 0, 0, 0x80, 1, 7, JIT_FRAME, ip->a);
+		jit_byte(b, 0);
+		jit_jmp(b, ip->op == LOL_BRANCH_Z ? JIT_CC_E : JIT_CC_NE, ip->target);
+		return 1;
+
+	case LOL_HALT:
+		// The HALT after the program is where fibers end, which
+		// the interpreter takes care of
+		if (i == jit->prog->count - 1) {
+			break;
+		}
+
+		jit_mem(b, 0, 0, 0xc7, 1, 0, JIT_VM, offsetof(struct lolvm, halted));
+		jit_u32(b, 1);
+		jit_exit(jit, b, i + 1);
+		return 1;
+
+	case LOL_DBG_PRINT_U8:
+	case LOL_DBG_PRINT_I32:
+	case LOL_DBG_PRINT_I64:
+	case LOL_DBG_PRINT_F32:
+	case LOL_DBG_PRINT_F64:
+	case LOL_WRITE_N:
+	case LOL_FLUSH:
+	case LOL_PRINT_U8:
+	case LOL_PRINT_I32:
+	case LOL_PRINT_I64:
+	case LOL_PRINT_F32:
+	case LOL_PRINT_F64:
+	case LOL_VADD_I32:
+	case LOL_VADD_F32:
+	case LOL_VEQ_I32:
+	case LOL_VLT_I32:
+	case LOL_VLE_I32:
+	case LOL_VSUM_I32:
+	case LOL_VSUM_F32:
+	case LOL_VMIN_I32:
+	case LOL_VMAX_I32:
+	case LOL_FILL_8:
+	case LOL_FILL_32:
+	case LOL_FILL_64:
+		jit_call_step(b, i);
+		return 1;
+
+	case LOL_BR_NEQ_8:
+	case LOL_BR_NEQ_32:
+	case LOL_BR_NEQ_64:
+	case LOL_BR_NEQ_F32:
+	case LOL_BR_NEQ_F64:
+	case LOL_BR_EQ_8:
+	case LOL_BR_EQ_32:
+	case LOL_BR_EQ_64:
+	case LOL_BR_EQ_F32:
+	case LOL_BR_EQ_F64:
+	case LOL_BR_GE_U8:
+	case LOL_BR_GE_I32:
+	case LOL_BR_GE_I64:
+	case LOL_BR_GE_F32:
+	case LOL_BR_GE_F64:
+	case LOL_BR_GT_U8:
+	case LOL_BR_GT_I32:
+	case LOL_BR_GT_I64:
+	case LOL_BR_GT_F32:
+	case LOL_BR_GT_F64:
+		jit_compare(b, lolvm_branch_compare_op(ip->op), ip->b, ip->c);
+		jit_store(b, 1, ip->a, JIT_RAX);
+		jit_reg(b, 0, 0, 0x84, 1, JIT_RAX, JIT_RAX);
+		jit_jmp(b, JIT_CC_E, ip->target);
+		if (next != i + 1) {
+			jit_jmp(b, -1, next);
+		}
+		return 1;
+
+	case LOL_BRI_NEQ_32:
+	case LOL_BRI_EQ_32:
+	case LOL_BRI_GE_I32:
+	case LOL_BRI_GT_I32: {
+		int cc =
+			ip->op == LOL_BRI_NEQ_32 ? JIT_CC_E :
+			ip->op == LOL_BRI_EQ_32 ? JIT_CC_NE :
+			ip->op == LOL_BRI_GE_I32 ? JIT_CC_L : JIT_CC_LE;
+		jit_store_imm(b, 4, ip->a, ip->imm32);
+		jit_load(b, 4, JIT_RAX, ip->b);
+		jit_reg(b, 0, 0, 0x81, 1, 7, JIT_RAX);
+		jit_u32(b, ip->imm32);
+		jit_setcc(b, cc, JIT_RAX);
+		jit_store(b, 1, ip->a, JIT_RAX);
+		jit_reg(b, 0, 0, 0x84, 1, JIT_RAX, JIT_RAX);
+		jit_jmp(b, JIT_CC_E, ip->target);
+		if (next != i + 1) {
+			jit_jmp(b, -1, next);
+		}
+		return 1;
+	}
+
+	case LOL_ADDI_32_BR:
+	case LOL_ADDI_64_BR: {
+		int w = ip->op == LOL_ADDI_64_BR;
+		jit_load(b, w ? 8 : 4, JIT_RAX, ip->b);
+		jit_reg(b, 0, w, 0x81, 1, 0, JIT_RAX);
+		jit_u32(b, ip->imm32);
+		jit_store(b, w ? 8 : 4, ip->a, JIT_RAX);
+		jit_jmp(b, -1, ip->target);
+		return 1;
+	}
+	case LOL_SETI_ADD_32_BR:
+	case LOL_SETI_ADD_64_BR: {
+		int w = ip->op == LOL_SETI_ADD_64_BR;
+		jit_store_imm(b, w ? 8 : 4, ip->c, ip->imm32);
+		jit_load(b, w ? 8 : 4, JIT_RAX, ip->b);
+		jit_reg(b, 0, w, 0x81, 1, 0, JIT_RAX);
+		jit_u32(b, ip->imm32);
+		jit_store(b, w ? 8 : 4, ip->a, JIT_RAX);
+		jit_jmp(b, -1, ip->target);
+		return 1;
+	}
+	case LOL_LOOP_INC_LT_I32:
+	case LOL_LOOP_INC_LE_I32:
+		// add eax, imm; cmp eax, [rbx + limit]
+		jit_load(b, 4, JIT_RAX, ip->a);
+		jit_reg(b, 0, 0, 0x81, 1, 0, JIT_RAX);
+		jit_u32(b, ip->imm32);
+		jit_store(b, 4, ip->a, JIT_RAX);
+		jit_mem(b, 0, 0, 0x3b, 1, JIT_RAX, JIT_FRAME, ip->b);
+		jit_jmp(b, ip->op == LOL_LOOP_INC_LT_I32 ? JIT_CC_L : JIT_CC_LE, ip->target);
+		if (next != i + 1) {
+			jit_jmp(b, -1, next);
+		}
+		return 1;
+
+	case LOL_COPY2_32:
+	case LOL_COPY2_64: {
+		int size = ip->op == LOL_COPY2_32 ? 4 : 8;
+		jit_load(b, size, JIT_RAX, ip->b);
+		jit_store(b, size, ip->a, JIT_RAX);
+		jit_load(b, size, JIT_RAX, ip->d);
+		jit_store(b, size, ip->c, JIT_RAX);
+		if (next != i + 1) {
+			jit_jmp(b, -1, next);
+		}
+		return 1;
+	}
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static void *lolvm_jit_alloc(struct lolvm_jit *jit, struct lolvm_jit_buf *b)
+{
+	size_t size = sizeof(struct lolvm_jit_chunk) + b->len;
+	unsigned char *mem = mmap(
+		NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+
+	struct lolvm_jit_chunk *chunk = (struct lolvm_jit_chunk *)mem;
+	chunk->size = size;
+	chunk->next = jit->chunks;
+	memcpy(mem + sizeof(*chunk), b->data, b->len);
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC) < 0) {
+		munmap(mem, size);
+		return NULL;
+	}
+
+	jit->chunks = chunk;
+	return mem + sizeof(*chunk);
+}
+
+// Compile instructions [start, end) to native code.
+// Jumps out of the range leave JIT'd code.
+int lolvm_jit_compile(struct lolvm_jit *jit, size_t start, size_t end)
+{
+	struct lolvm_jit_buf b = {0};
+	b.offsets = malloc((end - start) * sizeof(*b.offsets));
+	if (!b.offsets) {
+		return -1;
+	}
+
+	for (size_t i = start; i < end; ++i) {
+		b.offsets[i - start] = b.len;
+		if (!jit_instr(jit, &b, i)) {
+			b.offsets[i - start] = (size_t)-1;
+			jit_exit(jit, &b, i);
+		}
+	}
+
+	// Falling off the end of the range exits to the interpreter
+	jit_exit(jit, &b, end);
+
+	// Jumps out of the range exit to the interpreter
+	size_t nfixups = b.nfixups;
+	for (size_t i = 0; i < nfixups; ++i) {
+		size_t target = b.fixups[i].target;
+		if (target >= start && target < end && b.offsets[target - start] != (size_t)-1) {
+			continue;
+		}
+
+		size_t pos = b.len;
+		jit_exit(jit, &b, target);
+		if (b.oom) {
+			break;
+		}
+
+		uint32_t rel = pos - (b.fixups[i].pos + 4);
+		memcpy(&b.data[b.fixups[i].pos], &rel, 4);
+		b.fixups[i].target = (size_t)-1;
+	}
+
+	for (size_t i = 0; i < nfixups && !b.oom; ++i) {
+		size_t target = b.fixups[i].target;
+		if (target == (size_t)-1) {
+			continue;
+		}
+
+		uint32_t rel = b.offsets[target - start] - (b.fixups[i].pos + 4);
+		memcpy(&b.data[b.fixups[i].pos], &rel, 4);
+	}
+
+	unsigned char *mem = NULL;
+	if (!b.oom) {
+		mem = lolvm_jit_alloc(jit, &b);
+	}
+
+	if (mem) {
+		for (size_t i = start; i < end; ++i) {
+			if (b.offsets[i - start] != (size_t)-1) {
+				jit->entries[i] = mem + b.offsets[i - start];
+			}
+		}
+	}
+
+	free(b.data);
+	free(b.offsets);
+	free(b.fixups);
+	return mem ? 0 : -1;
+}
+
+int lolvm_jit_init(struct lolvm_jit *jit, struct lolvm_program *prog)
+{
+	jit->prog = prog;
+	jit->chunks = NULL;
+	jit->entries = calloc(prog->count, sizeof(*jit->entries));
+	if (!jit->entries) {
+		return -1;
+	}
+
+	struct lolvm_jit_buf b = {0};
+
+	// void enter(vm, frame, target, entries, stack)
+	jit_byte(&b, 0x55); // push rbp
+	jit_reg(&b, 0, 1, 0x89, 1, JIT_RSP, JIT_RBP);
+	jit_byte(&b, 0x53); // push rbx
+	jit_byte(&b, 0x41); // push r12
+	jit_byte(&b, 0x54);
+	jit_byte(&b, 0x41); // push r13
+	jit_byte(&b, 0x55);
+	jit_byte(&b, 0x41); // push r14
+	jit_byte(&b, 0x56);
+	jit_byte(&b, 0x41); // push r15
+	jit_byte(&b, 0x57);
+	jit_reg(&b, 0, 1, 0x83, 1, 5, JIT_RSP); // sub rsp, 8
+	jit_byte(&b, 8);
+	jit_reg(&b, 0, 1, 0x89, 1, JIT_RDI, JIT_VM);
+	jit_reg(&b, 0, 1, 0x89, 1, JIT_RSI, JIT_FRAME);
+	jit_reg(&b, 0, 1, 0x89, 1, JIT_RCX, JIT_ENTRIES);
+	jit_reg(&b, 0, 1, 0x89, 1, JIT_R8, JIT_STACK);
+	jit_reg(&b, 0, 0, 0xff, 1, 4, JIT_RDX); // jmp rdx
+
+	// Exit: vm->sptr = rbx - r14, then return from enter
+	size_t exit_offset = b.len;
+	jit_reg(&b, 0, 1, 0x89, 1, JIT_FRAME, JIT_RAX);
+	jit_reg(&b, 0, 1, 0x29, 1, JIT_STACK, JIT_RAX);
+	jit_mem(&b, 0, 1, 0x89, 1, JIT_RAX, JIT_VM, offsetof(struct lolvm, sptr));
+	jit_reg(&b, 0, 1, 0x83, 1, 0, JIT_RSP); // add rsp, 8
+	jit_byte(&b, 8);
+	jit_byte(&b, 0x41); // pop r15
+	jit_byte(&b, 0x5f);
+	jit_byte(&b, 0x41); // pop r14
+	jit_byte(&b, 0x5e);
+	jit_byte(&b, 0x41); // pop r13
+	jit_byte(&b, 0x5d);
+	jit_byte(&b, 0x41); // pop r12
+	jit_byte(&b, 0x5c);
+	jit_byte(&b, 0x5b); // pop rbx
+	jit_byte(&b, 0x5d); // pop rbp
+	jit_byte(&b, 0xc3); // ret
+
+	unsigned char *mem = NULL;
+	if (!b.oom) {
+		mem = lolvm_jit_alloc(jit, &b);
+	}
+
+	free(b.data);
+	if (!mem) {
+		free(jit->entries);
+		return -1;
+	}
+
+	jit->enter = (lolvm_jit_enter_func)mem;
+	jit->exit = mem + exit_offset;
+	return 0;
+}
+
+void lolvm_jit_destroy(struct lolvm_jit *jit)
+{
+	struct lolvm_jit_chunk *chunk = jit->chunks;
+	while (chunk) {
+		struct lolvm_jit_chunk *next = chunk->next;
+		munmap(chunk, chunk->size);
+		chunk = next;
+	}
+
+	free(jit->entries);
+	jit->chunks = NULL;
+	jit->entries = NULL;
+}
+
+// Run the VM, using JIT'd code wherever there is some
+void lolvm_run_jit(struct lolvm *vm, struct lolvm_jit *jit)
+{
+	while (!vm->halted) {
+		void *entry = jit->entries[vm->iptr];
+		if (entry) {
+			jit->enter(vm, &vm->stack[vm->sptr], entry, jit->entries, vm->stack);
+		} else {
+			lolvm_step(vm);
+		}
+	}
+}
+
+#else
+
+int lolvm_jit_init(struct lolvm_jit *jit, struct lolvm_program *prog)
+{
+	jit->prog = prog;
+	jit->entries = NULL;
+	jit->chunks = NULL;
+	return -1;
+}
+
+void lolvm_jit_destroy(struct lolvm_jit *jit)
+{
+	(void)jit;
+}
+
+int lolvm_jit_compile(struct lolvm_jit *jit, size_t start, size_t end)
+{
+	(void)jit;
+	(void)start;
+	(void)end;
+	return -1;
+}
+
+void lolvm_run_jit(struct lolvm *vm, struct lolvm_jit *jit)
+{
+	(void)jit;
+	lolvm_run(vm);
+}
+
+#endif
+
+/*
+ * Tiered execution.
+ *
+ * Code starts out running unfused in the interpreter. Backward jumps and
+ * calls count how often their target is reached. When a target reaches
+ * the threshold, the loop or function starting there is fused and, if the
+ * JIT is available, compiled to native code. Execution then continues in
+ * the faster tier from the loop header or function entry, in the middle
+ * of the running loop or call.
+ */
+
+// Values for lolvm_tier.flags
+#define LOLVM_TIER_CALL_TARGET (1 << 0)
+#define LOLVM_TIER_DONE (1 << 1)
+
+int lolvm_tier_init(struct lolvm_tier *tier, struct lolvm_program *prog, uint32_t threshold)
+{
+	tier->prog = prog;
+	tier->threshold = threshold;
+	tier->callback = NULL;
+	tier->data = NULL;
+	tier->jit = NULL;
+
+	tier->counters = calloc(prog->count, sizeof(*tier->counters));
+	tier->flags = calloc(prog->count, sizeof(*tier->flags));
+	if (!tier->counters || !tier->flags) {
+		free(tier->counters);
+		free(tier->flags);
+		return -1;
+	}
+
+	for (size_t i = 0; i < prog->count; ++i) {
+		if (prog->code[i].op == LOL_CALL || prog->code[i].op == LOL_TAILCALL) {
+			tier->flags[prog->code[i].target] |= LOLVM_TIER_CALL_TARGET;
+		}
+	}
+
+	return 0;
+}
+
+void lolvm_tier_destroy(struct lolvm_tier *tier)
+{
+	free(tier->counters);
+	free(tier->flags);
+}
+
+static void lolvm_tier_up(
+		struct lolvm_tier *tier, enum lolvm_tier_kind kind, size_t start, size_t end)
+{
+	struct lolvm_tier_event event = {0};
+	event.kind = kind;
+	event.level = LOLVM_TIER_FUSED;
+	event.start = start;
+	event.end = end;
+	event.count = tier->counters[start];
+
+	tier->flags[start] |= LOLVM_TIER_DONE;
+	event.fused = lolvm_program_fuse_range(tier->prog, start, end);
+
+#if LOLVM_JIT
+	if (tier->jit && lolvm_jit_compile(tier->jit, start, end) >= 0) {
+		event.level = LOLVM_TIER_NATIVE;
+	}
+#endif
+
+	if (tier->callback) {
+		tier->callback(tier->data, &event);
+	}
+}
+
+// Count one arrival at 'target'. For loops, 'end' is one past
+// the backward jump which got us there.
+static void lolvm_tier_count(
+		struct lolvm_tier *tier, enum lolvm_tier_kind kind, size_t target, size_t end)
+{
+	if (tier->flags[target] & LOLVM_TIER_DONE) {
+		return;
+	}
+
+	tier->counters[target] += 1;
+	if (tier->counters[target] < tier->threshold) {
+		return;
+	}
+
+	if (kind == LOLVM_TIER_FUNCTION) {
+		end = lolvm_program_function_end(tier->prog, target);
+	}
+
+	lolvm_tier_up(tier, kind, target, end);
+}
+
+#if LOLVM_JIT
+static void lolvm_tier_run_native(struct lolvm *vm, struct lolvm_tier *tier)
+{
+	struct lolvm_jit *jit = tier->jit;
+	while (!vm->halted && jit->entries[vm->iptr]) {
+		jit->enter(vm, &vm->stack[vm->sptr], jit->entries[vm->iptr], jit->entries, vm->stack);
+
+		// Calls from native code to functions which aren't compiled yet
+		// exit here rather than going through the interpreter's CALL
+		if (!vm->halted && (tier->flags[vm->iptr] & LOLVM_TIER_CALL_TARGET)) {
+			lolvm_tier_count(tier, LOLVM_TIER_FUNCTION, vm->iptr, 0);
+		}
+	}
+}
+#endif
+
+void lolvm_run_tiered(struct lolvm *vm, struct lolvm_tier *tier)
+{
+#if LOLVM_THREADED
+	static void *const dispatch[256] = {
+		[0 ... 255] = &&op_invalid,
+#define X(name) [LOL_ ## name] = &&op_ ## name,
+LOLVM_OPS
+#undef X
+	};
+#endif
+
+	struct lolvm_instr *code = vm->code;
+	struct lolvm_instr *ip = &code[vm->iptr];
+	unsigned char *stack = vm->stack;
+	size_t sptr = vm->sptr;
+
+#if LOLVM_JIT
+	#define TIER_ENTER() \
+		if (tier->jit && tier->jit->entries[ip - code]) { \
+			vm->iptr = ip - code; \
+			vm->sptr = sptr; \
+			lolvm_tier_run_native(vm, tier); \
+			ip = &code[vm->iptr]; \
+			sptr = vm->sptr; \
+			if (vm->halted) goto out; \
+		}
+#else
+	#define TIER_ENTER()
+#endif
+
+#if LOLVM_THREADED
+	#define CASE(name) op_ ## name
+	#define DISPATCH() goto *dispatch[ip->op]
+#else
+	#define CASE(name) case LOL_ ## name
+	#define DISPATCH() continue
+#endif
+	#define NEXT() { ip += 1; DISPATCH(); }
+	#define NEXT_LEN() { ip += ip->len; DISPATCH(); }
+	#define JUMP(index) { \
+		size_t target_ = (index); \
+		if (ip->op == LOL_CALL || ip->op == LOL_TAILCALL) { \
+			lolvm_tier_count(tier, LOLVM_TIER_FUNCTION, target_, 0); \
+		} else if (lolvm_is_jump(ip->op) && target_ <= (size_t)(ip - code)) { \
+			lolvm_tier_count(tier, LOLVM_TIER_LOOP, target_, ip - code + ip->len); \
+		} \
+		ip = &code[target_]; \
+		TIER_ENTER(); \
+		DISPATCH(); \
+	}
+	#define EXIT() goto out
+
+	if (vm->halted) {
+		return;
+	}
+
+	TIER_ENTER();
+
+#if LOLVM_THREADED
+	DISPATCH();
+	#include "lolvm_ops.inc"
+op_invalid:
+	NEXT();
+#else
+	while (1) {
+		switch ((enum lolvm_op)ip->op) {
+		#include "lolvm_ops.inc"
+		}
+
+		// Unknown opcode
+		ip += 1;
+	}
+#endif
+
+	#undef CASE
+	#undef DISPATCH
+	#undef NEXT
+	#undef NEXT_LEN
+	#undef JUMP
+	#undef EXIT
+	#undef TIER_ENTER
+
+out:
+	vm->iptr = ip - code;
+	vm->sptr = sptr;
+}
+
+/*
+ * Ahead-of-time translation to C.
+ *
+ * Every function (the program entry and every CALL target) becomes a C
+ * function which takes a pointer to its stack frame. Branches become
+ * gotos, CALL becomes a C call and RETURN a C return. The stack has the
+ * same size and layout as the one in struct lolvm.
+ */
+
+static const char *lolvm_emit_c_prelude =
+	"#include <stdint.h>\n"
+	"#include <string.h>\n"
+	"#include <stdio.h>\n"
+	"#include <stdlib.h>\n"
+	"#include <inttypes.h>\n"
+	"\n"
+	"#define LOL_ACCESS(name, type) \\\n"
+	"\tstatic inline type ld_ ## name(unsigned char *p) { type v; memcpy(&v, p, sizeof(v)); return v; } \\\n"
+	"\tstatic inline void st_ ## name(unsigned char *p, type v) { memcpy(p, &v, sizeof(v)); }\n"
+	"LOL_ACCESS(u8, uint8_t)\n"
+	"LOL_ACCESS(u32, uint32_t)\n"
+	"LOL_ACCESS(i32, int32_t)\n"
+	"LOL_ACCESS(u64, uint64_t)\n"
+	"LOL_ACCESS(i64, int64_t)\n"
+	"LOL_ACCESS(f32, float)\n"
+	"LOL_ACCESS(f64, double)\n"
+	"#define PTR(p) ((unsigned char *)(uintptr_t)ld_u64(p))\n"
+	"\n"
+	"static inline void v_add_u32(unsigned char *d, unsigned char *a, unsigned char *b, uint32_t n) {\n"
+	"\tfor (uint32_t i = 0; i < n; ++i) st_u32(d + i * 4, ld_u32(a + i * 4) + ld_u32(b + i * 4));\n"
+	"}\n"
+	"static inline void v_add_f32(unsigned char *d, unsigned char *a, unsigned char *b, uint32_t n) {\n"
+	"\tfor (uint32_t i = 0; i < n; ++i) st_f32(d + i * 4, ld_f32(a + i * 4) + ld_f32(b + i * 4));\n"
+	"}\n"
+	"#define LOL_VCOMPARE(name, op) \\\n"
+	"\tstatic inline void v_ ## name(unsigned char *d, unsigned char *a, unsigned char *b, uint32_t n) { \\\n"
+	"\t\tfor (uint32_t i = 0; i < n; ++i) st_u8(d + i, ld_i32(a + i * 4) op ld_i32(b + i * 4)); \\\n"
+	"\t}\n"
+	"LOL_VCOMPARE(eq_i32, ==)\n"
+	"LOL_VCOMPARE(lt_i32, <)\n"
+	"LOL_VCOMPARE(le_i32, <=)\n"
+	"static inline uint32_t v_sum_u32(unsigned char *a, uint32_t n) {\n"
+	"\tuint32_t s = 0;\n"
+	"\tfor (uint32_t i = 0; i < n; ++i) s += ld_u32(a + i * 4);\n"
+	"\treturn s;\n"
+	"}\n"
+	"static inline float v_sum_f32(unsigned char *a, uint32_t n) {\n"
+	"\tfloat l[8] = {0};\n"
+	"\tuint32_t i = 0;\n"
+	"\tfor (; i + 8 <= n; i += 8) for (int k = 0; k < 8; ++k) l[k] += ld_f32(a + (i + k) * 4);\n"
+	"\tfloat s = ((l[0] + l[4]) + (l[2] + l[6])) + ((l[1] + l[5]) + (l[3] + l[7]));\n"
+	"\tfor (; i < n; ++i) s += ld_f32(a + i * 4);\n"
+	"\treturn s;\n"
+	"}\n"
+	"static inline int32_t v_min_i32(unsigned char *a, uint32_t n) {\n"
+	"\tint32_t m = INT32_MAX;\n"
+	"\tfor (uint32_t i = 0; i < n; ++i) if (ld_i32(a + i * 4) < m) m = ld_i32(a + i * 4);\n"
+	"\treturn m;\n"
+	"}\n"
+	"static inline int32_t v_max_i32(unsigned char *a, uint32_t n) {\n"
+	"\tint32_t m = INT32_MIN;\n"
+	"\tfor (uint32_t i = 0; i < n; ++i) if (ld_i32(a + i * 4) > m) m = ld_i32(a + i * 4);\n"
+	"\treturn m;\n"
+	"}\n"
+	"\n";
+
+struct lolvm_emit_c {
+	struct lolvm_program *prog;
+	FILE *out;
+	uint8_t *flags;
+	size_t func_start;
+	size_t func_end;
+};
+
+// Values for lolvm_emit_c.flags
+#define LOLVM_EMIT_C_FUNCTION (1 << 0)
+#define LOLVM_EMIT_C_LABEL (1 << 1)
+
+static int lolvm_emit_c_fail(struct lolvm_emit_c *e, const char *error, size_t i)
+{
+	e->prog->error = error;
+	e->prog->error_addr = e->prog->addrs[i];
+	return -1;
+}
+
+// The C type of an operand, from the suffix of the instruction's name
+static const char *lolvm_emit_c_type(enum lolvm_op op)
+{
+	const char *name = lolvm_op_name(op);
+	const char *suffix = strrchr(name, '_') + 1;
+	if (strcmp(suffix, "8") == 0 || strcmp(suffix, "U8") == 0) return "u8";
+	if (strcmp(suffix, "32") == 0) return "u32";
+	if (strcmp(suffix, "64") == 0) return "u64";
+	if (strcmp(suffix, "I32") == 0) return "i32";
+	if (strcmp(suffix, "I64") == 0) return "i64";
+	if (strcmp(suffix, "F32") == 0) return "f32";
+	if (strcmp(suffix, "F64") == 0) return "f64";
+	return NULL;
+}
+
+static void lolvm_emit_c_compare(
+		struct lolvm_emit_c *e, enum lolvm_op op, int16_t dest, int16_t a, int16_t b)
+{
+	const char *cmp;
+	const char *name = lolvm_op_name(op);
+	if (strncmp(name, "EQ_", 3) == 0) cmp = "==";
+	else if (strncmp(name, "NEQ_", 4) == 0) cmp = "!=";
+	else if (strncmp(name, "LT_", 3) == 0) cmp = "<";
+	else cmp = "<=";
+
+	const char *type = lolvm_emit_c_type(op);
+	fprintf(e->out, "\tst_u8(sp + %d, ld_%s(sp + %d) %s ld_%s(sp + %d));\n",
+		dest, type, a, cmp, type, b);
+}
+
+static int lolvm_emit_c_goto(struct lolvm_emit_c *e, size_t i, size_t target)
+{
+	if (target < e->func_start || target >= e->func_end) {
+		return lolvm_emit_c_fail(e, "Branch out of the function", i);
+	}
+
+	fprintf(e->out, "goto L%04" PRIu32 ";\n", e->prog->addrs[target]);
+	return 0;
+}
+
+static int lolvm_emit_c_instr(struct lolvm_emit_c *e, size_t i)
+{
+	struct lolvm_instr *ip = &e->prog->code[i];
+	FILE *out = e->out;
+
+	switch ((enum lolvm_op)ip->op) {
+	case LOL_SETI_8:
+		fprintf(out, "\tst_u8(sp + %d, %" PRIu8 ");\n", ip->a, (uint8_t)ip->imm);
+		return 0;
+	case LOL_SETI_32:
+		fprintf(out, "\tst_u32(sp + %d, UINT32_C(%" PRIu32 "));\n", ip->a, (uint32_t)ip->imm);
+		return 0;
+	case LOL_SETI_64:
+		fprintf(out, "\tst_u64(sp + %d, UINT64_C(%" PRIu64 "));\n", ip->a, ip->imm);
+		return 0;
+
+	case LOL_COPY_8:
+		fprintf(out, "\tmemcpy(sp + %d, sp + %d, 1);\n", ip->a, ip->b);
+		return 0;
+	case LOL_COPY_32:
+		fprintf(out, "\tmemcpy(sp + %d, sp + %d, 4);\n", ip->a, ip->b);
+		return 0;
+	case LOL_COPY_64:
+		fprintf(out, "\tmemcpy(sp + %d, sp + %d, 8);\n", ip->a, ip->b);
+		return 0;
+	case LOL_COPY_N:
+		fprintf(out, "\tmemcpy(sp + %d, sp + %d, %" PRIu32 ");\n", ip->a, ip->b, (uint32_t)ip->imm);
+		return 0;
+
+	case LOL_ADD_8:
+	case LOL_ADD_32:
+	case LOL_ADD_64:
+	case LOL_ADD_F32:
+	case LOL_ADD_F64: {
+		const char *type = lolvm_emit_c_type(ip->op);
+		fprintf(out, "\tst_%s(sp + %d, ld_%s(sp + %d) + ld_%s(sp + %d));\n",
+			type, ip->a, type, ip->b, type, ip->c);
+		return 0;
+	}
+
+	case LOL_ADDI_8:
+		fprintf(out, "\tst_u8(sp + %d, ld_u8(sp + %d) + %" PRIu8 ");\n",
+			ip->a, ip->b, (uint8_t)ip->imm);
+		return 0;
+	case LOL_ADDI_32:
+		fprintf(out, "\tst_u32(sp + %d, ld_u32(sp + %d) + UINT32_C(%" PRIu32 "));\n",
+			ip->a, ip->b, (uint32_t)ip->imm);
+		return 0;
+	case LOL_ADDI_64:
+		fprintf(out, "\tst_u64(sp + %d, ld_u64(sp + %d) + UINT64_C(%" PRIu64 "));\n",
+			ip->a, ip->b, ip->imm);
+		return 0;
+
+	case LOL_EQ_8:
+	case LOL_EQ_32:
+	case LOL_EQ_64:
+	case LOL_EQ_F32:
+	case LOL_EQ_F64:
+	case LOL_NEQ_8:
+	case LOL_NEQ_32:
+	case LOL_NEQ_64:
+	case LOL_NEQ_F32:
+	case LOL_NEQ_F64:
+	case LOL_LT_U8:
+	case LOL_LT_I32:
+	case LOL_LT_I64:
+	case LOL_LT_F32:
+	case LOL_LT_F64:
+	case LOL_LE_U8:
+	case LOL_LE_I32:
+	case LOL_LE_I64:
+	case LOL_LE_F32:
+	case LOL_LE_F64:
+		lolvm_emit_c_compare(e, ip->op, ip->a, ip->b, ip->c);
+		return 0;
+
+	case LOL_REF:
+		fprintf(out, "\tst_u64(sp + %d, (uint64_t)(uintptr_t)(sp + %d));\n", ip->a, ip->b);
+		return 0;
+
+	case LOL_LOAD_8:
+		fprintf(out, "\tmemcpy(sp + %d, PTR(sp + %d), 1);\n", ip->a, ip->b);
+		return 0;
+	case LOL_LOAD_32:
+		fprintf(out, "\tmemcpy(sp + %d, PTR(sp + %d), 4);\n", ip->a, ip->b);
+		return 0;
+	case LOL_LOAD_64:
+		fprintf(out, "\tmemcpy(sp + %d, PTR(sp + %d), 8);\n", ip->a, ip->b);
+		return 0;
+	case LOL_LOAD_N:
+		fprintf(out, "\tmemcpy(sp + %d, PTR(sp + %d), %" PRIu32 ");\n",
+			ip->a, ip->b, (uint32_t)ip->imm);
+		return 0;
+
+	case LOL_STORE_8:
+		fprintf(out, "\tmemcpy(PTR(sp + %d), sp + %d, 1);\n", ip->a, ip->b);
+		return 0;
+	case LOL_STORE_32:
+		fprintf(out, "\tmemcpy(PTR(sp + %d), sp + %d, 4);\n", ip->a, ip->b);
+		return 0;
+	case LOL_STORE_64:
+		fprintf(out, "\tmemcpy(PTR(sp + %d), sp + %d, 8);\n", ip->a, ip->b);
+		return 0;
+	case LOL_STORE_N:
+		fprintf(out, "\tmemcpy(PTR(sp + %d), sp + %d, %" PRIu32 ");\n",
+			ip->a, ip->b, (uint32_t)ip->imm);
+		return 0;
+
+	case LOL_CALL:
+		fprintf(out, "\tlol_%04" PRIu32 "(sp + %d);\n", e->prog->addrs[ip->target], ip->a);
+		return 0;
+	case LOL_TAILCALL:
+		fprintf(out, "\tmemmove(sp + %d, sp + %d, %d);\n", ip->b, ip->a, -ip->b);
+		fprintf(out, "\tlol_%04" PRIu32 "(sp);\n", e->prog->addrs[ip->target]);
+		fprintf(out, "\treturn;\n");
+		return 0;
+	case LOL_RETURN:
+		fprintf(out, "\treturn;\n");
+		return 0;
+
+	case LOL_BRANCH:
+		fprintf(out, "\t");
+		return lolvm_emit_c_goto(e, i, ip->target);
+	case LOL_BRANCH_Z:
+		fprintf(out, "\tif (ld_u8(sp + %d) == 0) ", ip->a);
+		return lolvm_emit_c_goto(e, i, ip->target);
+	case LOL_BRANCH_NZ:
+		fprintf(out, "\tif (ld_u8(sp + %d) != 0) ", ip->a);
+		return lolvm_emit_c_goto(e, i, ip->target);
+
+	case LOL_DBG_PRINT_U8:
+		fprintf(out, "\tprintf(\"DBG PRINT @%d: %%\" PRIu8 \"\\n\", ld_u8(sp + %d));\n",
+			ip->a, ip->a);
+		return 0;
+	case LOL_DBG_PRINT_I32:
+		fprintf(out, "\tprintf(\"DBG PRINT @%d: %%\" PRIi32 \"\\n\", ld_i32(sp + %d));\n",
+			ip->a, ip->a);
+		return 0;
+	case LOL_DBG_PRINT_I64:
+		fprintf(out, "\tprintf(\"DBG PRINT @%d: %%\" PRIi64 \"\\n\", ld_i64(sp + %d));\n",
+			ip->a, ip->a);
+		return 0;
+	case LOL_DBG_PRINT_F32:
+		fprintf(out, "\tprintf(\"DBG PRINT @%d: %%g\\n\", ld_f32(sp + %d));\n",
+			ip->a, ip->a);
+		return 0;
+	case LOL_DBG_PRINT_F64:
+		fprintf(out, "\tprintf(\"DBG PRINT @%d: %%g\\n\", ld_f64(sp + %d));\n",
+			ip->a, ip->a);
+		return 0;
+
+	case LOL_HALT:
+		fprintf(out, "\texit(0);\n");
+		return 0;
+
+	case LOL_BR_NEQ_8:
+	case LOL_BR_NEQ_32:
+	case LOL_BR_NEQ_64:
+	case LOL_BR_NEQ_F32:
+	case LOL_BR_NEQ_F64:
+	case LOL_BR_EQ_8:
+	case LOL_BR_EQ_32:
+	case LOL_BR_EQ_64:
+	case LOL_BR_EQ_F32:
+	case LOL_BR_EQ_F64:
+	case LOL_BR_GE_U8:
+	case LOL_BR_GE_I32:
+	case LOL_BR_GE_I64:
+	case LOL_BR_GE_F32:
+	case LOL_BR_GE_F64:
+	case LOL_BR_GT_U8:
+	case LOL_BR_GT_I32:
+	case LOL_BR_GT_I64:
+	case LOL_BR_GT_F32:
+	case LOL_BR_GT_F64:
+		lolvm_emit_c_compare(e, lolvm_branch_compare_op(ip->op), ip->a, ip->b, ip->c);
+		fprintf(out, "\tif (ld_u8(sp + %d) == 0) ", ip->a);
+		return lolvm_emit_c_goto(e, i, ip->target);
+
+	case LOL_BRI_NEQ_32:
+	case LOL_BRI_EQ_32:
+	case LOL_BRI_GE_I32:
+	case LOL_BRI_GT_I32: {
+		enum lolvm_op cmp =
+			ip->op == LOL_BRI_NEQ_32 ? LOL_EQ_32 :
+			ip->op == LOL_BRI_EQ_32 ? LOL_NEQ_32 :
+			ip->op == LOL_BRI_GE_I32 ? LOL_LT_I32 : LOL_LE_I32;
+		fprintf(out, "\tst_u32(sp + %d, UINT32_C(%" PRIu32 "));\n", ip->a, (uint32_t)ip->imm32);
+		lolvm_emit_c_compare(e, cmp, ip->a, ip->b, ip->a);
+		fprintf(out, "\tif (ld_u8(sp + %d) == 0) ", ip->a);
+		return lolvm_emit_c_goto(e, i, ip->target);
+	}
+
+	case LOL_ADDI_32_BR:
+		fprintf(out, "\tst_u32(sp + %d, ld_u32(sp + %d) + UINT32_C(%" PRIu32 "));\n\t",
+			ip->a, ip->b, (uint32_t)ip->imm32);
+		return lolvm_emit_c_goto(e, i, ip->target);
+	case LOL_LOOP_INC_LT_I32:
+	case LOL_LOOP_INC_LE_I32:
+		fprintf(out, "\tst_u32(sp + %d, ld_u32(sp + %d) + UINT32_C(%" PRIu32 "));\n",
+			ip->a, ip->a, (uint32_t)ip->imm32);
+		fprintf(out, "\tif (ld_i32(sp + %d) %s ld_i32(sp + %d)) ",
+			ip->a, ip->op == LOL_LOOP_INC_LT_I32 ? "<" : "<=", ip->b);
+		return lolvm_emit_c_goto(e, i, ip->target);
+	case LOL_ADDI_64_BR:
+		fprintf(out, "\tst_u64(sp + %d, ld_u64(sp + %d) + (uint64_t)INT64_C(%" PRIi32 "));\n\t",
+			ip->a, ip->b, ip->imm32);
+		return lolvm_emit_c_goto(e, i, ip->target);
+	case LOL_SETI_ADD_32_BR:
+		fprintf(out, "\tst_u32(sp + %d, UINT32_C(%" PRIu32 "));\n", ip->c, (uint32_t)ip->imm32);
+		fprintf(out, "\tst_u32(sp + %d, ld_u32(sp + %d) + UINT32_C(%" PRIu32 "));\n\t",
+			ip->a, ip->b, (uint32_t)ip->imm32);
+		return lolvm_emit_c_goto(e, i, ip->target);
+	case LOL_SETI_ADD_64_BR:
+		fprintf(out, "\tst_u64(sp + %d, (uint64_t)INT64_C(%" PRIi32 "));\n", ip->c, ip->imm32);
+		fprintf(out, "\tst_u64(sp + %d, ld_u64(sp + %d) + (uint64_t)INT64_C(%" PRIi32 "));\n\t",
+			ip->a, ip->b, ip->imm32);
+		return lolvm_emit_c_goto(e, i, ip->target);
+
+	case LOL_COPY2_32:
+	case LOL_COPY2_64: {
+		int size = ip->op == LOL_COPY2_32 ? 4 : 8;
+		fprintf(out, "\tmemcpy(sp + %d, sp + %d, %d);\n", ip->a, ip->b, size);
+		fprintf(out, "\tmemcpy(sp + %d, sp + %d, %d);\n", ip->c, ip->d, size);
+		return 0;
+	}
+
+	// The heap is malloc's
+	case LOL_ALLOC:
+		fprintf(out, "\tst_u64(sp + %d, (uint64_t)(uintptr_t)malloc(%" PRIu32 "));\n",
+			ip->a, (uint32_t)ip->imm);
+		return 0;
+	case LOL_FREE:
+		fprintf(out, "\tfree(PTR(sp + %d));\n", ip->a);
+		return 0;
+	case LOL_ARENA_BEGIN:
+	case LOL_ARENA_RESET:
+		return lolvm_emit_c_fail(e, "Arenas can't be compiled to C", i);
+
+	case LOL_SPAWN:
+	case LOL_YIELD:
+	case LOL_CHAN_NEW:
+	case LOL_CHAN_SEND:
+	case LOL_CHAN_RECV:
+		return lolvm_emit_c_fail(e, "Fibers can't be compiled to C", i);
+
+	case LOL_VADD_I32:
+	case LOL_VADD_F32:
+	case LOL_VEQ_I32:
+	case LOL_VLT_I32:
+	case LOL_VLE_I32: {
+		const char *name =
+			ip->op == LOL_VADD_I32 ? "add_u32" :
+			ip->op == LOL_VADD_F32 ? "add_f32" :
+			ip->op == LOL_VEQ_I32 ? "eq_i32" :
+			ip->op == LOL_VLT_I32 ? "lt_i32" : "le_i32";
+		fprintf(out, "\tv_%s(sp + %d, sp + %d, sp + %d, UINT32_C(%" PRIu32 "));\n",
+			name, ip->a, ip->b, ip->c, (uint32_t)ip->imm);
+		return 0;
+	}
+	case LOL_VSUM_I32:
+	case LOL_VSUM_F32:
+	case LOL_VMIN_I32:
+	case LOL_VMAX_I32: {
+		const char *name =
+			ip->op == LOL_VSUM_I32 ? "sum_u32" :
+			ip->op == LOL_VSUM_F32 ? "sum_f32" :
+			ip->op == LOL_VMIN_I32 ? "min_i32" : "max_i32";
+		const char *type = ip->op == LOL_VSUM_F32 ? "f32" : "u32";
+		fprintf(out, "\tst_%s(sp + %d, v_%s(sp + %d, UINT32_C(%" PRIu32 ")));\n",
+			type, ip->a, name, ip->b, (uint32_t)ip->imm);
+		return 0;
+	}
+	case LOL_FILL_8:
+		fprintf(out, "\tmemset(sp + %d, ld_u8(sp + %d), %" PRIu32 ");\n",
+			ip->a, ip->b, (uint32_t)ip->imm);
+		return 0;
+	case LOL_FILL_32:
+	case LOL_FILL_64: {
+		int size = ip->op == LOL_FILL_32 ? 4 : 8;
+		fprintf(out, "\t{ uint%d_t v = ld_u%d(sp + %d);\n", size * 8, size * 8, ip->b);
+		fprintf(out, "\tfor (uint32_t i = 0; i < UINT32_C(%" PRIu32 "); ++i) st_u%d(sp + %d + i * %d, v); }\n",
+			(uint32_t)ip->imm, size * 8, ip->a, size);
+		return 0;
+	}
+
+	case LOL_WRITE_N:
+		fprintf(out, "\tfwrite(sp + %d, 1, %" PRIu32 ", stdout);\n", ip->a, (uint32_t)ip->imm);
+		return 0;
+	case LOL_FLUSH:
+		fprintf(out, "\tfflush(stdout);\n");
+		return 0;
+	case LOL_PRINT_U8:
+		fprintf(out, "\tprintf(\"%%\" PRIu8 \"\\n\", ld_u8(sp + %d));\n", ip->a);
+		return 0;
+	case LOL_PRINT_I32:
+		fprintf(out, "\tprintf(\"%%\" PRIi32 \"\\n\", ld_i32(sp + %d));\n", ip->a);
+		return 0;
+	case LOL_PRINT_I64:
+		fprintf(out, "\tprintf(\"%%\" PRIi64 \"\\n\", ld_i64(sp + %d));\n", ip->a);
+		return 0;
+	case LOL_PRINT_F32:
+		fprintf(out, "\tprintf(\"%%g\\n\", ld_f32(sp + %d));\n", ip->a);
+		return 0;
+	case LOL_PRINT_F64:
+		fprintf(out, "\tprintf(\"%%g\\n\", ld_f64(sp + %d));\n", ip->a);
+		return 0;
+	}
+
+	// Unknown opcodes are no-ops
+	return 0;
+}
+
+static int lolvm_emit_c_function(struct lolvm_emit_c *e, size_t start)
+{
+	struct lolvm_program *prog = e->prog;
+	FILE *out = e->out;
+
+	// Stop at the next function if we would run into it. Falling through
+	// into it is the same as a tail call.
+	size_t end = lolvm_program_function_end(prog, start);
+	size_t next = start + 1;
+	while (next < end && !(e->flags[next] & LOLVM_EMIT_C_FUNCTION)) {
+		next += 1;
+	}
+
+	e->func_start = start;
+	e->func_end = next;
+
+	fprintf(out, "static void lol_%04" PRIu32 "(unsigned char *sp)\n{\n", prog->addrs[start]);
+	for (size_t i = start; i < next; ++i) {
+		if (e->flags[i] & LOLVM_EMIT_C_LABEL) {
+			fprintf(out, "L%04" PRIu32 ":\n", prog->addrs[i]);
+		}
+
+		if (lolvm_emit_c_instr(e, i) < 0) {
+			return -1;
+		}
+	}
+
+	if (next < end) {
+		fprintf(out, "\tlol_%04" PRIu32 "(sp);\n", prog->addrs[next]);
+	}
+
+	fprintf(out, "}\n\n");
+	return 0;
+}
+
+// Write 'prog' as a C program to 'out'.
+// On error, returns -1 and sets prog->error and prog->error_addr.
+int lolvm_emit_c(struct lolvm_program *prog, FILE *out)
+{
+	// The emitted program has no guarded memory to put a sandbox in
+	if (prog->sandbox) {
+		prog->error = "Sandboxed programs can't be compiled to C";
+		prog->error_addr = 0;
+		return -1;
+	}
+
+	struct lolvm_emit_c e = {0};
+	e.prog = prog;
+	e.out = out;
+	e.flags = calloc(prog->count, sizeof(*e.flags));
+	if (!e.flags) {
+		prog->error = "Out of memory";
+		prog->error_addr = 0;
+		return -1;
+	}
+
+	e.flags[0] |= LOLVM_EMIT_C_FUNCTION;
+	for (size_t i = 0; i < prog->count; ++i) {
+		struct lolvm_instr *ip = &prog->code[i];
+		if (lolvm_is_call(ip->op)) {
+			e.flags[ip->target] |= LOLVM_EMIT_C_FUNCTION;
+		} else if (lolvm_is_jump(ip->op)) {
+			e.flags[ip->target] |= LOLVM_EMIT_C_LABEL;
+		}
+	}
+
+	fprintf(out, "%s", lolvm_emit_c_prelude);
+	fprintf(out, "static unsigned char stack[%d];\n\n", LOLVM_STACK_SIZE);
+	for (size_t i = 0; i < prog->count; ++i) {
+		if (e.flags[i] & LOLVM_EMIT_C_FUNCTION) {
+			fprintf(out, "static void lol_%04" PRIu32 "(unsigned char *sp);\n", prog->addrs[i]);
+		}
+	}
+	fprintf(out, "\n");
+
+	for (size_t i = 0; i < prog->count; ++i) {
+		if ((e.flags[i] & LOLVM_EMIT_C_FUNCTION) && lolvm_emit_c_function(&e, i) < 0) {
+			free(e.flags);
+			return -1;
+		}
+	}
+
+	fprintf(out, "int main(void)\n{\n");
+	fprintf(out, "\tlol_0000(stack);\n");
+	fprintf(out, "\treturn 0;\n}\n");
+
+	free(e.flags);
+	return 0;
 }
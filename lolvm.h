@@ -0,0 +1,711 @@
+#ifndef LOLVM_H
+#define LOLVM_H
+
+/*
+ * The LolVM library.
+ *
+ * A program is loaded once with lolvm_program_init and is then shared,
+ * read-only, by any number of VMs. Every struct lolvm has its own stacks
+ * and registers, so VMs can run on different threads at the same time.
+ * The run loops never allocate memory or touch global state.
+ *
+ * lolvm_program_fuse and tiered execution rewrite the program, so they
+ * must not run while other VMs are executing it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define LOLVM_OPS \
+	X(SETI_8)   /* dest @, imm x32 */ \
+	X(SETI_32)  /* dest @, imm x32 */ \
+	X(SETI_64)  /* dest @, imm x64 */ \
+	X(COPY_8)   /* dest @, src @ */ \
+	X(COPY_32)  /* dest @, src @ */ \
+	X(COPY_64)  /* dest @, src @ */ \
+	X(COPY_N)   /* dest @, src @, size u32 */ \
+	X(ADD_8)    /* dest @, a @, b @ */ \
+	X(ADD_32)   /* dest @, a @, b @ */ \
+	X(ADD_64)   /* dest @, a @, b @ */ \
+	X(ADD_F32)  /* dest @, a @, b @ */ \
+	X(ADD_F64)  /* dest @, a @, b @ */ \
+	X(ADDI_8)   /* dest @, a @, imm b x32 */ \
+	X(ADDI_32)  /* dest @, a @, imm b x32 */ \
+	X(ADDI_64)  /* dest @, a @, imm b x64 */ \
+	X(EQ_8)     /* dest @, a @, b @ */ \
+	X(EQ_32)    /* dest @, a @, b @ */ \
+	X(EQ_64)    /* dest @, a @, b @ */ \
+	X(EQ_F32)   /* dest @, a @, b @ */ \
+	X(EQ_F64)   /* dest @, a @, b @ */ \
+	X(NEQ_8)    /* dest @, a @, b @ */ \
+	X(NEQ_32)   /* dest @, a @, b @ */ \
+	X(NEQ_64)   /* dest @, a @, b @ */ \
+	X(NEQ_F32)  /* dest @, a @, b @ */ \
+	X(NEQ_F64)  /* dest @, a @, b @ */ \
+	X(LT_U8)    /* dest @, a @, b @ */ \
+	X(LT_I32)   /* dest @, a @, b @ */ \
+	X(LT_I64)   /* dest @, a @, b @ */ \
+	X(LT_F32)   /* dest @, a @, b @ */ \
+	X(LT_F64)   /* dest @, a @, b @ */ \
+	X(LE_U8)    /* dest @, a @, b @ */ \
+	X(LE_I32)   /* dest @, a @, b @ */ \
+	X(LE_I64)   /* dest @, a @, b @ */ \
+	X(LE_F32)   /* dest @, a @, b @ */ \
+	X(LE_F64)   /* dest @, a @, b @ */ \
+	X(REF)      /* dest @, src @ */ \
+	X(LOAD_8)   /* dest @, src @ */ \
+	X(LOAD_32)  /* dest @, src @ */ \
+	X(LOAD_64)  /* dest @, src @ */ \
+	X(LOAD_N)   /* dest @, src @, size u32 */ \
+	X(STORE_8)  /* dest @, src @ */ \
+	X(STORE_32) /* dest @, src @ */ \
+	X(STORE_64) /* dest @, src @ */ \
+	X(STORE_N)  /* dest @, src @, size u32 */ \
+	/* */ \
+	X(CALL)          /* stack-bump @, jump_target u32 */ \
+	X(RETURN)        /* */ \
+	X(BRANCH)        /* delta @ */ \
+	X(BRANCH_Z)      /* cond @, delta @ */ \
+	X(BRANCH_NZ)     /* cond @, delta @ */ \
+	X(DBG_PRINT_U8) /* val @ */ \
+	X(DBG_PRINT_I32) /* val @ */ \
+	X(DBG_PRINT_I64) /* val @ */ \
+	X(DBG_PRINT_F32) /* val @ */ \
+	X(DBG_PRINT_F64) /* val @ */ \
+	X(HALT)          /* */ \
+	/* Superinstructions. Each one does exactly what the listed sequence */ \
+	/* does, including the writes to 'cond' and 'tmp'. */ \
+	X(BR_NEQ_8)       /* cond @, a @, b @, delta @: EQ_8 + BRANCH_Z */ \
+	X(BR_NEQ_32)      /* cond @, a @, b @, delta @: EQ_32 + BRANCH_Z */ \
+	X(BR_NEQ_64)      /* cond @, a @, b @, delta @: EQ_64 + BRANCH_Z */ \
+	X(BR_NEQ_F32)     /* cond @, a @, b @, delta @: EQ_F32 + BRANCH_Z */ \
+	X(BR_NEQ_F64)     /* cond @, a @, b @, delta @: EQ_F64 + BRANCH_Z */ \
+	X(BR_EQ_8)        /* cond @, a @, b @, delta @: NEQ_8 + BRANCH_Z */ \
+	X(BR_EQ_32)       /* cond @, a @, b @, delta @: NEQ_32 + BRANCH_Z */ \
+	X(BR_EQ_64)       /* cond @, a @, b @, delta @: NEQ_64 + BRANCH_Z */ \
+	X(BR_EQ_F32)      /* cond @, a @, b @, delta @: NEQ_F32 + BRANCH_Z */ \
+	X(BR_EQ_F64)      /* cond @, a @, b @, delta @: NEQ_F64 + BRANCH_Z */ \
+	X(BR_GE_U8)       /* cond @, a @, b @, delta @: LT_U8 + BRANCH_Z */ \
+	X(BR_GE_I32)      /* cond @, a @, b @, delta @: LT_I32 + BRANCH_Z */ \
+	X(BR_GE_I64)      /* cond @, a @, b @, delta @: LT_I64 + BRANCH_Z */ \
+	X(BR_GE_F32)      /* cond @, a @, b @, delta @: LT_F32 + BRANCH_Z */ \
+	X(BR_GE_F64)      /* cond @, a @, b @, delta @: LT_F64 + BRANCH_Z */ \
+	X(BR_GT_U8)       /* cond @, a @, b @, delta @: LE_U8 + BRANCH_Z */ \
+	X(BR_GT_I32)      /* cond @, a @, b @, delta @: LE_I32 + BRANCH_Z */ \
+	X(BR_GT_I64)      /* cond @, a @, b @, delta @: LE_I64 + BRANCH_Z */ \
+	X(BR_GT_F32)      /* cond @, a @, b @, delta @: LE_F32 + BRANCH_Z */ \
+	X(BR_GT_F64)      /* cond @, a @, b @, delta @: LE_F64 + BRANCH_Z */ \
+	X(BRI_NEQ_32)     /* cond @, a @, imm x32, delta @: SETI_32 + EQ_32 + BRANCH_Z */ \
+	X(BRI_EQ_32)      /* cond @, a @, imm x32, delta @: SETI_32 + NEQ_32 + BRANCH_Z */ \
+	X(BRI_GE_I32)     /* cond @, a @, imm x32, delta @: SETI_32 + LT_I32 + BRANCH_Z */ \
+	X(BRI_GT_I32)     /* cond @, a @, imm x32, delta @: SETI_32 + LE_I32 + BRANCH_Z */ \
+	X(ADDI_32_BR)     /* dest @, a @, imm x32, delta @: ADDI_32 + BRANCH */ \
+	X(ADDI_64_BR)     /* dest @, a @, imm i32, delta @: ADDI_64 + BRANCH */ \
+	X(SETI_ADD_32_BR) /* dest @, a @, tmp @, imm x32, delta @: SETI_32 + ADD_32 + BRANCH */ \
+	X(SETI_ADD_64_BR) /* dest @, a @, tmp @, imm i32, delta @: SETI_64 + ADD_64 + BRANCH */ \
+	X(COPY2_32)       /* dest @, src @, dest2 @, src2 @: COPY_32 + COPY_32 */ \
+	X(COPY2_64)       /* dest @, src @, dest2 @, src2 @: COPY_64 + COPY_64 */ \
+	/* The heap */ \
+	X(ALLOC)       /* dest @, size u32 */ \
+	X(FREE)        /* ptr @, size u32 */ \
+	X(ARENA_BEGIN) /* mark @ */ \
+	X(ARENA_RESET) /* mark @ */ \
+	/* Fibers */ \
+	X(SPAWN)     /* stack-bump @, jump_target u32 */ \
+	X(YIELD)     /* */ \
+	X(CHAN_NEW)  /* dest @ */ \
+	X(CHAN_SEND) /* chan @, src @, size u32 */ \
+	X(CHAN_RECV) /* chan @, dest @, size u32 */ \
+	/* Output */ \
+	X(WRITE_N)   /* src @, size u32 */ \
+	X(FLUSH)     /* */ \
+	X(PRINT_U8)  /* val @ */ \
+	X(PRINT_I32) /* val @ */ \
+	X(PRINT_I64) /* val @ */ \
+	X(PRINT_F32) /* val @ */ \
+	X(PRINT_F64) /* val @ */ \
+	/* Calls which reuse the current frame */ \
+	X(TAILCALL)  /* args @, params @, jump_target u32 */ \
+	/* Vectors of 'count' elements */ \
+	X(VADD_I32)  /* dest @, a @, b @, count u32 */ \
+	X(VADD_F32)  /* dest @, a @, b @, count u32 */ \
+	X(VEQ_I32)   /* dest @, a @, b @, count u32: dest is 'count' bytes */ \
+	X(VLT_I32)   /* dest @, a @, b @, count u32: dest is 'count' bytes */ \
+	X(VLE_I32)   /* dest @, a @, b @, count u32: dest is 'count' bytes */ \
+	X(VSUM_I32)  /* dest @, src @, count u32 */ \
+	X(VSUM_F32)  /* dest @, src @, count u32 */ \
+	X(VMIN_I32)  /* dest @, src @, count u32 */ \
+	X(VMAX_I32)  /* dest @, src @, count u32 */ \
+	X(FILL_8)    /* dest @, val @, count u32 */ \
+	X(FILL_32)   /* dest @, val @, count u32 */ \
+	X(FILL_64)   /* dest @, val @, count u32 */ \
+	/* Counted loops: add imm to the counter, and branch while it's below the limit */ \
+	X(LOOP_INC_LT_I32) /* counter @, limit @, imm x32, delta @ */ \
+	X(LOOP_INC_LE_I32) /* counter @, limit @, imm x32, delta @ */ \
+//
+
+enum lolvm_op {
+#define X(name) LOL_ ## name,
+LOLVM_OPS
+#undef X
+};
+
+const char *lolvm_op_name(enum lolvm_op op);
+
+// Print the instruction at 'instr' and return the size of its operands
+size_t pretty_print_instruction(FILE *out, const unsigned char *instr);
+void pretty_print(FILE *out, const unsigned char *instrs, size_t size);
+
+// An instruction after load-time decoding.
+// Operands are stored sign-extended and immediates as native values,
+// and branch and call targets are indices into the decoded array,
+// so the interpreter never has to look at the raw bytecode.
+struct lolvm_instr {
+	uint8_t op;
+	uint8_t len; // Number of bytecode instructions this entry stands for
+	int16_t a;
+	int16_t b;
+	int16_t c;
+	union {
+		uint64_t imm;
+		struct {
+			uint32_t target;
+			union {
+				int32_t imm32;
+				int16_t d;
+			};
+		};
+	};
+};
+
+struct lolvm_program {
+	const unsigned char *bytecode;
+	size_t size;
+
+	// One entry per bytecode instruction, plus a HALT at the end
+	// which catches execution running off the end of the program.
+	struct lolvm_instr *code;
+	uint32_t *addrs;
+	size_t count;
+
+	const char *error;
+	size_t error_addr;
+
+	// Whether pointers are 32-bit offsets into a sandboxed VM's memory,
+	// rather than 64-bit host addresses. Set it before verifying the
+	// program or creating VMs for it.
+	int sandbox;
+
+	// Set by lolvm_program_verify
+	int verified;
+	size_t max_calls; // Deepest call chain, or SIZE_MAX with recursion
+	size_t max_stack; // Stack used; with recursion, by the biggest frame
+	size_t max_bump; // Largest CALL stack bump
+};
+
+// Translate raw bytecode into the decoded form executed by the interpreter.
+// The bytecode must outlive the program.
+// On error, returns -1 and sets prog->error and prog->error_addr.
+int lolvm_program_init(struct lolvm_program *prog, const unsigned char *bytecode, size_t size);
+void lolvm_program_destroy(struct lolvm_program *prog);
+
+// Find the index of the instruction at byte address 'addr',
+// or (size_t)-1 if no instruction starts there.
+size_t lolvm_program_find(struct lolvm_program *prog, size_t addr);
+
+// Walk every function's control flow graph and check that the program
+// can't access the stack outside its frames, run unknown opcodes, RETURN
+// with an empty call stack, or, unless it's sandboxed, load and store
+// through pointers.
+// Sets prog->verified and the limits on success; on error, returns -1
+// and sets prog->error and prog->error_addr, but keeps the program.
+int lolvm_program_verify(struct lolvm_program *prog);
+
+// Replace common instruction sequences with superinstructions.
+// Returns the number of superinstructions created.
+size_t lolvm_program_fuse(struct lolvm_program *prog);
+
+// Like lolvm_program_fuse, for the instructions in [start, end).
+// This rewrites the program in place, so while it's running, it must be
+// called from the thread which runs it, and never on a program shared by
+// several VMs, such as the workers of a batch.
+size_t lolvm_program_fuse_range(struct lolvm_program *prog, size_t start, size_t end);
+
+// Write 'prog' as a C program to 'out'.
+// On error, returns -1 and sets prog->error and prog->error_addr.
+int lolvm_emit_c(struct lolvm_program *prog, FILE *out);
+
+struct lolvm_stack_frame {
+	size_t sptr;
+	size_t iptr;
+};
+#define LOLVM_STACK_SIZE (1024 * 1024)
+#define LOLVM_CALLSTACK_SIZE (16 * 1024)
+
+/*
+ * Every VM has a heap for ALLOC and FREE. Blocks come in power-of-two
+ * size classes from 16 bytes up, and freed blocks go on a free list for
+ * their class. New blocks are cut off the top of the heap.
+ *
+ * Between ARENA_BEGIN and ARENA_RESET, ALLOC just bumps the top of the
+ * heap, and ARENA_RESET frees everything allocated since ARENA_BEGIN
+ * at once. Arenas nest; the mark operand keeps the outer arena's start.
+ */
+
+#define LOLVM_HEAP_SIZE ((size_t)1 << 30)
+#define LOLVM_HEAP_CLASSES 27 // 16 bytes to 1 GiB
+
+struct lolvm_heap {
+	unsigned char *base;
+	size_t size;
+	size_t top; // Offset of the first byte which has never been allocated
+	size_t arena; // Where the innermost arena starts, or SIZE_MAX
+	uint32_t free[LOLVM_HEAP_CLASSES]; // Offsets, or UINT32_MAX if empty
+
+	size_t in_use; // Bytes in allocated blocks
+	size_t peak; // Most bytes in use at once
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t failed; // ALLOCs which returned a null pointer
+};
+
+/*
+ * A VM's output. DBG_PRINT_* and PRINT_* format their value into a
+ * buffer, and WRITE_N copies raw bytes from the stack into it. The
+ * buffer is written out when it's full, on FLUSH, and by lolvm_flush;
+ * the run loops don't flush it when the program ends.
+ * In binary mode, the print instructions write their value's bytes
+ * as they are on the stack instead of formatting it.
+ */
+
+#define LOLVM_OUTPUT_SIZE (64 * 1024)
+
+struct lolvm_output {
+	unsigned char *buf;
+	size_t len;
+	int fd; // Written to with write(2) unless it's -1,
+	FILE *file; // and with fwrite otherwise; stdout by default
+	int binary;
+	int failed; // Output has been lost since the last reset
+};
+
+/*
+ * Fibers are cooperative threads within one VM. SPAWN starts a function
+ * in a new fiber with its own stack and call stack, which begins with a
+ * copy of the spawning frame up to the stack bump, so the function finds
+ * its arguments just like after a CALL. The fiber ends when the function
+ * returns. Fibers only switch at YIELD, and when CHAN_SEND or CHAN_RECV
+ * has to wait, so a switch is just saving and loading a few registers.
+ *
+ * Channels are unbuffered: a send waits for a receiver and the other way
+ * around, and values are copied straight from one fiber's stack to the
+ * other's. The program halts with an error if every fiber is waiting.
+ * The main fiber returning still ends the program.
+ */
+
+#define LOLVM_FIBERS 1024 // At once, including the main fiber
+#define LOLVM_CHANNELS 4096 // Per run
+#define LOLVM_FIBER_NONE UINT32_MAX
+
+struct lolvm_fiber {
+	unsigned char *stack;
+	struct lolvm_stack_frame *callstack;
+	size_t iptr;
+	size_t sptr;
+	size_t cptr;
+	unsigned char *value; // What a waiting send sends, or a receive receives into
+	uint32_t size;
+	uint32_t next; // In the ready queue, a channel's queue or the free list
+};
+
+struct lolvm_fiber_queue {
+	uint32_t head;
+	uint32_t tail;
+};
+
+struct lolvm_channel {
+	struct lolvm_fiber_queue senders;
+	struct lolvm_fiber_queue receivers;
+};
+
+struct lolvm_fibers {
+	struct lolvm_fiber *fibers; // NULL unless the program uses fibers
+	size_t count; // Including the main fiber, fibers[0]
+	uint32_t current;
+	struct lolvm_fiber_queue ready;
+	uint32_t free; // Fibers which have ended
+	size_t used; // Fibers started since the last reset, not counting reuse
+	size_t mapped; // Fibers whose stacks have been made accessible
+
+	unsigned char *stacks; // Every fiber's stack after the main one's
+	struct lolvm_stack_frame *callstacks;
+	size_t stack_stride;
+	size_t callstack_stride; // In bytes
+
+	struct lolvm_channel *channels;
+	size_t nchannels;
+
+	uint64_t spawned;
+	uint64_t switches;
+};
+
+struct lolvm {
+	struct lolvm_program *prog;
+	struct lolvm_instr *code;
+	size_t iptr;
+	size_t sptr;
+	size_t cptr;
+	int halted;
+	struct lolvm_output out;
+	unsigned char *memory; // Base of a sandboxed VM's memory, or NULL
+	unsigned char *stack;
+	size_t stack_size;
+	struct lolvm_stack_frame *callstack;
+	size_t callstack_size; // In frames
+	struct lolvm_heap heap;
+	struct lolvm_fibers fibers; // vm->stack and vm->callstack are the current fiber's
+
+	// Why lolvm_run_checked stopped, or why a fiber or channel
+	// instruction halted the program, at vm->iptr
+	const char *error;
+
+	// The current instruction while in lolvm_run_sampled, NULL otherwise
+	struct lolvm_instr *volatile sample_ip;
+};
+
+// Create a VM for 'prog'. 'stack_size' is in bytes, 'callstack_size'
+// is in frames. Returns -1 if the stacks can't be allocated.
+// If prog->sandbox is set, the stack and heap live inside an 8 GiB
+// reservation of address space, where out-of-bounds pointers fault.
+int lolvm_init(
+		struct lolvm *vm, struct lolvm_program *prog,
+		size_t stack_size, size_t callstack_size);
+
+// Get the VM ready to run its program from the start again,
+// keeping its stacks. Everything on the heap is freed, and every
+// fiber and channel is gone. Pending output is flushed.
+// The stacks and heap read as zeroes again, like in a new VM.
+void lolvm_reset(struct lolvm *vm);
+
+// Write out everything in the VM's output buffer.
+// Returns -1 if any output has been lost since the last reset.
+int lolvm_flush(struct lolvm *vm);
+
+// Flushes the output first
+void lolvm_destroy(struct lolvm *vm);
+
+// Allocate and free blocks on the VM's heap, like ALLOC and FREE.
+// lolvm_alloc returns NULL if the heap is full. 'size' must be the
+// size the block was allocated with.
+void *lolvm_alloc(struct lolvm *vm, uint32_t size);
+void lolvm_free(struct lolvm *vm, void *ptr, uint32_t size);
+
+// Start an arena, like ARENA_BEGIN. Returns the mark to pass to
+// lolvm_arena_reset, which frees everything allocated since.
+uint64_t lolvm_arena_begin(struct lolvm *vm);
+void lolvm_arena_reset(struct lolvm *vm, uint64_t mark);
+
+/*
+ * Snapshots save a VM part way through its program, so that other VMs
+ * can start from there instead of from the beginning. The stack and
+ * heap are mapped copy-on-write from the snapshot file, so restoring
+ * is cheap and VMs share the pages they don't write to.
+ *
+ * Instruction addresses are saved as bytecode addresses, so a snapshot
+ * can be restored into a program which is fused differently. Host
+ * pointers can't be relocated, so only sandboxed programs can be
+ * snapshotted if they use REF or ALLOC. Programs which use fibers
+ * can't be snapshotted.
+ */
+
+struct lolvm_snapshot {
+	struct lolvm_program *prog;
+	size_t stack_size;
+	size_t callstack_size; // In frames
+
+	int fd;
+	void *data; // Header and call stack
+	size_t stack_offset; // Where the stack and the heap are in the file
+	size_t heap_offset;
+};
+
+// Hash of a program's bytecode, which snapshots are checked against
+uint64_t lolvm_program_hash(const struct lolvm_program *prog);
+
+// Run until the instruction at decoded index 'index' is next, using
+// lolvm_run_checked if 'checked' is set. Briefly patches the program,
+// so no other VM may run it at the same time. Returns 1 if the VM
+// stopped at 'index', 0 if the program halted, and -1 if the checked
+// interpreter stopped it.
+int lolvm_run_until(struct lolvm *vm, size_t index, int checked);
+
+// Write the VM's state to 'out', which must be seekable.
+// Returns -1 and sets vm->error if the state can't be saved.
+int lolvm_snapshot_save(struct lolvm *vm, FILE *out);
+
+// Open a snapshot of 'prog'. Returns -1 and sets prog->error if the
+// file can't be read, or was saved from a different program.
+int lolvm_snapshot_open(struct lolvm_snapshot *snap, struct lolvm_program *prog, const char *path);
+void lolvm_snapshot_close(struct lolvm_snapshot *snap);
+
+// Replace the state of 'vm', which must have been created for the
+// snapshot's program with the same stack sizes.
+// Returns -1 and sets vm->error on failure.
+int lolvm_snapshot_restore(struct lolvm *vm, const struct lolvm_snapshot *snap);
+
+// Execute one instruction
+void lolvm_step(struct lolvm *vm);
+
+// Run until the program halts
+void lolvm_run(struct lolvm *vm);
+
+// Run until the program halts or 'budget' instructions have executed,
+// whichever comes first. Returns the number of instructions executed.
+// Call it again to continue where it left off.
+uint64_t lolvm_run_budget(struct lolvm *vm, uint64_t budget);
+
+// Whether the verifier proved that 'prog' runs safely in the unchecked
+// run loops with stacks of these sizes
+int lolvm_verified(const struct lolvm_program *prog, size_t stack_size, size_t callstack_size);
+
+// Like lolvm_run, but checks every instruction before running it,
+// for programs which aren't verified. Returns -1 and sets vm->error
+// if an instruction would do something unsafe.
+int lolvm_run_checked(struct lolvm *vm);
+
+struct lolvm_counters {
+	uint64_t dispatches; // Decoded instructions executed
+	uint64_t instrs; // Bytecode instructions those stand for
+};
+
+// Like lolvm_run, but counts what gets executed
+void lolvm_run_counted(struct lolvm *vm, struct lolvm_counters *counters);
+
+/*
+ * The profiler counts and times every decoded instruction, and follows
+ * CALL and RETURN to time functions. Times are in cycles on x86,
+ * and in nanoseconds elsewhere.
+ */
+
+// One call path; the root is the code the VM started in
+struct lolvm_profile_node {
+	size_t func; // Decoded index of the function's first instruction
+	size_t parent;
+	size_t first_child;
+	size_t next_sibling;
+	uint64_t self; // Time spent in this function on this path
+};
+
+struct lolvm_profile {
+	struct lolvm_program *prog;
+	uint64_t total_instrs;
+	uint64_t total_cycles;
+
+	// Per decoded instruction
+	uint64_t *counts;
+	uint64_t *cycles;
+
+	// Per opcode
+	uint64_t op_counts[256];
+	uint64_t op_cycles[256];
+
+	// Per function, indexed by the function's first decoded instruction
+	uint64_t *func_calls;
+	uint64_t *func_inclusive;
+	uint64_t *func_exclusive;
+	size_t *func_depth;
+	uint64_t *func_start;
+
+	struct lolvm_profile_node *nodes;
+	size_t nnodes;
+	size_t nodes_cap;
+	size_t node; // The current call path
+};
+
+int lolvm_profile_init(struct lolvm_profile *prof, struct lolvm_program *prog);
+void lolvm_profile_destroy(struct lolvm_profile *prof);
+
+// Like lolvm_run, but records everything into 'prof'.
+// Several runs can be recorded into the same profile.
+void lolvm_run_profiled(struct lolvm *vm, struct lolvm_profile *prof);
+
+// Print opcode and function tables and an annotated disassembly
+void lolvm_profile_print(struct lolvm_profile *prof, FILE *out);
+
+// Print one "caller;callee time" line per call path, for flame graph tools
+void lolvm_profile_print_folded(struct lolvm_profile *prof, FILE *out);
+
+/*
+ * The sampler interrupts the process with SIGPROF and records where
+ * VMs running in lolvm_run_sampled are, on any thread. Samples are
+ * aggregated by a background thread. Only one sampler can run at a time.
+ */
+
+// Return addresses kept per sample; deeper stacks are cut off
+#define LOLVM_SAMPLE_DEPTH 32
+
+struct lolvm_sampler_state;
+
+// The counts are only complete after lolvm_sampler_stop
+struct lolvm_sampler {
+	struct lolvm_program *prog;
+	uint64_t samples;
+	uint64_t dropped; // Samples lost because the ring buffer was full
+	uint64_t truncated; // Samples with stacks deeper than LOLVM_SAMPLE_DEPTH
+
+	// Indexed by decoded instruction; functions by their first instruction
+	uint64_t *addr_samples;
+	uint64_t *func_self;
+	uint64_t *func_total;
+
+	struct lolvm_sampler_state *state;
+};
+
+// Start sampling VMs which run 'prog' 'hz' times per second of CPU time.
+// Returns -1 if another sampler is running or on allocation failure.
+int lolvm_sampler_start(struct lolvm_sampler *s, struct lolvm_program *prog, int hz);
+void lolvm_sampler_stop(struct lolvm_sampler *s);
+void lolvm_sampler_destroy(struct lolvm_sampler *s);
+
+// Like lolvm_run, but lets the running sampler see where the VM is
+void lolvm_run_sampled(struct lolvm *vm);
+
+// Print function and instruction tables
+void lolvm_sampler_print(struct lolvm_sampler *s, FILE *out);
+
+/*
+ * The tracer records every executed instruction into a binary file:
+ * a header, then one record per instruction with its decoded index,
+ * its opcode, and the stack bytes it wrote:
+ *
+ *   index u32, op u8, size u16, [offset u32, bytes...]
+ *
+ * The offset is from the bottom of the stack (of the running fiber),
+ * and is only there when size isn't 0. The bytes are what was there
+ * when the instruction finished, so a CHAN_RECV which had to wait
+ * records what was there before the value came.
+ *
+ * Records go into a ring of blocks, which a writer thread writes out
+ * while the VM keeps going. Each thread which traces a VM needs its
+ * own lolvm_trace.
+ */
+
+struct lolvm_trace_state;
+
+struct lolvm_trace {
+	struct lolvm_program *prog;
+
+	// Per decoded instruction: its record's header, with the size of
+	// what it writes, and where it writes relative to sptr
+	uint64_t *headers;
+	int16_t *offsets;
+
+	unsigned char *pos; // Where the next record goes
+	unsigned char *end; // End of the current block
+	uint64_t bytes; // Written to the file, once the trace is stopped
+
+	struct lolvm_trace_state *state;
+};
+
+// Start tracing 'vm' into the file at 'path'.
+// Returns -1 with errno set on failure.
+int lolvm_trace_start(struct lolvm_trace *trace, struct lolvm *vm, const char *path);
+
+// Write out what's left and close the file.
+// Returns -1 if anything couldn't be written.
+int lolvm_trace_stop(struct lolvm_trace *trace);
+
+// Like lolvm_run, but records every instruction into 'trace'
+void lolvm_run_traced(struct lolvm *vm, struct lolvm_trace *trace);
+
+// Read a trace of 'prog' and print its hottest basic blocks and
+// control flow edges, and with 'dump', every record first.
+// The program has to be decoded (and fused) the same way as when
+// the trace was recorded. Returns -1 and sets prog->error on failure.
+int lolvm_trace_replay(struct lolvm_program *prog, const char *path, int dump, FILE *out);
+
+/*
+ * The JIT compiles instructions to native code. It's only available on
+ * x86-64; elsewhere, lolvm_jit_init fails.
+ */
+
+typedef void (*lolvm_jit_enter_func)(
+	struct lolvm *vm, unsigned char *frame, void *target,
+	void **entries, unsigned char *stack);
+
+struct lolvm_jit_chunk {
+	struct lolvm_jit_chunk *next;
+	size_t size;
+};
+
+struct lolvm_jit {
+	struct lolvm_program *prog;
+
+	// Native code for each instruction, or NULL if it has none
+	void **entries;
+
+	lolvm_jit_enter_func enter;
+	unsigned char *exit;
+	struct lolvm_jit_chunk *chunks;
+};
+
+int lolvm_jit_init(struct lolvm_jit *jit, struct lolvm_program *prog);
+void lolvm_jit_destroy(struct lolvm_jit *jit);
+
+// Compile instructions [start, end) to native code
+int lolvm_jit_compile(struct lolvm_jit *jit, size_t start, size_t end);
+
+// Run the VM, using native code wherever there is some
+void lolvm_run_jit(struct lolvm *vm, struct lolvm_jit *jit);
+
+/*
+ * Tiered execution: hot loops and functions are fused and,
+ * if tier->jit is set, compiled to native code.
+ */
+
+#define LOLVM_TIER_THRESHOLD 1000
+
+enum lolvm_tier_kind {
+	LOLVM_TIER_LOOP,
+	LOLVM_TIER_FUNCTION,
+};
+
+enum lolvm_tier_level {
+	LOLVM_TIER_FUSED,
+	LOLVM_TIER_NATIVE,
+};
+
+struct lolvm_tier_event {
+	enum lolvm_tier_kind kind;
+	enum lolvm_tier_level level;
+
+	// The region is instructions [start, end)
+	size_t start;
+	size_t end;
+
+	uint32_t count;
+	size_t fused;
+};
+
+typedef void (*lolvm_tier_callback)(void *data, const struct lolvm_tier_event *event);
+
+struct lolvm_tier {
+	struct lolvm_program *prog;
+	uint32_t threshold;
+	uint32_t *counters;
+	uint8_t *flags;
+
+	// Called for every region which moves up a tier, if set
+	lolvm_tier_callback callback;
+	void *data;
+
+	// Native code is only generated if this is set
+	struct lolvm_jit *jit;
+};
+
+int lolvm_tier_init(struct lolvm_tier *tier, struct lolvm_program *prog, uint32_t threshold);
+void lolvm_tier_destroy(struct lolvm_tier *tier);
+void lolvm_run_tiered(struct lolvm *vm, struct lolvm_tier *tier);
+
+#endif
@@ -0,0 +1,595 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lolvm.h"
+#include "batch.h"
+
+static void lolvm_step_manually(struct lolvm *vm)
+{
+	struct lolvm_program *prog = vm->prog;
+	while (!vm->halted) {
+		lolvm_flush(vm);
+		size_t addr = prog->addrs[vm->iptr];
+		printf("sptr: %zu, cptr: %zu\n", vm->sptr, vm->cptr);
+		printf("%04zu: ", addr);
+		if (addr >= prog->size) {
+			printf("HALT (end of program)\n");
+		} else {
+			size_t n = pretty_print_instruction(stdout, &prog->bytecode[addr]);
+			for (size_t i = 0; i < n + 1; ++i) {
+				if (i == n) {
+					printf("%02x\n", prog->bytecode[addr + i]);
+				} else {
+					printf("%02x ", prog->bytecode[addr + i]);
+				}
+			}
+		}
+
+		int ch = getchar();
+		if (ch == 'c') {
+			lolvm_run(vm);
+			return;
+		}
+
+		lolvm_step(vm);
+	}
+}
+
+// Map a file read-only. Returns NULL with *size set to 0 for empty files,
+// since those can't be mapped.
+static unsigned char *map_file(const char *path, size_t *size)
+{
+	*size = (size_t)-1;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	unsigned char *data = NULL;
+	if (*size > 0) {
+		data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			data = NULL;
+		}
+	}
+
+	close(fd);
+	return data;
+}
+
+static int run_batch(struct lolvm_program *prog, struct lolvm_batch_options *opts)
+{
+	struct lolvm_batch_result result;
+	if (lolvm_batch_run(prog, opts, &result) < 0) {
+		fprintf(stderr, "Batch: Failed to start the workers\n");
+		return -1;
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "Batch: %zu jobs on %d threads in %.3fs: %.1f jobs/sec",
+		opts->jobs, opts->threads, result.seconds, opts->jobs / result.seconds);
+	fprintf(stderr, " (%" PRIu64 " slices, %" PRIu64 " steals)\n", result.slices, result.steals);
+	return 0;
+}
+
+// Run the batch with 1, 2, 4, ... threads, up to opts->threads,
+// and show how throughput scales. Job output is dropped.
+static void run_batch_scaling(struct lolvm_program *prog, struct lolvm_batch_options *opts)
+{
+	int max_threads = opts->threads;
+	double base = 0;
+	fprintf(stderr, "threads  jobs/sec    speedup  efficiency\n");
+	for (int threads = 1; threads <= max_threads; threads *= 2) {
+		// Make sure the last step is all threads
+		if (threads * 2 > max_threads) {
+			threads = max_threads;
+		}
+
+		struct lolvm_batch_result result;
+		opts->threads = threads;
+		if (lolvm_batch_run(prog, opts, &result) < 0) {
+			fprintf(stderr, "Batch: Failed to start the workers\n");
+			return;
+		}
+
+		double rate = opts->jobs / result.seconds;
+		if (threads == 1) {
+			base = rate;
+		}
+
+		fprintf(stderr, "%7d  %10.1f  %6.2fx  %9.0f%%\n",
+			threads, rate, rate / base, 100 * rate / base / threads);
+	}
+}
+
+static void print_tier_event(void *data, const struct lolvm_tier_event *event)
+{
+	struct lolvm_program *prog = data;
+	fflush(stdout);
+	fprintf(stderr, "Tier up: %s %04" PRIu32 "-%04" PRIu32 " after %" PRIu32 " hits: %s",
+		event->kind == LOLVM_TIER_LOOP ? "loop" : "function",
+		prog->addrs[event->start], prog->addrs[event->end - 1], event->count,
+		event->level == LOLVM_TIER_NATIVE ? "native" : "fused");
+	fprintf(stderr, " (%zu superinstructions)\n", event->fused);
+}
+
+int main(int argc, char **argv)
+{
+	int do_print = 0;
+	int do_step = 0;
+	int do_run = -1;
+	int do_fuse = 1;
+	int do_stats = 0;
+	int do_jit = 0;
+	int do_tier = 0;
+	int do_emit_c = 0;
+	int do_tier_log = 0;
+	int do_profile = 0;
+	const char *folded_path = NULL;
+	int sample_hz = 0;
+	int do_verify = 1;
+	int do_verify_log = 0;
+	int do_sandbox = 0;
+	int do_binary = 0;
+	uint32_t tier_threshold = LOLVM_TIER_THRESHOLD;
+	size_t stack_size = LOLVM_STACK_SIZE;
+	size_t callstack_size = LOLVM_CALLSTACK_SIZE;
+	size_t batch_jobs = 0;
+	int batch_scaling = 0;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	uint64_t batch_budget = 100000;
+	const char *snapshot_path = NULL;
+	size_t snapshot_addr = 0;
+	const char *restore_path = NULL;
+	const char *trace_path = NULL;
+	const char *replay_path = NULL;
+	int do_dump_trace = 0;
+	const char *path = NULL;
+	int ret = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--step") == 0) {
+			do_step = 1;
+			if (do_run < 0) do_run = 0;
+		} else if (strcmp(argv[i], "--print") == 0) {
+			do_print = 1;
+			if (do_run < 0) do_run = 0;
+		} else if (strcmp(argv[i], "--run") == 0) {
+			do_run = 1;
+		} else if (strcmp(argv[i], "--no-fuse") == 0) {
+			do_fuse = 0;
+		} else if (strcmp(argv[i], "--stats") == 0) {
+			do_stats = 1;
+		} else if (strcmp(argv[i], "--profile") == 0) {
+			do_profile = 1;
+		} else if (strcmp(argv[i], "--profile-folded") == 0 && i + 1 < argc) {
+			do_profile = 1;
+			folded_path = argv[++i];
+		} else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+			sample_hz = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--verify") == 0) {
+			do_verify_log = 1;
+		} else if (strcmp(argv[i], "--no-verify") == 0) {
+			do_verify = 0;
+		} else if (strcmp(argv[i], "--sandbox") == 0) {
+			do_sandbox = 1;
+		} else if (strcmp(argv[i], "--binary-output") == 0) {
+			do_binary = 1;
+		} else if (strcmp(argv[i], "--jit") == 0) {
+			do_jit = 1;
+		} else if (strcmp(argv[i], "--emit-c") == 0) {
+			do_emit_c = 1;
+			if (do_run < 0) do_run = 0;
+		} else if (strcmp(argv[i], "--tier") == 0) {
+			do_tier = 1;
+		} else if (strcmp(argv[i], "--tier-log") == 0) {
+			do_tier = 1;
+			do_tier_log = 1;
+		} else if (strcmp(argv[i], "--tier-threshold") == 0 && i + 1 < argc) {
+			do_tier = 1;
+			tier_threshold = strtoul(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--stack-size") == 0 && i + 1 < argc) {
+			stack_size = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--callstack-size") == 0 && i + 1 < argc) {
+			callstack_size = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			batch_jobs = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--batch-scaling") == 0) {
+			batch_scaling = 1;
+		} else if (strcmp(argv[i], "--batch-budget") == 0 && i + 1 < argc) {
+			batch_budget = strtoull(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--snapshot-at") == 0 && i + 2 < argc) {
+			snapshot_addr = strtoull(argv[++i], NULL, 0);
+			snapshot_path = argv[++i];
+			do_fuse = 0;
+		} else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+			restore_path = argv[++i];
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			trace_path = argv[++i];
+		} else if (strcmp(argv[i], "--replay-trace") == 0 && i + 1 < argc) {
+			replay_path = argv[++i];
+			if (do_run < 0) do_run = 0;
+		} else if (strcmp(argv[i], "--dump-trace") == 0 && i + 1 < argc) {
+			replay_path = argv[++i];
+			do_dump_trace = 1;
+			if (do_run < 0) do_run = 0;
+		} else if (argv[i][0] == '-') {
+			printf("Unknown option: %s\n", argv[i]);
+			return 1;
+		} else {
+			path = argv[i];
+		}
+	}
+
+	if (do_run < 0) {
+		do_run = 1;
+	}
+
+	if (!path) {
+		printf("Usage: %s <path>\n", argv[0]);
+		return 1;
+	}
+
+	size_t size;
+	unsigned char *bytecode = map_file(path, &size);
+	if (!bytecode && size > 0) {
+		printf("%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	if (do_print) {
+		pretty_print(stdout, bytecode, size);
+	}
+
+	struct lolvm_program prog;
+	if (lolvm_program_init(&prog, bytecode, size) < 0) {
+		printf("%s: %04zu: %s\n", path, prog.error_addr, prog.error);
+		return 1;
+	}
+
+	prog.sandbox = do_sandbox;
+
+	// The snapshot decides how big the stacks are
+	struct lolvm_snapshot snap;
+	if (restore_path) {
+		if (lolvm_snapshot_open(&snap, &prog, restore_path) < 0) {
+			printf("%s: %s\n", restore_path, prog.error);
+			lolvm_program_destroy(&prog);
+			return 1;
+		}
+
+		stack_size = snap.stack_size;
+		callstack_size = snap.callstack_size;
+	}
+
+	// Programs which can't be verified run in the checked interpreter
+	int checked = 0;
+	if (do_verify) {
+		if (lolvm_program_verify(&prog) < 0) {
+			if (do_verify_log) {
+				fprintf(stderr, "Verifier: %04zu: %s\n", prog.error_addr, prog.error);
+			}
+		} else if (do_verify_log) {
+			fprintf(stderr, "Verifier: OK, %zu bytes of stack", prog.max_stack);
+			if (prog.max_calls == SIZE_MAX) {
+				fprintf(stderr, " per frame, recursive\n");
+			} else {
+				fprintf(stderr, ", %zu calls deep\n", prog.max_calls);
+			}
+		}
+
+		checked = !lolvm_verified(&prog, stack_size, callstack_size);
+		if (checked && do_verify_log) {
+			fprintf(stderr, "Verifier: Using the checked interpreter\n");
+		}
+	}
+
+	// The C compiler does a better job with the plain instructions
+	if (do_emit_c && lolvm_emit_c(&prog, stdout) < 0) {
+		printf("%s: %04zu: %s\n", path, prog.error_addr, prog.error);
+		lolvm_program_destroy(&prog);
+		return 1;
+	}
+
+	// Tiered execution fuses hot code as it goes
+	size_t fused = 0;
+	if (do_fuse && !do_tier) {
+		fused = lolvm_program_fuse(&prog);
+	}
+
+	if (batch_jobs > 0 && checked) {
+		printf("%s: --batch needs a verified program (or --no-verify)\n", path);
+		lolvm_program_destroy(&prog);
+		return 1;
+	}
+
+	if (trace_path && checked) {
+		printf("%s: --trace needs a verified program (or --no-verify)\n", path);
+		lolvm_program_destroy(&prog);
+		return 1;
+	}
+
+	// The checked interpreter has no JIT, tiers or counters
+	if (do_run && checked) {
+		const char *mode = NULL;
+		if (do_profile) {
+			mode = "--profile";
+		} else if (sample_hz > 0) {
+			mode = "--sample";
+		} else if (do_stats) {
+			mode = "--stats";
+		} else if (do_tier) {
+			mode = "--tier";
+		} else if (do_jit) {
+			mode = "--jit";
+		}
+
+		if (mode) {
+			printf("%s: %s needs a verified program (or --no-verify)\n", path, mode);
+			lolvm_program_destroy(&prog);
+			return 1;
+		}
+	}
+
+	// The trace's instruction indices only match the same decoding
+	if (replay_path) {
+		if (lolvm_trace_replay(&prog, replay_path, do_dump_trace, stdout) < 0) {
+			printf("%s: %s\n", replay_path, prog.error);
+			ret = 1;
+		}
+	}
+
+	if (batch_jobs > 0) {
+		struct lolvm_batch_options opts = {0};
+		opts.jobs = batch_jobs;
+		opts.threads = threads;
+		opts.budget = batch_budget;
+		opts.stack_size = stack_size;
+		opts.callstack_size = callstack_size;
+		opts.snapshot = restore_path ? &snap : NULL;
+		opts.out = batch_scaling ? NULL : stdout;
+		opts.binary = do_binary;
+		if (batch_scaling) {
+			run_batch_scaling(&prog, &opts);
+		} else {
+			run_batch(&prog, &opts);
+		}
+
+		do_run = 0;
+	}
+
+	if (snapshot_path) {
+		size_t index = lolvm_program_find(&prog, snapshot_addr);
+		if (index == (size_t)-1) {
+			printf("%s: %04zu: Not the start of an instruction\n", path, snapshot_addr);
+			return 1;
+		}
+
+		struct lolvm vm;
+		if (lolvm_init(&vm, &prog, stack_size, callstack_size) < 0) {
+			printf("%s: Failed to allocate the stack\n", path);
+			return 1;
+		}
+
+		vm.out.binary = do_binary;
+
+		if (restore_path && lolvm_snapshot_restore(&vm, &snap) < 0) {
+			printf("%s: %s\n", restore_path, vm.error);
+			return 1;
+		}
+
+		int stopped = lolvm_run_until(&vm, index, checked);
+		lolvm_flush(&vm);
+		if (stopped < 0) {
+			fprintf(stderr, "%s: %04" PRIu32 ": %s\n", path, prog.addrs[vm.iptr], vm.error);
+			return 1;
+		} else if (!stopped) {
+			fprintf(stderr, "%s: %04zu: Never reached\n", path, snapshot_addr);
+			return 1;
+		}
+
+		FILE *f = fopen(snapshot_path, "wb");
+		if (!f) {
+			fprintf(stderr, "%s: %s\n", snapshot_path, strerror(errno));
+			return 1;
+		}
+
+		if (lolvm_snapshot_save(&vm, f) < 0) {
+			fprintf(stderr, "%s: %s\n", snapshot_path, vm.error);
+			ret = 1;
+		}
+
+		fclose(f);
+		lolvm_destroy(&vm);
+		do_run = 0;
+	}
+
+	if (do_step) {
+		struct lolvm vm;
+		if (lolvm_init(&vm, &prog, stack_size, callstack_size) < 0) {
+			printf("%s: Failed to allocate the stack\n", path);
+			return 1;
+		}
+
+		vm.out.binary = do_binary;
+
+		if (restore_path && lolvm_snapshot_restore(&vm, &snap) < 0) {
+			printf("%s: %s\n", restore_path, vm.error);
+			return 1;
+		}
+
+		lolvm_step_manually(&vm);
+		lolvm_destroy(&vm);
+	}
+
+	if (do_run) {
+		struct lolvm vm;
+		if (lolvm_init(&vm, &prog, stack_size, callstack_size) < 0) {
+			printf("%s: Failed to allocate the stack\n", path);
+			return 1;
+		}
+
+		// The VM buffers its output, so stdio would only add a copy
+		fflush(stdout);
+		vm.out.fd = STDOUT_FILENO;
+		vm.out.file = NULL;
+		vm.out.binary = do_binary;
+
+		if (restore_path && lolvm_snapshot_restore(&vm, &snap) < 0) {
+			printf("%s: %s\n", restore_path, vm.error);
+			return 1;
+		}
+
+		if (checked) {
+			if (lolvm_run_checked(&vm) < 0) {
+				lolvm_flush(&vm);
+				fprintf(stderr, "%s: %04" PRIu32 ": %s\n", path, prog.addrs[vm.iptr], vm.error);
+				ret = 1;
+			}
+		} else if (trace_path) {
+			struct lolvm_trace trace;
+			if (lolvm_trace_start(&trace, &vm, trace_path) < 0) {
+				printf("%s: %s\n", trace_path, strerror(errno));
+				return 1;
+			}
+
+			lolvm_run_traced(&vm, &trace);
+			if (lolvm_trace_stop(&trace) < 0) {
+				lolvm_flush(&vm);
+				fprintf(stderr, "%s: Failed to write the trace\n", trace_path);
+				ret = 1;
+			}
+		} else if (do_profile) {
+			struct lolvm_profile prof;
+			if (lolvm_profile_init(&prof, &prog) < 0) {
+				printf("%s: Out of memory\n", path);
+				return 1;
+			}
+
+			lolvm_run_profiled(&vm, &prof);
+			lolvm_flush(&vm);
+			lolvm_profile_print(&prof, stderr);
+			if (folded_path) {
+				FILE *f = fopen(folded_path, "w");
+				if (!f) {
+					fprintf(stderr, "%s: %s\n", folded_path, strerror(errno));
+				} else {
+					lolvm_profile_print_folded(&prof, f);
+					fclose(f);
+				}
+			}
+
+			lolvm_profile_destroy(&prof);
+		} else if (sample_hz > 0) {
+			struct lolvm_sampler sampler;
+			if (lolvm_sampler_start(&sampler, &prog, sample_hz) < 0) {
+				fprintf(stderr, "Sampler: Failed to start, running without it\n");
+				lolvm_run(&vm);
+			} else {
+				lolvm_run_sampled(&vm);
+				lolvm_sampler_stop(&sampler);
+				lolvm_flush(&vm);
+				lolvm_sampler_print(&sampler, stderr);
+				lolvm_sampler_destroy(&sampler);
+			}
+		} else if (do_stats) {
+			struct lolvm_counters counters = {0};
+			lolvm_run_counted(&vm, &counters);
+			lolvm_flush(&vm);
+			fprintf(stderr, "Superinstructions: %zu\n", fused);
+			fprintf(stderr, "Instructions executed: %" PRIu64 "\n", counters.instrs);
+			fprintf(stderr, "Dispatches: %" PRIu64 "\n", counters.dispatches);
+			fprintf(stderr, "Dispatches eliminated: %" PRIu64 " (%.1f%%)\n",
+				counters.instrs - counters.dispatches,
+				counters.instrs ? 100.0 * (counters.instrs - counters.dispatches) / counters.instrs : 0.0);
+			fprintf(stderr, "Heap allocations: %" PRIu64 " (%" PRIu64 " failed)\n",
+				vm.heap.allocs, vm.heap.failed);
+			fprintf(stderr, "Heap frees: %" PRIu64 "\n", vm.heap.frees);
+			fprintf(stderr, "Heap in use: %zu bytes (peak %zu, top at %zu)\n",
+				vm.heap.in_use, vm.heap.peak, vm.heap.top);
+			fprintf(stderr, "Fibers spawned: %" PRIu64 "\n", vm.fibers.spawned);
+			fprintf(stderr, "Fiber switches: %" PRIu64 "\n", vm.fibers.switches);
+		} else if (do_tier) {
+			struct lolvm_tier tier;
+			if (lolvm_tier_init(&tier, &prog, tier_threshold) < 0) {
+				printf("%s: Out of memory\n", path);
+				return 1;
+			}
+
+			if (do_tier_log) {
+				tier.callback = print_tier_event;
+				tier.data = &prog;
+			}
+
+			struct lolvm_jit jit;
+			int have_jit = lolvm_jit_init(&jit, &prog) >= 0;
+			if (have_jit) {
+				tier.jit = &jit;
+			}
+
+			lolvm_run_tiered(&vm, &tier);
+
+			if (have_jit) {
+				lolvm_jit_destroy(&jit);
+			}
+			lolvm_tier_destroy(&tier);
+		} else if (do_jit) {
+			struct lolvm_jit jit;
+			if (lolvm_jit_init(&jit, &prog) < 0) {
+				fprintf(stderr, "JIT: Not available, using the interpreter\n");
+				lolvm_run(&vm);
+			} else {
+				if (lolvm_jit_compile(&jit, 0, prog.count) < 0) {
+					fprintf(stderr, "JIT: Compilation failed, using the interpreter\n");
+				}
+
+				lolvm_run_jit(&vm, &jit);
+				lolvm_jit_destroy(&jit);
+			}
+		} else {
+			lolvm_run(&vm);
+		}
+
+		// Fibers and channels can halt any run loop with an error
+		if (!checked && vm.error) {
+			lolvm_flush(&vm);
+			fprintf(stderr, "%s: %04" PRIu32 ": %s\n", path, prog.addrs[vm.iptr], vm.error);
+			ret = 1;
+		}
+
+		if (lolvm_flush(&vm) < 0) {
+			fprintf(stderr, "%s: Failed to write the output\n", path);
+			ret = 1;
+		}
+
+		lolvm_destroy(&vm);
+	}
+
+	if (restore_path) {
+		lolvm_snapshot_close(&snap);
+	}
+
+	lolvm_program_destroy(&prog);
+	if (bytecode) {
+		munmap(bytecode, size);
+	}
+
+	return ret;
+}
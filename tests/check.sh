@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Compiler tests for Lol.
+#
+#   check.sh <lolvm> <program.lol>...
+#     Compile every program at -O0 and at -O1, each with and without
+#     --fuse-branches, run them, and check that they all print the same
+#     thing as the -O0 build. A program with a .out file next to it must
+#     also print exactly what's in that file.
+#
+# At -O1, values computed ahead of time get their own variables, which
+# can move the variables declared after them, so the stack address
+# dbg-print shows isn't compared.
+
+set -e
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 <lolvm> <program.lol>..." >&2
+	exit 2
+fi
+
+lolvm="$1"
+shift
+compiler="$(dirname "$0")/../lol.raku"
+
+tmp="${TMPDIR:-/tmp}/lolvm-check.$$"
+mkdir -p "$tmp"
+trap 'rm -rf "$tmp"' EXIT
+
+# Run a compiled program, with dbg-print's addresses left out
+run() {
+	"$lolvm" "$1" > "$tmp/raw" || return 1
+	sed 's/^DBG PRINT @-\{0,1\}[0-9]*: /DBG PRINT: /' "$tmp/raw"
+}
+
+status=0
+for prog in "$@"; do
+	expected="${prog%.lol}.out"
+	ref=""
+	failed=0
+	for flags in "-O0" "-O1" "-O0 --fuse-branches" "-O1 --fuse-branches"; do
+		bc="$tmp/prog.bc"
+		out="$tmp/$(echo "$flags" | tr -d ' -').txt"
+		if ! raku "$compiler" $flags "$prog" "$bc" > "$tmp/compile.log" 2>&1; then
+			echo "FAIL $prog ($flags): compile error" >&2
+			cat "$tmp/compile.log" >&2
+			failed=1
+			continue
+		fi
+		if ! run "$bc" > "$out"; then
+			echo "FAIL $prog ($flags): lolvm failed" >&2
+			failed=1
+			continue
+		fi
+
+		if [ -f "$expected" ] && ! cmp -s "$expected" "$out"; then
+			echo "FAIL $prog ($flags): output differs from $expected" >&2
+			diff "$expected" "$out" | head -n 20 >&2
+			failed=1
+		elif [ -z "$ref" ]; then
+			ref="$out"
+		elif ! cmp -s "$ref" "$out"; then
+			echo "FAIL $prog ($flags): output differs from -O0" >&2
+			diff "$ref" "$out" | head -n 20 >&2
+			failed=1
+		fi
+	done
+	if [ "$failed" = 1 ]; then
+		status=1
+	else
+		echo "ok $prog" >&2
+	fi
+done
+
+exit $status